@@ -25,6 +25,15 @@
 #include <linux/hugetlb.h>
 #include <linux/mmu_notifier.h>
 #include <linux/rbtree.h>
+#include <linux/interval_tree_generic.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/rwsem.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+#include <linux/sort.h>
+#include <linux/prefetch.h>
+#include <linux/memory_hotplug.h>
 
 #include <asm/uaccess.h>
 
@@ -48,11 +57,16 @@
 #define	BANKSHOT2_DEFAULT_JOURNAL_SIZE	(4 << 20)
 
 /* PMFS supported data blocks */
-/* Currently only support 4K block */
+/*
+ * Data blocks may be 4K, 16K, 64K or 2M; meta blocks are always 4K.
+ * The type values are stored in i_blk_type, so new sizes go at the end.
+ */
 #define BANKSHOT2_BLOCK_TYPE_4K     0
 #define BANKSHOT2_BLOCK_TYPE_2M     1
 #define BANKSHOT2_BLOCK_TYPE_1G     2
-#define BANKSHOT2_BLOCK_TYPE_MAX    3
+#define BANKSHOT2_BLOCK_TYPE_16K    3
+#define BANKSHOT2_BLOCK_TYPE_64K    4
+#define BANKSHOT2_BLOCK_TYPE_MAX    5
 #define	META_BLK_SHIFT	9
 
 #define	BANKSHOT2_DEFAULT_BLOCK_TYPE BANKSHOT2_BLOCK_TYPE_4K
@@ -60,6 +74,11 @@
 extern unsigned int blk_type_to_shift[BANKSHOT2_BLOCK_TYPE_MAX];
 extern uint32_t blk_type_to_size[BANKSHOT2_BLOCK_TYPE_MAX];
 extern int bio_interception;
+extern int data_block_type;
+extern unsigned long data_block_size;
+extern int alloc_stripes;
+extern int extent_mapping;
+extern unsigned long hash_entries;
 
 /* INODE HINT Start at 3 */
 #define	BANKSHOT2_FREE_INODE_HINT_START	3
@@ -124,6 +143,7 @@ enum timing_category {
 	vfs_cache_fill_read_t,
 	vfs_cache_fill_write_t,
 	vfs_fill_mmap_t,
+	vfs_fill_direct_t,
 	bs_write_t,
 	copy_to_user_t,
 	copy_from_user_t,
@@ -186,6 +206,29 @@ struct hash_inode {
  *    16 byte aligned offset from the start of the inode. We use cmpxchg16b to
  *    update these three fields atomically.
  */
+/* Last leaf a data block lookup went through, see bankshot2_find_leaf() */
+struct bankshot2_btree_cursor {
+	seqcount_t seq;
+	spinlock_t lock;	    /* Serializes cursor updates */
+	u32 gen;		    /* btree_gen the cursor was taken at */
+	u32 leaf_index;		    /* Data blocknr >> META_BLK_SHIFT */
+	u64 leaf;		    /* Leaf node offset, 0 if invalid */
+	u64 parent;		    /* Offset of the leaf's parent, 0 if none */
+};
+
+/*
+ * DRAM copy of the interior levels above the leaves, so a lookup only
+ * touches PM for the leaf entry and the data. Valid only while root and
+ * height match the inode; see bankshot2_mirror_find_leaf().
+ */
+struct bankshot2_btree_mirror {
+	u64 root;		    /* pi->root the copy was taken from */
+	u32 height;		    /* pi->height, 2 or 3 */
+	__le64 *top;		    /* Copy of the root node */
+	__le64 **mid;		    /* Height 3: copies of level 2, lazily */
+	struct rcu_head rcu;
+};
+
 struct bankshot2_inode {
 	/* first 48 bytes */
 	__le16	i_rsvd;         /* reserved. used to be checksum */
@@ -211,7 +254,7 @@ struct bankshot2_inode {
 	__le32	i_atime;            /* Access time */
 	struct inode *inode;	    /* Backing inode */
 	struct rb_root extent_tree; /* Extent tree root */
-	struct rb_root access_tree; /* Extent being accessed */
+	struct rb_root access_tree; /* Ranges locked by reads and writes */
 //	rwlock_t extent_tree_lock;  /* Extent tree lock */
 //	spinlock_t btree_lock;	    /* B-tree lock */	
 	struct mutex tree_lock;     /* Inode mutex */
@@ -219,29 +262,55 @@ struct bankshot2_inode {
 	unsigned long start_index;  /* For btree height increase */	
 	struct list_head lru_list;  /* LRU list for eviction */	
 
-	wait_queue_head_t wait_queue; /* wait queue for access extent */
 	unsigned int num_access_extents;   /* Num of access extents in tree */
+	atomic_t btree_gen;	    /* Bumped when tree nodes may move */
+	struct bankshot2_btree_cursor cursor;
+	struct bankshot2_btree_mirror *mirror;
+	unsigned int free_gen;	    /* Bumped each time the inode is freed */
 //	struct {
 //		__le32 rdev;    /* major/minor # */
 //	} dev;              /* device inode */
 //	__le32 padding;     /* pad to ensure truncate_item starts 8-byte aligned */
 };
 
+struct vma_list {
+	struct vm_area_struct *vma;
+	struct list_head list;
+};
+
+/* An mmap window of a cached file, in the inode's extent tree */
 struct extent_entry {
 	struct rb_node node;
-	u64 ino;
 	off_t offset; // file offset
 	size_t length;
-	int dirty;
+	off_t subtree_last; // Last byte under this node in the extent tree
 	atomic_t access; // Whether we'll access the extent later
 	unsigned long b_offset; // Backing store physical offset
 	struct address_space *mapping;
 	struct list_head vma_list; // list of mapping VMAs
+	/* Most windows are mapped by one process only: its VMA goes here
+	 * and only further ones are allocated from bs2_vma_slab */
+	struct vma_list vma_slot;
 };
 
-struct vma_list {
-	struct vm_area_struct *vma;
-	struct list_head list;
+/* Backing store range of cached file data, in the device physical tree */
+struct phys_extent_entry {
+	struct rb_node node;
+	u64 ino;
+	off_t offset; // file offset
+	size_t length;
+	unsigned long b_offset; // Backing store physical offset
+};
+
+/* A locked file range in an inode's access tree; waiters sleep on it */
+struct bankshot2_range_lock {
+	struct rb_node node;
+	off_t offset;
+	size_t length;
+	off_t subtree_last; /* Last byte locked under this node */
+	bool exclusive;
+	unsigned int excl_waiters; /* Keep new shared holders out */
+	struct list_head waiters;
 };
 
 /* Test purpose only */
@@ -310,6 +379,9 @@ struct bankshot2_super_block {
 	__le64          s_journal_offset;
 	/* points to the location of struct pmfs_inode for the inode table */
 	__le64          s_inode_table_offset;
+	/* points to the block hash index, s_hash_entries long, or 0 */
+	__le64		s_hash_offset;
+	__le64		s_hash_entries;
 
 	__le64  	s_start_dynamic; 
 
@@ -327,12 +399,147 @@ struct bankshot2_super_block {
 	__le32		s_free_inode_hint;
 };
 
+/* A run of free blocks, indexed by address and by size */
 struct bankshot2_blocknode {
-	struct list_head link;
+	struct rb_node addr_node;
+	struct rb_node size_node;
+	unsigned long block_low;
+	unsigned long block_high;
+};
+
+/* Per-CPU cache of free 4K blocks in front of s_lock */
+#define BANKSHOT2_MAGAZINE_SIZE		64
+#define BANKSHOT2_MAGAZINE_BATCH	32
+
+struct bankshot2_magazine {
+	spinlock_t lock;
+	int count;
+	unsigned long blocks[BANKSHOT2_MAGAZINE_SIZE];
+};
+
+/* Per-CPU allocator latency histograms, see struct bankshot2_alloc_stats */
+struct bankshot2_alloc_lat {
+	u64 total_ns[BANKSHOT2_LAT_NUM];
+	u64 max_ns[BANKSHOT2_LAT_NUM];
+	u64 hist[BANKSHOT2_LAT_NUM][BANKSHOT2_HIST_BUCKETS];
+};
+
+/* Data blocks freed by a truncate, handed back to the allocator as sorted,
+ * coalesced runs */
+#define BANKSHOT2_FREE_BATCH_SIZE	512
+
+struct bankshot2_free_batch {
+	unsigned short btype;
+	int count;
+	unsigned long *blocks;
+};
+
+/* A tree node unlinked from a live inode, freed after a grace period.
+ * height > 0 means the whole subtree below it goes, btype data blocks
+ * and all, and they come off pi's i_blocks as it is freed. */
+struct bankshot2_deferred_free {
+	struct rcu_head rcu;
+	struct list_head list;
+	struct bankshot2_device *bs2_dev;
+	unsigned long blocknr;
+	u32 height;
+	u32 btype;
+	struct bankshot2_inode *pi;
+	unsigned int free_gen;	/* pi->free_gen when it was unlinked */
+};
+
+/* A run of physically contiguous 4K cache pages backing consecutive file
+ * blocks. block is 0 for a hole. */
+struct bankshot2_block_run {
+	u64 block;
+	unsigned long num;
+};
+
+#define BANKSHOT2_LOOKUP_RUNS	16
+/* Cache lines at the head of the next run to prefetch while copying one */
+#define BANKSHOT2_PREFETCH_LINES	4
+
+/* Walks a file range page by page, or run by run, refilling runs with one
+ * B-tree descent per leaf instead of one per page */
+struct bankshot2_block_iter {
+	struct bankshot2_inode *pi;
+	unsigned long next;	/* First file block not yet looked up */
+	unsigned long end;
+	int nr_runs;
+	int run;
+	unsigned long off;	/* Pages of runs[run] already returned */
+	struct bankshot2_block_run runs[BANKSHOT2_LOOKUP_RUNS];
+};
+
+/*
+ * Extent-mapped inodes (BANKSHOT2_EXTMAP_FL) replace the block tree with a
+ * tree of 4K nodes: leaves map len data blocks starting at file block
+ * block to the PM offset start, index entries point start at the child
+ * covering file blocks from block on. Both fill one 16 byte entry.
+ */
+#define BANKSHOT2_EXTMAP_FL		0x00080000	/* as FS_EXTENT_FL */
+#define BANKSHOT2_EXTMAP_MAGIC		0xb5e7
+#define BANKSHOT2_EXTMAP_MAX_DEPTH	2
+
+struct bankshot2_extmap_header {
+	__le16	eh_magic;
+	__le16	eh_entries;	/* Entries in use */
+	__le16	eh_depth;	/* 0 for a leaf */
+	__le16	eh_rsvd;
+	__le64	eh_rsvd2;
+};
+
+struct bankshot2_extmap_entry {
+	__le32	block;		/* First file block, in data blocks */
+	__le32	len;		/* Data blocks mapped; unused in index nodes */
+	__le64	start;		/* PM offset of the data or the child node */
+};
+
+#define BANKSHOT2_EXTMAP_ENTRIES \
+	((PAGE_SIZE - sizeof(struct bankshot2_extmap_header)) / \
+	 sizeof(struct bankshot2_extmap_entry))
+/* File blocks beyond this don't fit the 32 bit block field */
+#define BANKSHOT2_EXTMAP_MAX_BLOCK	0xffffffffUL
+
+/*
+ * PM hash index from (backing inode, data block) to the cache block, sized
+ * by hash_entries at format time. key packs the 32 bit backing inode
+ * number over the 32 bit data block index; 0 is an empty slot and all ones
+ * a deleted one. A key is only looked for in the BANKSHOT2_HASH_PROBE
+ * slots from its hash, so a miss costs the same however full the table.
+ */
+struct bankshot2_hash_entry {
+	__le64	key;
+	__le64	block;		/* PM offset of the data block */
+};
+
+#define BANKSHOT2_HASH_EMPTY		0ULL
+#define BANKSHOT2_HASH_DELETED		(~0ULL)
+#define BANKSHOT2_HASH_PROBE		16
+/* Iterator ranges up to this many pages try the index first */
+#define BANKSHOT2_HASH_MAX_PAGES	8
+
+/*
+ * Placement domain: a 2MB aligned slice of the cache backed by one NUMA
+ * node (and, with alloc_stripes > 1, one stripe of that node's range).
+ * Each domain keeps its own free trees; runs never span domains.
+ */
+#define BANKSHOT2_MAX_DOMAINS	64
+
+struct bankshot2_domain {
 	unsigned long block_low;
 	unsigned long block_high;
+	int nid;
+	unsigned long num_free; /* Blocks in the free trees, under s_lock */
+	struct rb_root block_free_tree; /* Free runs by address */
+	struct rb_root block_free_size_tree; /* Free runs by size */
 };
 
+/* Pool of pre-zeroed 4K blocks, refilled by the zeroing thread */
+#define BANKSHOT2_ZERO_POOL_SIZE	1024
+#define BANKSHOT2_ZERO_POOL_LOW		256
+#define BANKSHOT2_ZERO_POOL_BATCH	32
+
 /* job part */
 
 #define STATUS(flag)	((uint8_t)(1 << flag))
@@ -411,14 +618,31 @@ struct bankshot2_device {
 	unsigned long size;
 	unsigned long block_start;
 	unsigned long block_end;
-	unsigned long num_free_blocks;
+	struct percpu_counter num_free_blocks; /* Approx, incl. magazines/pool */
 	unsigned long num_blocknode_allocated;
 	kuid_t	uid;
 	kgid_t	gid;
 	umode_t	mode;
-	struct list_head block_inuse_head;
+	struct bankshot2_domain domains[BANKSHOT2_MAX_DOMAINS];
+	int num_domains;
+	atomic_t domain_rotor; /* Next local stripe to allocate from */
 	struct mutex s_lock;
-	struct mutex alloc_lock;
+	struct bankshot2_magazine __percpu *magazines;
+	struct bankshot2_alloc_lat __percpu *alloc_lat;
+	struct rw_semaphore alloc_lock;
+	spinlock_t zero_pool_lock;
+	unsigned long *zero_pool; /* Stack of zeroed 4K blocks */
+	int zero_pool_count;
+	int zero_pool_wanted;
+	struct task_struct *zero_thread;
+	wait_queue_head_t zero_wait;
+	spinlock_t deferred_lock;
+	struct list_head deferred_list; /* Past their grace period */
+	unsigned long deferred_subtrees; /* Detached, not freed yet */
+	struct bankshot2_hash_entry *hash_table; /* NULL without an index */
+	unsigned int hash_bits;
+	spinlock_t hash_lock; /* Serializes index updates */
+	unsigned long hash_dropped; /* Keys that found no slot */
 	struct mutex inode_table_mutex;
 	unsigned int	s_inodes_count;  /* total inodes count (used or free) */
 	unsigned int	s_free_inodes_count;    /* free inodes count */
@@ -452,6 +676,8 @@ struct bankshot2_device {
 	uint64_t bs_sects;
 
 	struct kmem_cache *bs2_extent_slab;
+	struct kmem_cache *bs2_phys_extent_slab;
+	struct kmem_cache *bs2_vma_slab;
 
 	/* Journaling related structures */
 	struct kmem_cache *bs2_transaction_slab;
@@ -477,6 +703,12 @@ struct bankshot2_device {
 	u64 num_bio;
 	u64 total_bio_size;
 	int mmap_hit;
+	u64 zero_pool_hit;
+	u64 zero_pool_miss;
+	struct percpu_counter cursor_hit;
+	struct percpu_counter cursor_miss;
+	struct percpu_counter hash_hit;
+	struct percpu_counter hash_miss;
 
 	struct hash_inode *inode_hash_array;
 };
@@ -485,9 +717,6 @@ extern struct bankshot2_device *bs2_dev;
 
 /* ========================= Methods =================================== */
 
-extern unsigned int blk_type_to_shift[3];
-extern uint32_t blk_type_to_size[3];
-
 static inline unsigned int
 bankshot2_inode_blk_shift (struct bankshot2_inode *pi)
 {
@@ -536,20 +765,59 @@ bankshot2_get_block_off(struct bankshot2_device *bs2_dev,
 static inline unsigned long
 bankshot2_get_numblocks(unsigned short btype)
 {
-//	unsigned long num_blocks;
+	unsigned long num_blocks;
 
-/*
-	if (btype == PMFS_BLOCK_TYPE_4K) {
+	if (btype == BANKSHOT2_BLOCK_TYPE_4K) {
 		num_blocks = 1;
-	} else if (btype == PMFS_BLOCK_TYPE_2M) {
+	} else if (btype == BANKSHOT2_BLOCK_TYPE_16K) {
+		num_blocks = 4;
+	} else if (btype == BANKSHOT2_BLOCK_TYPE_64K) {
+		num_blocks = 16;
+	} else if (btype == BANKSHOT2_BLOCK_TYPE_2M) {
 		num_blocks = 512;
 	} else {
-		//btype == PMFS_BLOCK_TYPE_1G 
+		//btype == BANKSHOT2_BLOCK_TYPE_1G
 		num_blocks = 0x40000;
 	}
 	return num_blocks;
-*/
-	return 1;
+}
+
+/* Block types cache inodes can use for data; 1G blocks are not supported */
+static inline bool bankshot2_data_blk_type_ok(int btype)
+{
+	return btype >= 0 && btype < BANKSHOT2_BLOCK_TYPE_MAX &&
+		btype != BANKSHOT2_BLOCK_TYPE_1G;
+}
+
+/* Data block type for a block size in bytes, or -EINVAL */
+static inline int bankshot2_data_blk_size_to_type(unsigned long size)
+{
+	int btype;
+
+	for (btype = 0; btype < BANKSHOT2_BLOCK_TYPE_MAX; btype++)
+		if (bankshot2_data_blk_type_ok(btype) &&
+				blk_type_to_size[btype] == size)
+			return btype;
+	return -EINVAL;
+}
+
+/* Cheap estimate, good enough for eviction decisions. Blocks cached in the
+ * per-CPU magazines and the zeroed pool count as free. */
+static inline unsigned long
+bankshot2_count_free_blocks(struct bankshot2_device *bs2_dev)
+{
+	return percpu_counter_read_positive(&bs2_dev->num_free_blocks);
+}
+
+/*
+ * i_blocks also drops from the zeroing thread as evicted subtrees are
+ * freed, outside the inode's tree_lock, so every update is atomic. The
+ * field is little endian like the CPUs we run on.
+ */
+static inline void bankshot2_add_iblocks(struct bankshot2_inode *pi,
+		long delta)
+{
+	atomic64_add(delta, (atomic64_t *)&pi->i_blocks);
 }
 
 static inline unsigned long bankshot2_get_pfn(struct bankshot2_device *bs2_dev,
@@ -633,6 +901,39 @@ static inline u64 __bankshot2_find_data_block_verbose(
 	return bp;
 }
 
+/*
+ * Invalidate lookup cursors. Call before relinking tree nodes, and again
+ * once they are unlinked but before they are freed: a lookup that saw the
+ * first bump can still have walked into them and cached one.
+ */
+static inline void bankshot2_btree_changed(struct bankshot2_inode *pi)
+{
+	/* Unlinks are visible to whoever reads the new gen */
+	smp_wmb();
+	atomic_inc(&pi->btree_gen);
+}
+
+/* Root and height as one bankshot2_publish_root() left them. Lockless
+ * lookups take this inside rcu_read_lock() and walk from it. */
+static inline u32 bankshot2_read_root(struct bankshot2_inode *pi, u64 *root)
+{
+	unsigned int seq;
+	u32 height;
+
+	do {
+		seq = read_seqcount_begin(&pi->cursor.seq);
+		height = pi->height;
+		*root = le64_to_cpu(pi->root);
+	} while (read_seqcount_retry(&pi->cursor.seq, seq));
+
+	return height;
+}
+
+static inline bool bankshot2_is_extmap(struct bankshot2_inode *pi)
+{
+	return le32_to_cpu(pi->i_flags) & BANKSHOT2_EXTMAP_FL;
+}
+
 static inline unsigned long bankshot2_get_blocknr(u64 block)
 {
 	return block >> PAGE_SHIFT;
@@ -743,6 +1044,9 @@ int bankshot2_copy_to_cache(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, struct bankshot2_cache_data *data,
 		u64 pos, size_t count, u64 b_offset, char *void_array,
 		unsigned long required, int read); 
+void bankshot2_zero_unfilled_pages(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, u64 pos, char *void_array,
+		unsigned long start, size_t nr_pages, char flag);
 int bankshot2_copy_from_cache(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, struct bankshot2_cache_data *data,
 		u64 pos, size_t count, u64 b_offset, char *void_array,
@@ -758,22 +1062,48 @@ void bankshot2_destroy_block(struct bankshot2_device *);
 /* bankshot2_mem.c */
 int bankshot2_init_kmem(struct bankshot2_device *);
 void bankshot2_destroy_kmem(struct bankshot2_device *);
+void bankshot2_init_domains(struct bankshot2_device *bs2_dev);
 int bankshot2_init_blockmap(struct bankshot2_device *, unsigned long);
 int __bankshot2_alloc_blocks(bankshot2_transaction_t *trans,
 	struct bankshot2_device *bs2_dev, struct bankshot2_inode *pi,
-	unsigned long file_blocknr, unsigned int num, bool zero);
+	unsigned long file_blocknr, unsigned int num, bool zero,
+	const char *written);
 int bankshot2_alloc_blocks(bankshot2_transaction_t *trans,
 		struct bankshot2_device *bs2_dev, struct bankshot2_inode *pi,
-		unsigned long file_blocknr, unsigned int num, bool zero);
+		unsigned long file_blocknr, unsigned int num, bool zero,
+		const char *written);
 int bankshot2_new_block(struct bankshot2_device *bs2_dev,
 		unsigned long *blocknr, unsigned short btype, int zero);
+int bankshot2_new_blocks(struct bankshot2_device *bs2_dev,
+		unsigned long *blocknr, unsigned long *num, unsigned short btype,
+		int zero);
 void bankshot2_free_block(struct bankshot2_device *bs2_dev,
 		unsigned long blocknr, unsigned short btype);
+void bankshot2_init_free_batch(struct bankshot2_free_batch *batch,
+		unsigned short btype);
+void bankshot2_free_batch_add(struct bankshot2_device *bs2_dev,
+		struct bankshot2_free_batch *batch, unsigned long blocknr);
+void bankshot2_finish_free_batch(struct bankshot2_device *bs2_dev,
+		struct bankshot2_free_batch *batch);
+void bankshot2_free_meta_block(struct bankshot2_device *bs2_dev,
+		unsigned long blocknr);
+void bankshot2_free_deferred_blocks(struct bankshot2_device *bs2_dev);
+bool bankshot2_reclaim_deferred(struct bankshot2_device *bs2_dev);
+void bankshot2_publish_root(struct bankshot2_inode *pi, __le64 root,
+		u32 height);
+void bankshot2_get_alloc_stats(struct bankshot2_device *bs2_dev,
+		struct bankshot2_alloc_stats *stats);
+void bankshot2_clear_alloc_stats(struct bankshot2_device *bs2_dev);
+void bankshot2_wakeup_zero_thread(struct bankshot2_device *bs2_dev);
+int bankshot2_zero_thread_run(struct bankshot2_device *bs2_dev);
+void bankshot2_zero_thread_stop(struct bankshot2_device *bs2_dev);
 void bankshot2_truncate_blocks(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, off_t start, off_t end);
 int recursive_truncate_blocks(struct bankshot2_device *bs2_dev, __le64 block,
 		u32 height, u32 btype, unsigned long first_blocknr,
-		unsigned long last_blocknr, bool *meta_empty);
+		unsigned long last_blocknr, bool *meta_empty,
+		struct bankshot2_free_batch *batch,
+		struct bankshot2_inode *pi, int mi);
 
 /* bankshot2_inode.c */
 int bankshot2_init_inode_table(struct bankshot2_device *);
@@ -783,6 +1113,25 @@ u64 bankshot2_find_data_block(struct bankshot2_device *bs2_dev,
 			struct bankshot2_inode *pi, unsigned long file_blocknr);
 u64 bankshot2_find_data_block_verbose(struct bankshot2_device *bs2_dev,
 			struct bankshot2_inode *pi, unsigned long file_blocknr);
+void bankshot2_mirror_set(struct bankshot2_inode *pi, u32 height, int mi,
+		unsigned int index, __le64 val);
+void bankshot2_mirror_clear(struct bankshot2_inode *pi, u32 height, int mi,
+		unsigned int start, unsigned int end);
+void bankshot2_drop_btree_mirror(struct bankshot2_inode *pi);
+int bankshot2_find_data_blocks(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long file_blocknr,
+		unsigned long num, struct bankshot2_block_run *runs,
+		int max_runs);
+void bankshot2_block_iter_init(struct bankshot2_block_iter *iter,
+		struct bankshot2_inode *pi, unsigned long file_blocknr,
+		unsigned long num);
+u64 bankshot2_block_iter_next(struct bankshot2_device *bs2_dev,
+		struct bankshot2_block_iter *iter);
+u64 bankshot2_block_iter_next_run(struct bankshot2_device *bs2_dev,
+		struct bankshot2_block_iter *iter, unsigned long max,
+		unsigned long *num);
+void bankshot2_block_iter_prefetch(struct bankshot2_device *bs2_dev,
+		struct bankshot2_block_iter *iter, int write);
 struct bankshot2_inode *
 bankshot2_find_cache_inode(struct bankshot2_device *bs2_dev,
 		struct bankshot2_cache_data *data, u64 *st_ino);
@@ -800,6 +1149,33 @@ int bankshot2_ioctl_evict_cache_inode(struct bankshot2_device *bs2_dev,
 int bankshot2_get_backing_inode(struct bankshot2_device *bs2_dev,
 					void *arg, struct inode **st_inode);
 
+/* bankshot2_extmap.c */
+u64 bankshot2_extmap_lookup(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long blocknr,
+		unsigned long *len);
+int bankshot2_extmap_insert(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long block,
+		unsigned long len, u64 start);
+unsigned long bankshot2_extmap_truncate(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long first_blocknr,
+		unsigned long last_blocknr);
+unsigned long bankshot2_extmap_free_tree(struct bankshot2_device *bs2_dev,
+		u64 root, unsigned short btype);
+
+/* bankshot2_hash.c */
+unsigned long bankshot2_hash_index_size(unsigned long entries);
+void bankshot2_init_hash_index(struct bankshot2_device *bs2_dev,
+		u64 offset, unsigned long entries);
+void bankshot2_clear_hash_index(struct bankshot2_device *bs2_dev);
+u64 bankshot2_hash_lookup(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long file_blocknr);
+void bankshot2_hash_insert_range(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long file_blocknr,
+		unsigned long num);
+void bankshot2_hash_remove_range(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long file_blocknr,
+		unsigned long num);
+
 /* bankshot2_super.c */
 int bankshot2_init_super(struct bankshot2_device *,
 				unsigned long, unsigned long);
@@ -826,6 +1202,8 @@ int bankshot2_fsync_to_cache(struct bankshot2_device *bs2_dev,
 /* bankshot2_extent.c */
 struct extent_entry * bankshot2_find_extent(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, off_t offset);
+void bankshot2_remove_vma(struct bankshot2_device *bs2_dev,
+		struct extent_entry *extent, struct vma_list *entry);
 void bankshot2_clear_extent_access(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, unsigned long index);
 int bankshot2_add_extent(struct bankshot2_device *bs2_dev,
@@ -855,19 +1233,18 @@ int bankshot2_update_physical_tree(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, struct bankshot2_cache_data *data,
 		u64 offset, size_t length, char *alloc_array,
 		unsigned long unallocated);
-struct extent_entry * bankshot2_find_physical_extent(
+struct phys_extent_entry * bankshot2_find_physical_extent(
 		struct bankshot2_device *bs2_dev, off_t b_offset);
 int bankshot2_insert_physical_tree(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, u64 extent_offset,
 		size_t extent_length, u64 b_offset);
 void bankshot2_destroy_physical_tree(struct bankshot2_device *bs2_dev);
 void bankshot2_print_physical_tree(struct bankshot2_device *bs2_dev);
-int bankshot2_extent_being_accessed(struct bankshot2_device *bs2_dev,
-		struct bankshot2_inode *pi, off_t pos, size_t count);
-int bankshot2_insert_access_extent(struct bankshot2_device *bs2_dev,
-		struct bankshot2_inode *pi, off_t pos, size_t count);
-void bankshot2_remove_access_extent(struct bankshot2_device *bs2_dev,
-		struct bankshot2_inode *pi, off_t pos, size_t count);
+void bankshot2_lock_range(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, struct bankshot2_range_lock *range,
+		off_t pos, size_t count, bool exclusive);
+void bankshot2_unlock_range(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, struct bankshot2_range_lock *range);
 void bankshot2_print_access_tree(struct bankshot2_device *bs2_dev,
 				struct bankshot2_inode *pi);
 
@@ -876,6 +1253,8 @@ void bankshot2_munmap_extent(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, struct extent_entry *extent);
 int bankshot2_ioctl_remove_mappings(struct bankshot2_device *bs2_dev,
 			void *arg);
+bool bankshot2_mmap_hit(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, struct bankshot2_cache_data *data);
 int bankshot2_mmap_extent(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, struct bankshot2_cache_data *data,
 		struct extent_entry **access_extent, int *mmaped);
@@ -883,6 +1262,7 @@ int bankshot2_mmap_extent(struct bankshot2_device *bs2_dev,
 /* bankshot2_stats.c */
 void bankshot2_print_time_stats(struct bankshot2_device *bs2_dev);
 void bankshot2_print_io_stats(struct bankshot2_device *bs2_dev);
+void bankshot2_print_alloc_stats(struct bankshot2_device *bs2_dev);
 void bankshot2_clear_stats(struct bankshot2_device *bs2_dev);
 
 /* bankshot2_journal.c */
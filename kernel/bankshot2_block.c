@@ -43,9 +43,10 @@ void bankshot2_make_cache_request(struct request_queue *q, struct bio *bio)
 {
 	struct bankshot2_device *bs2_dev;
 	struct bankshot2_inode *pi;
-	struct extent_entry *extent;
+	struct phys_extent_entry *extent;
 	size_t size;
 	struct bio_vec *bvec;
+	struct bankshot2_block_iter iter;
 	u64 b_offset;
 	u64 block;
 	void *xmem;
@@ -98,8 +99,11 @@ void bankshot2_make_cache_request(struct request_queue *q, struct bio *bio)
 
 		bs2_dbg("Found: pi %llu, offset 0x%lx, length %lu\n",
 			extent->ino, index << bs2_dev->s_blocksize_bits, size);
+		bankshot2_block_iter_init(&iter, pi, index,
+			((extent->offset + extent->length) >>
+			 bs2_dev->s_blocksize_bits) - index);
 		bio_for_each_segment(bvec, bio, i) {
-			block = bankshot2_find_data_block(bs2_dev, pi, index);
+			block = bankshot2_block_iter_next(bs2_dev, &iter);
 			if (!block) {
 				bs2_info("Transfer to cache failed\n");
 				break;
@@ -61,6 +61,33 @@ struct bankshot2_cache_data{
 	/* -=-=-= End Match Requirement -=-=-= */
 };
 
+/* Allocator latency classes */
+#define BANKSHOT2_LAT_ALLOC	0	/* bankshot2_new_block(s) */
+#define BANKSHOT2_LAT_FREE	1	/* bankshot2_free_block */
+#define BANKSHOT2_LAT_LOCK_WAIT	2	/* Waiting for the allocator lock */
+#define BANKSHOT2_LAT_NUM	3
+
+#define BANKSHOT2_HIST_BUCKETS	32
+
+/*
+ * Allocator statistics, returned by BANKSHOT2_IOCTL_GET_ALLOC_STATS.
+ * free_run_hist[i] counts free runs of [2^i, 2^(i+1)) 4K blocks.
+ * lat_hist[c][i] counts class c samples that took [2^(i-1), 2^i) ns;
+ * bucket 0 of BANKSHOT2_LAT_LOCK_WAIT counts uncontended acquisitions.
+ * Alloc/free latencies are only sampled when measure_timing is set.
+ */
+struct bankshot2_alloc_stats {
+	uint64_t total_blocks;
+	uint64_t free_blocks;	/* Including per-CPU magazines and zero pool */
+	uint64_t free_runs;	/* Runs in the free trees */
+	uint64_t largest_free_run;
+	uint64_t free_run_hist[BANKSHOT2_HIST_BUCKETS];
+	uint64_t lat_count[BANKSHOT2_LAT_NUM];
+	uint64_t lat_total_ns[BANKSHOT2_LAT_NUM];
+	uint64_t lat_max_ns[BANKSHOT2_LAT_NUM];
+	uint64_t lat_hist[BANKSHOT2_LAT_NUM][BANKSHOT2_HIST_BUCKETS];
+};
+
 /* ioctls */
 #define BANKSHOT2_IOCTL_CACHE_DATA	0xBCD00000
 #define BANKSHOT2_IOCTL_SHOW_INODE_INFO	0xBCD00001
@@ -78,3 +105,4 @@ struct bankshot2_cache_data{
 #define BANKSHOT2_IOCTL_FSYNC_TO_BS	0xBCD0000D
 #define BANKSHOT2_IOCTL_FSYNC_TO_CACHE	0xBCD0000E
 #define BANKSHOT2_IOCTL_EVICT_INODE	0xBCD0000F
+#define BANKSHOT2_IOCTL_GET_ALLOC_STATS	0xBCD00010
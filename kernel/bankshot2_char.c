@@ -235,6 +235,24 @@ out:
 	return 0;
 }
 
+static int bankshot2_ioctl_get_alloc_stats(struct bankshot2_device *bs2_dev,
+		void *arg)
+{
+	struct bankshot2_alloc_stats *stats;
+	int ret = 0;
+
+	stats = kmalloc(sizeof(struct bankshot2_alloc_stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+
+	bankshot2_get_alloc_stats(bs2_dev, stats);
+	if (copy_to_user(arg, stats, sizeof(struct bankshot2_alloc_stats)))
+		ret = -EFAULT;
+
+	kfree(stats);
+	return ret;
+}
+
 static int bankshot2_ioctl_fsync_to_bs(struct bankshot2_device *bs2_dev,
 		void *arg)
 {
@@ -347,6 +365,9 @@ long bankshot2_char_ioctl(struct file *filp, unsigned int cmd,
 	case BANKSHOT2_IOCTL_EVICT_INODE:
 		ret = bankshot2_ioctl_evict_cache_inode(bs2_dev, (void *)arg);
 		break;
+	case BANKSHOT2_IOCTL_GET_ALLOC_STATS:
+		ret = bankshot2_ioctl_get_alloc_stats(bs2_dev, (void *)arg);
+		break;
 	default:
 		break;
 	}
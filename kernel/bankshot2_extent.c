@@ -3,37 +3,25 @@
 
 /* ========================== Extent Tree ============================= */
 
-static inline int bankshot2_rbtree_compare(struct extent_entry *curr,
-		struct extent_entry *new)
-{
-	if (new->offset < curr->offset) return -1;
-	if (new->offset > curr->offset) return 1;
-
-	return 0;
-}
-
-static inline int bankshot2_rbtree_compare_find(struct extent_entry *curr,
-		off_t offset)
-{
-	if ((curr->offset <= offset) &&
-			(curr->offset + curr->length > offset))
-		return 0;
-
-	if (offset < curr->offset) return -1;
-	if (offset > curr->offset) return 1;
-
-	return 0;
-}
+/*
+ * The extent tree and the access tree are interval trees keyed by start
+ * offset. Each node also caches the last byte covered by its subtree, so
+ * that overlap lookups skip whole subtrees ending before the range.
+ */
+#define BANKSHOT2_RANGE_START(r)	((r)->offset)
+#define BANKSHOT2_RANGE_LAST(r)		((r)->offset + (r)->length - 1)
+
+INTERVAL_TREE_DEFINE(struct extent_entry, node, off_t, subtree_last,
+		BANKSHOT2_RANGE_START, BANKSHOT2_RANGE_LAST, static inline,
+		bankshot2_extent_it)
 
 void bankshot2_free_extent(struct bankshot2_device *bs2_dev,
 		struct extent_entry *extent)
 {
 	struct vma_list *next, *delete;
 
-	list_for_each_entry_safe(delete, next, &extent->vma_list, list) {
-		list_del(&delete->list);
-		kfree(delete);
-	}
+	list_for_each_entry_safe(delete, next, &extent->vma_list, list)
+		bankshot2_remove_vma(bs2_dev, extent, delete);
 
 	kmem_cache_free(bs2_dev->bs2_extent_slab, extent);
 }
@@ -41,128 +29,81 @@ void bankshot2_free_extent(struct bankshot2_device *bs2_dev,
 struct extent_entry * bankshot2_find_extent(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, off_t offset)
 {
-	struct extent_entry *curr;
-	struct rb_node *temp;
-	int compVal;
-
-//	read_lock(&pi->extent_tree_lock);
-	temp = pi->extent_tree.rb_node;
-	while (temp) {
-		curr = container_of(temp, struct extent_entry, node);
-		compVal = bankshot2_rbtree_compare_find(curr, offset);
-
-		if (compVal == -1) {
-			temp = temp->rb_left;
-		} else if (compVal == 1) {
-			temp = temp->rb_right;
-		} else {
-//			extent->offset = curr->offset;
-//			extent->length = curr->length;
-//			extent->dirty = curr->dirty;
-//			extent->mmap_addr = curr->mmap_addr;
-//			read_unlock(&pi->extent_tree_lock);
-
-			return curr;
-		}
-	}
-
-//	read_unlock(&pi->extent_tree_lock);
-	return NULL;
+	return bankshot2_extent_it_iter_first(&pi->extent_tree, offset, offset);
 }
 
 void bankshot2_clear_extent_access(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, unsigned long index)
 {
 	struct extent_entry *curr;
-	off_t offset;
-	struct rb_node *temp;
-	int compVal;
-
-	offset = index << bs2_dev->s_blocksize_bits;
 
-//	read_lock(&pi->extent_tree_lock);
-	temp = pi->extent_tree.rb_node;
-	while (temp) {
-		curr = container_of(temp, struct extent_entry, node);
-		compVal = bankshot2_rbtree_compare_find(curr, offset);
+	curr = bankshot2_find_extent(bs2_dev, pi,
+					index << bs2_dev->s_blocksize_bits);
+	if (!curr)
+		return;
 
-		if (compVal == -1) {
-			temp = temp->rb_left;
-		} else if (compVal == 1) {
-			temp = temp->rb_right;
-		} else {
-			bs2_dbg("Clear pi %llu, extent offset 0x%lx access\n",
-				pi->i_ino, curr->offset);
-			atomic_set(&curr->access, 0);
-//			read_unlock(&pi->extent_tree_lock);
-			return;
-		}
-	}
-
-//	read_unlock(&pi->extent_tree_lock);
-	return;
+	bs2_dbg("Clear pi %llu, extent offset 0x%lx access\n",
+		pi->i_ino, curr->offset);
+	atomic_set(&curr->access, 0);
 }
 
 void bankshot2_remove_extent(struct bankshot2_device *bs2_dev,
 			struct bankshot2_inode *pi, off_t offset)
 {
 	struct extent_entry *curr;
-	struct rb_node *temp;
-	int compVal;
 
-//	write_lock(&pi->extent_tree_lock);
-	temp = pi->extent_tree.rb_node;
-	while (temp) {
-		curr = container_of(temp, struct extent_entry, node);
-		compVal = bankshot2_rbtree_compare_find(curr, offset);
-
-		if (compVal == -1) {
-			temp = temp->rb_left;
-		} else if (compVal == 1) {
-			temp = temp->rb_right;
-		} else {
-			bs2_dbg("Delete extent to pi %llu, extent offset %lu, "
-				"length %lu\n",
-				pi->i_ino, curr->offset, curr->length);
-			rb_erase(&curr->node, &pi->extent_tree);
-			pi->num_extents--;
-			bankshot2_free_extent(bs2_dev, curr);
-			break;
-		}
-	}
+	curr = bankshot2_find_extent(bs2_dev, pi, offset);
+	if (!curr)
+		return;
 
-//	write_unlock(&pi->extent_tree_lock);
-	return;
+	bs2_dbg("Delete extent to pi %llu, extent offset %lu, length %lu\n",
+		pi->i_ino, curr->offset, curr->length);
+	bankshot2_extent_it_remove(curr, &pi->extent_tree);
+	pi->num_extents--;
+	bankshot2_free_extent(bs2_dev, curr);
 }
 
-/* Use an list to store the vmas */
-static void bankshot2_insert_vma(struct bankshot2_device *bs2_dev,
+/*
+ * Use an list to store the vmas. The first one takes the slot inside the
+ * extent, so only windows shared between processes allocate.
+ */
+static int bankshot2_insert_vma(struct bankshot2_device *bs2_dev,
 		struct extent_entry *extent, struct vm_area_struct *vma)
 {
 	struct vma_list *inserted_vma, *new_vma;
 
+	if (!vma)
+		return 0;
+
 	list_for_each_entry(inserted_vma, &extent->vma_list, list) {
 		if (inserted_vma->vma == vma)
-			return;
+			return 0;
 	}
 
-	new_vma = kzalloc(sizeof(struct vma_list), GFP_ATOMIC);
-	BUG_ON(!new_vma);
+	if (!extent->vma_slot.vma) {
+		new_vma = &extent->vma_slot;
+	} else {
+		new_vma = kmem_cache_alloc(bs2_dev->bs2_vma_slab, GFP_KERNEL);
+		if (!new_vma)
+			return -ENOMEM;
+	}
 
 	new_vma->vma = vma;
-	INIT_LIST_HEAD(&new_vma->list);
 	list_add_tail(&new_vma->list, &extent->vma_list);
-#if 0
-	bs2_info("Extent offset 0x%lx, length 0x%lx VMAs:\n", extent->offset, extent->length);
-	list_for_each_entry(temp, &extent->vma_list, list) {
-		bs2_info("Vma: start %lx, pgoff %lx, end %lx, mm %p\n",
-		temp->vma->vm_start, temp->vma->vm_pgoff, temp->vma->vm_end, temp->vma->vm_mm);
-	}
-#endif
-	return;
+	return 0;
 }
 
-static void bankshot2_initialize_new_extent(struct bankshot2_device *bs2_dev,
+void bankshot2_remove_vma(struct bankshot2_device *bs2_dev,
+		struct extent_entry *extent, struct vma_list *entry)
+{
+	list_del(&entry->list);
+	if (entry == &extent->vma_slot)
+		entry->vma = NULL;
+	else
+		kmem_cache_free(bs2_dev->bs2_vma_slab, entry);
+}
+
+static int bankshot2_initialize_new_extent(struct bankshot2_device *bs2_dev,
 		struct extent_entry *new, off_t offset, size_t length,
 		unsigned long b_offset, struct address_space *mapping,
 		struct vm_area_struct *vma)
@@ -170,11 +111,11 @@ static void bankshot2_initialize_new_extent(struct bankshot2_device *bs2_dev,
 	new->offset = offset;
 	new->length = length;
 	new->b_offset = b_offset;
-	new->dirty = 1; //FIXME: assume all extents are dirty
 	new->mapping = mapping;
 
 	INIT_LIST_HEAD(&new->vma_list);
-	bankshot2_insert_vma(bs2_dev, new, vma);
+	new->vma_slot.vma = NULL;
+	return bankshot2_insert_vma(bs2_dev, new, vma);
 }
 
 int bankshot2_add_extent(struct bankshot2_device *bs2_dev,
@@ -183,13 +124,9 @@ int bankshot2_add_extent(struct bankshot2_device *bs2_dev,
 		struct vm_area_struct *vma,
 		struct extent_entry **access_extent)
 {
-	struct extent_entry *curr, *new, *next;
-	struct rb_node **temp, *parent, *next_node;
-	off_t extent_offset;
-	size_t extent_length;
-	unsigned long extent_b_offset;
-	int compVal;
-	int no_new = 0;
+	struct extent_entry *curr, *new;
+	off_t last;
+	int ret;
 
 	bs2_dbg("Insert extent to pi %llu, extent offset %lx, "
 			"length %lu,  b_offset %lx\n",
@@ -203,91 +140,76 @@ int bankshot2_add_extent(struct bankshot2_device *bs2_dev,
 		return 0;
 	}
 
-//	write_lock(&pi->extent_tree_lock);
-	temp = &(pi->extent_tree.rb_node);
-	parent = NULL;
-
-	extent_offset = offset;
-	extent_b_offset = b_offset;
-	extent_length = length;
-
-	while (*temp) {
-		curr = container_of(*temp, struct extent_entry, node);
-		compVal = bankshot2_rbtree_compare_find(curr,
-					extent_offset);
-		parent = *temp;
-
-		if (compVal == -1) {
-			temp = &((*temp)->rb_left);
-		} else if (compVal == 1) {
-			temp = &((*temp)->rb_right);
-		} else {
-			if (curr->offset != extent_offset
-					|| curr->length > extent_length
-					|| curr->b_offset != extent_b_offset
-					|| curr->mapping != mapping) {
-				bs2_info("Existing extent hit but unmatch! "
-					"existing extent offset 0x%lx, "
-					"length %lu, b_offset 0x%lx, "
-					"mapping %p, "
-					"new extent offset 0x%lx, length %lu, "
-					"b_offset 0x%lx, mapping %p\n",
-					curr->offset, curr->length,
-					curr->b_offset, curr->mapping,
-					extent_offset, extent_length,
-					extent_b_offset, mapping);
-
-				no_new = 1;
-				break;
-			}
-			bankshot2_insert_vma(bs2_dev, curr, vma);
-			if (curr->length < extent_length) {
-				curr->length = extent_length;
-				atomic_set(&curr->access, 1);
-				new = curr;
-				goto check_overlap;
-			}
+	if (!length)
+		return 0;
 
-			no_new = 1;
-			break;
+	/* The leftmost overlap either holds offset or bounds the new extent */
+	last = offset + length - 1;
+	curr = bankshot2_extent_it_iter_first(&pi->extent_tree, offset, last);
+
+	if (curr && curr->offset <= offset) {
+		if (curr->offset != offset
+				|| curr->length > length
+				|| curr->b_offset != b_offset
+				|| curr->mapping != mapping) {
+			bs2_info("Existing extent hit but unmatch! "
+				"existing extent offset 0x%lx, "
+				"length %lu, b_offset 0x%lx, "
+				"mapping %p, "
+				"new extent offset 0x%lx, length %lu, "
+				"b_offset 0x%lx, mapping %p\n",
+				curr->offset, curr->length,
+				curr->b_offset, curr->mapping,
+				offset, length, b_offset, mapping);
+			goto set_access;
 		}
-	}
 
-	if (no_new) {
-		bs2_dbg("Set pi %llu, extent offset 0x%lx access\n",
-			pi->i_ino, curr->offset);
-		atomic_set(&curr->access, 1);
-		return 0;
+		ret = bankshot2_insert_vma(bs2_dev, curr, vma);
+		if (ret)
+			return ret;
+		if (curr->length == length)
+			goto set_access;
+
+		/*
+		 * Grow it up to the next extent. The subtree ends cached
+		 * above it only follow if it is reinserted.
+		 */
+		bankshot2_extent_it_remove(curr, &pi->extent_tree);
+		new = bankshot2_extent_it_iter_first(&pi->extent_tree,
+							offset, last);
+		curr->length = new ? new->offset - offset : length;
+		bankshot2_extent_it_insert(curr, &pi->extent_tree);
+		goto set_access;
 	}
 
+	/* Stop short of the next extent */
+	if (curr)
+		length = curr->offset - offset;
+
 	new = (struct extent_entry *)
 		kmem_cache_alloc(bs2_dev->bs2_extent_slab, GFP_KERNEL);
-	if (!new) {
-//		write_unlock(&pi->extent_tree_lock);
+	if (!new)
 		return -ENOMEM;
-	}
 
-	bankshot2_initialize_new_extent(bs2_dev, new, extent_offset,
-		extent_length, extent_b_offset, mapping, vma);
+	ret = bankshot2_initialize_new_extent(bs2_dev, new, offset, length,
+					b_offset, mapping, vma);
+	if (ret) {
+		kmem_cache_free(bs2_dev->bs2_extent_slab, new);
+		return ret;
+	}
 
 	atomic_set(&new->access, 1);
 	*access_extent = new;
 	bs2_dbg("Set pi %llu, extent offset 0x%lx access\n",
 			pi->i_ino, new->offset);
-	rb_link_node(&new->node, parent, temp);
-	rb_insert_color(&new->node, &pi->extent_tree);
+	bankshot2_extent_it_insert(new, &pi->extent_tree);
 	pi->num_extents++;
+	return 0;
 
-check_overlap:
-	// Check the next node see if it overlaps
-	next_node = rb_next(&new->node);
-	if (!next_node)
-		return 0;
-
-	next = container_of(next_node, struct extent_entry, node);
-	if (new->offset + new->length > next->offset)
-		new->length = next->offset - new->offset;
-
+set_access:
+	bs2_dbg("Set pi %llu, extent offset 0x%lx access\n",
+		pi->i_ino, curr->offset);
+	atomic_set(&curr->access, 1);
 	return 0;
 }
 
@@ -390,7 +312,7 @@ void bankshot2_delete_tree(struct bankshot2_device *bs2_dev,
 //				"mmap addr %lx\n", pi->i_ino, curr->offset,
 //				curr->length, curr->mmap_addr);
 		temp = rb_next(temp);
-		rb_erase(&curr->node, &pi->extent_tree);
+		bankshot2_extent_it_remove(curr, &pi->extent_tree);
 		bankshot2_free_extent(bs2_dev, curr);
 	}
 
@@ -420,7 +342,7 @@ static struct extent_entry* bankshot2_get_victim_extent(
 	return NULL;
 
 found:
-	rb_erase(&victim->node, &pi->extent_tree);
+	bankshot2_extent_it_remove(victim, &pi->extent_tree);
 	pi->num_extents--;
 
 	return victim;
@@ -514,8 +436,7 @@ bankshot2_remove_mapping_from_extent(struct bankshot2_device *bs2_dev,
 			vm_munmap_page(mm, vma->vm_start,
 					vma->vm_end - vma->vm_start);
 
-			list_del(&delete->list);
-			kfree(delete);
+			bankshot2_remove_vma(bs2_dev, extent, delete);
 		}
 	}
 }
@@ -543,8 +464,8 @@ int bankshot2_remove_mapping_from_tree(struct bankshot2_device *bs2_dev,
 
 /* ========================= Physical Tree ============================ */
 
-static inline int bankshot2_rbtree_compare_find_phy(struct extent_entry *curr,
-		off_t b_offset)
+static inline int bankshot2_rbtree_compare_find_phy(
+		struct phys_extent_entry *curr, off_t b_offset)
 {
 	if ((curr->b_offset <= b_offset) &&
 			(curr->b_offset + curr->length > b_offset))
@@ -556,17 +477,17 @@ static inline int bankshot2_rbtree_compare_find_phy(struct extent_entry *curr,
 	return 0;
 }
 
-struct extent_entry * bankshot2_find_physical_extent(
+struct phys_extent_entry * bankshot2_find_physical_extent(
 		struct bankshot2_device *bs2_dev, off_t b_offset)
 {
-	struct extent_entry *curr;
+	struct phys_extent_entry *curr;
 	struct rb_node *temp;
 	int compVal;
 
 	mutex_lock(&bs2_dev->phy_tree_lock);
 	temp = bs2_dev->physical_tree.rb_node;
 	while (temp) {
-		curr = container_of(temp, struct extent_entry, node);
+		curr = container_of(temp, struct phys_extent_entry, node);
 		compVal = bankshot2_rbtree_compare_find_phy(curr, b_offset);
 
 		if (compVal == -1) {
@@ -587,7 +508,7 @@ int bankshot2_insert_physical_tree(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, u64 extent_offset,
 		size_t extent_length, u64 extent_b_offset)
 {
-	struct extent_entry *curr, *new, *prev, *next;
+	struct phys_extent_entry *curr, *new, *prev, *next;
 	struct rb_node **temp, *parent, *prev_node, *next_node;
 	int compVal;
 	int ret;
@@ -597,7 +518,7 @@ int bankshot2_insert_physical_tree(struct bankshot2_device *bs2_dev,
 
 	mutex_lock(&bs2_dev->phy_tree_lock);
 	while (*temp) {
-		curr = container_of(*temp, struct extent_entry, node);
+		curr = container_of(*temp, struct phys_extent_entry, node);
 		compVal = bankshot2_rbtree_compare_find_phy(curr,
 						extent_b_offset);
 		parent = *temp;
@@ -637,8 +558,8 @@ int bankshot2_insert_physical_tree(struct bankshot2_device *bs2_dev,
 		}
 	}
 
-	new = (struct extent_entry *)
-		kmem_cache_alloc(bs2_dev->bs2_extent_slab, GFP_KERNEL);
+	new = (struct phys_extent_entry *)
+		kmem_cache_alloc(bs2_dev->bs2_phys_extent_slab, GFP_KERNEL);
 	if (!new) {
 //		write_unlock(&pi->extent_tree_lock);
 		ret = -ENOMEM;
@@ -649,7 +570,6 @@ int bankshot2_insert_physical_tree(struct bankshot2_device *bs2_dev,
 	new->offset = extent_offset;
 	new->length = extent_length;
 	new->b_offset = extent_b_offset;
-	INIT_LIST_HEAD(&new->vma_list); // Not used
 
 	rb_link_node(&new->node, parent, temp);
 	rb_insert_color(&new->node, &bs2_dev->physical_tree);
@@ -659,7 +579,7 @@ int bankshot2_insert_physical_tree(struct bankshot2_device *bs2_dev,
 	if (!prev_node)
 		goto check_next_overlap;
 
-	prev = container_of(prev_node, struct extent_entry, node);
+	prev = container_of(prev_node, struct phys_extent_entry, node);
 
 	if ((prev->ino == new->ino) &&
 	    (prev->offset + prev->length >= new->offset) &&
@@ -668,7 +588,7 @@ int bankshot2_insert_physical_tree(struct bankshot2_device *bs2_dev,
 			prev->length = new->offset + new->length - prev->offset;
 
 		rb_erase(&new->node, &bs2_dev->physical_tree);
-		bankshot2_free_extent(bs2_dev, new);
+		kmem_cache_free(bs2_dev->bs2_phys_extent_slab, new);
 
 		new = prev;
 	}
@@ -679,7 +599,7 @@ check_next_overlap:
 		if (!next_node)
 			break;
 	
-		next = container_of(next_node, struct extent_entry, node);
+		next = container_of(next_node, struct phys_extent_entry, node);
 
 		if ((new->ino == next->ino) &&
 		    (new->offset + new->length >= next->offset) &&
@@ -689,6 +609,7 @@ check_next_overlap:
 				new->length = next->offset + next->length - new->offset;
 
 			rb_erase(&next->node, &bs2_dev->physical_tree);
+			kmem_cache_free(bs2_dev->bs2_phys_extent_slab, next);
 		} else {
 			break;
 		}
@@ -702,19 +623,19 @@ out:
 
 void bankshot2_destroy_physical_tree(struct bankshot2_device *bs2_dev)
 {
-	struct extent_entry *curr;
+	struct phys_extent_entry *curr;
 	struct rb_node *temp;
 
 //	write_lock(&pi->extent_tree_lock);
 	temp = rb_first(&bs2_dev->physical_tree);
 	while (temp) {
-		curr = container_of(temp, struct extent_entry, node);
+		curr = container_of(temp, struct phys_extent_entry, node);
 //		bs2_info("pi %llu, extent offset %lu, length %lu, "
 //				"mmap addr %lx\n", pi->i_ino, curr->offset,
 //				curr->length, curr->mmap_addr);
 		temp = rb_next(temp);
 		rb_erase(&curr->node, &bs2_dev->physical_tree);
-		bankshot2_free_extent(bs2_dev, curr);
+		kmem_cache_free(bs2_dev->bs2_phys_extent_slab, curr);
 	}
 
 //	write_unlock(&pi->extent_tree_lock);
@@ -724,14 +645,14 @@ void bankshot2_destroy_physical_tree(struct bankshot2_device *bs2_dev)
 
 void bankshot2_print_physical_tree(struct bankshot2_device *bs2_dev)
 {
-	struct extent_entry *curr;
+	struct phys_extent_entry *curr;
 	struct rb_node *temp;
 
 //	read_lock(&pi->extent_tree_lock);
 	bs2_info("Print physical tree:\n");
 	temp = rb_first(&bs2_dev->physical_tree);
 	while (temp) {
-		curr = container_of(temp, struct extent_entry, node);
+		curr = container_of(temp, struct phys_extent_entry, node);
 		bs2_info("b_offset 0x%lx, pi %llu, extent offset 0x%lx, "
 				"length %lu\n",	curr->b_offset, curr->ino,
 				curr->offset, curr->length);
@@ -744,121 +665,132 @@ void bankshot2_print_physical_tree(struct bankshot2_device *bs2_dev)
 
 /* ========================== Access Tree ============================= */
 
-static inline int bankshot2_rbtree_compare_overlap(struct extent_entry *curr,
-		off_t offset, size_t count)
+INTERVAL_TREE_DEFINE(struct bankshot2_range_lock, node, off_t, subtree_last,
+		BANKSHOT2_RANGE_START, BANKSHOT2_RANGE_LAST, static inline,
+		bankshot2_range_it)
+
+/*
+ * Reads and writes hold their file range in the inode's access tree for as
+ * long as they use it, read hits shared and everything else exclusively.
+ * A task that runs into a conflicting range queues on it and sleeps until
+ * exactly that range is released, then looks again: another task may have
+ * taken an overlapping range in between. A range with a writer queued on
+ * it admits no more readers, so that writers are not starved.
+ */
+struct bankshot2_range_waiter {
+	struct list_head list;
+	struct task_struct *task;
+};
+
+static inline bool bankshot2_range_conflicts(struct bankshot2_range_lock *held,
+		bool exclusive)
 {
-	if (offset + count <= curr->offset)
-		return -1;
-
-	if (curr->offset + curr->length <= offset)
-		return 1;
-
-	return 0;
+	return exclusive || held->exclusive || held->excl_waiters;
 }
 
-int bankshot2_extent_being_accessed(struct bankshot2_device *bs2_dev,
-		struct bankshot2_inode *pi, off_t pos, size_t count)
+/*
+ * Shared ranges overlap each other, so walk every held range overlapping
+ * ours: nested and mixed-size windows are found all the same.
+ */
+static struct bankshot2_range_lock *
+bankshot2_find_range_conflict(struct bankshot2_inode *pi, off_t pos,
+		size_t count, bool exclusive)
 {
-	struct extent_entry *curr;
-	struct rb_node *temp;
-	int compVal;
-
-	temp = pi->access_tree.rb_node;
-	while (temp) {
-		curr = container_of(temp, struct extent_entry, node);
-		compVal = bankshot2_rbtree_compare_overlap(curr, pos, count);
+	struct bankshot2_range_lock *curr;
+	off_t last = pos + count - 1;
 
-		if (compVal == -1) {
-			temp = temp->rb_left;
-		} else if (compVal == 1) {
-			temp = temp->rb_right;
-		} else {
-			return 1;
-		}
+	for (curr = bankshot2_range_it_iter_first(&pi->access_tree, pos, last);
+	     curr; curr = bankshot2_range_it_iter_next(curr, pos, last)) {
+		if (bankshot2_range_conflicts(curr, exclusive))
+			return curr;
 	}
 
-	return 0;
+	return NULL;
 }
 
-int bankshot2_insert_access_extent(struct bankshot2_device *bs2_dev,
-		struct bankshot2_inode *pi, off_t pos, size_t count)
+static void bankshot2_insert_range(struct bankshot2_inode *pi,
+		struct bankshot2_range_lock *range)
 {
-	struct extent_entry *curr, *new;
-	struct rb_node **temp, *parent;
-	int compVal;
+	bankshot2_range_it_insert(range, &pi->access_tree);
+	pi->num_access_extents++;
+}
 
-	temp = &(pi->access_tree.rb_node);
-	parent = NULL;
+/* Lock [pos, pos + count) of pi, sleeping while any of it is held in a
+ * conflicting mode. range is the caller's, usually on its stack, until
+ * bankshot2_unlock_range. */
+void bankshot2_lock_range(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, struct bankshot2_range_lock *range,
+		off_t pos, size_t count, bool exclusive)
+{
+	struct bankshot2_range_lock *held;
+	struct bankshot2_range_waiter waiter;
+	timing_t time;
 
-	while (*temp) {
-		curr = container_of(*temp, struct extent_entry, node);
-		compVal = bankshot2_rbtree_compare_find(curr, pos);
-		parent = *temp;
+	range->offset = pos;
+	range->length = count;
+	range->exclusive = exclusive;
+	range->excl_waiters = 0;
+	INIT_LIST_HEAD(&range->waiters);
+	waiter.task = current;
 
-		if (compVal == -1) {
-			temp = &((*temp)->rb_left);
-		} else if (compVal == 1) {
-			temp = &((*temp)->rb_right);
-		} else {
-			bs2_info("ERROR: Hit accessing extent! existing extent"
-					" offset 0x%lx, length %lu, "
-					"new extent offset 0x%lx, length %lu\n",
-					curr->offset, curr->length,
-					pos, count);
-			return -EINVAL;
-		}
+	mutex_lock(&pi->tree_lock);
+	while ((held = bankshot2_find_range_conflict(pi, pos, count,
+							exclusive))) {
+		bs2_dbg("Waiting on range: pi %llu, offset 0x%lx, size %lu\n",
+				pi->i_ino, pos, count);
+		list_add_tail(&waiter.list, &held->waiters);
+		if (exclusive)
+			held->excl_waiters++;
+		BANKSHOT2_START_TIMING(bs2_dev, wait_access_t, time);
+		/* Taken off the list by whoever wakes us */
+		do {
+			set_current_state(TASK_UNINTERRUPTIBLE);
+			mutex_unlock(&pi->tree_lock);
+			schedule();
+			mutex_lock(&pi->tree_lock);
+		} while (!list_empty(&waiter.list));
+		BANKSHOT2_END_TIMING(bs2_dev, wait_access_t, time);
 	}
 
-	new = (struct extent_entry *)
-		kmem_cache_alloc(bs2_dev->bs2_extent_slab, GFP_KERNEL);
-	if (!new)
-		return -ENOMEM;
-
-	new->offset = pos;
-	new->length = count;
-	INIT_LIST_HEAD(&new->vma_list); // Not used
-
-	rb_link_node(&new->node, parent, temp);
-	rb_insert_color(&new->node, &pi->access_tree);
-	pi->num_access_extents++;
-
-	return 0;
+	BANKSHOT2_START_TIMING(bs2_dev, insert_access_t, time);
+	bankshot2_insert_range(pi, range);
+	BANKSHOT2_END_TIMING(bs2_dev, insert_access_t, time);
+	mutex_unlock(&pi->tree_lock);
+	bs2_dbg("Lock range: pi %llu, offset 0x%lx, size %lu\n",
+			pi->i_ino, pos, count);
 }
 
-void bankshot2_remove_access_extent(struct bankshot2_device *bs2_dev,
-			struct bankshot2_inode *pi, off_t pos, size_t count)
+static void bankshot2_wake_range_waiters(struct bankshot2_range_lock *range)
 {
-	struct extent_entry *curr;
-	struct rb_node *temp;
-	int compVal;
-
-	temp = pi->access_tree.rb_node;
-	while (temp) {
-		curr = container_of(temp, struct extent_entry, node);
-		compVal = bankshot2_rbtree_compare_find(curr, pos);
+	struct bankshot2_range_waiter *waiter, *next;
 
-		if (compVal == -1) {
-			temp = temp->rb_left;
-		} else if (compVal == 1) {
-			temp = temp->rb_right;
-		} else {
-			bs2_dbg("Delete extent to pi %llu, extent offset %lu, "
-				"length %lu\n",
-				pi->i_ino, curr->offset, curr->length);
-			rb_erase(&curr->node, &pi->access_tree);
-			pi->num_access_extents--;
-			bankshot2_free_extent(bs2_dev, curr);
-			break;
-		}
+	list_for_each_entry_safe(waiter, next, &range->waiters, list) {
+		list_del_init(&waiter->list);
+		wake_up_process(waiter->task);
 	}
+	range->excl_waiters = 0;
+}
 
-	return;
+void bankshot2_unlock_range(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, struct bankshot2_range_lock *range)
+{
+	timing_t time;
+
+	mutex_lock(&pi->tree_lock);
+	BANKSHOT2_START_TIMING(bs2_dev, remove_access_t, time);
+	bankshot2_range_it_remove(range, &pi->access_tree);
+	pi->num_access_extents--;
+	BANKSHOT2_END_TIMING(bs2_dev, remove_access_t, time);
+	bankshot2_wake_range_waiters(range);
+	mutex_unlock(&pi->tree_lock);
+	bs2_dbg("Release range: pi %llu, offset 0x%lx, size %lu\n",
+			pi->i_ino, range->offset, range->length);
 }
 
 void bankshot2_print_access_tree(struct bankshot2_device *bs2_dev,
 				struct bankshot2_inode *pi)
 {
-	struct extent_entry *curr;
+	struct bankshot2_range_lock *curr;
 	struct rb_node *temp;
 
 	mutex_lock(&pi->tree_lock);
@@ -868,7 +800,7 @@ void bankshot2_print_access_tree(struct bankshot2_device *bs2_dev,
 				pi->i_ino, pi->num_access_extents);
 	temp = rb_first(&pi->access_tree);
 	while (temp) {
-		curr = container_of(temp, struct extent_entry, node);
+		curr = container_of(temp, struct bankshot2_range_lock, node);
 		bs2_info("pi %llu, access extent offset %lu, length %lu\n",
 				pi->i_ino, curr->offset, curr->length);
 		temp = rb_next(temp);
@@ -878,20 +810,21 @@ void bankshot2_print_access_tree(struct bankshot2_device *bs2_dev,
 	return;
 }
 
+/* The ranges belong to their lockers, just let go of them */
 void bankshot2_delete_access_tree(struct bankshot2_device *bs2_dev,
 				struct bankshot2_inode *pi)
 {
-	struct extent_entry *curr;
+	struct bankshot2_range_lock *curr;
 	struct rb_node *temp;
 
 	temp = rb_first(&pi->access_tree);
 	while (temp) {
-		curr = container_of(temp, struct extent_entry, node);
+		curr = container_of(temp, struct bankshot2_range_lock, node);
 		bs2_info("pi %llu, access extent offset %lu, length %lu\n",
 				pi->i_ino, curr->offset, curr->length);
 		temp = rb_next(temp);
-		rb_erase(&curr->node, &pi->access_tree);
-		bankshot2_free_extent(bs2_dev, curr);
+		bankshot2_range_it_remove(curr, &pi->access_tree);
+		bankshot2_wake_range_waiters(curr);
 	}
 
 	pi->num_access_extents = 0;
@@ -908,7 +841,28 @@ int bankshot2_init_extents(struct bankshot2_device *bs2_dev)
 					0, 0, NULL);
 	if (bs2_dev->bs2_extent_slab == NULL)
 		return -ENOMEM;
+
+	bs2_dev->bs2_phys_extent_slab = kmem_cache_create(
+					"bankshot2_phys_extent_slab",
+					sizeof(struct phys_extent_entry),
+					0, 0, NULL);
+	if (bs2_dev->bs2_phys_extent_slab == NULL)
+		goto phys_fail;
+
+	bs2_dev->bs2_vma_slab = kmem_cache_create(
+					"bankshot2_vma_slab",
+					sizeof(struct vma_list),
+					0, 0, NULL);
+	if (bs2_dev->bs2_vma_slab == NULL)
+		goto vma_fail;
+
 	return 0;
+
+vma_fail:
+	kmem_cache_destroy(bs2_dev->bs2_phys_extent_slab);
+phys_fail:
+	kmem_cache_destroy(bs2_dev->bs2_extent_slab);
+	return -ENOMEM;
 }
 
 void bankshot2_destroy_extents(struct bankshot2_device *bs2_dev)
@@ -919,18 +873,25 @@ void bankshot2_destroy_extents(struct bankshot2_device *bs2_dev)
 	for (i = BANKSHOT2_FREE_INODE_HINT_START;
 			i < bs2_dev->s_inodes_count; i++) {
 		pi = bankshot2_get_inode(bs2_dev, i);
-		if (pi && pi->num_extents) {
+		if (!pi)
+			continue;
+		/* DRAM copy of the tree top, freed after the RCU barrier */
+		if (pi->mirror)
+			bankshot2_drop_btree_mirror(pi);
+		if (pi->num_extents) {
 			bs2_dbg("pi %llu: %u extents\n",
 					pi->i_ino, pi->num_extents);
 			bankshot2_delete_tree(bs2_dev, pi);
 		}
-		if (pi && pi->num_access_extents) {
+		if (pi->num_access_extents) {
 			bs2_info("pi %llu: still have %u access extents\n",
 					pi->i_ino, pi->num_access_extents);
 			bankshot2_delete_access_tree(bs2_dev, pi);
 		}
 	}
 
+	kmem_cache_destroy(bs2_dev->bs2_vma_slab);
+	kmem_cache_destroy(bs2_dev->bs2_phys_extent_slab);
 	kmem_cache_destroy(bs2_dev->bs2_extent_slab);
 	bs2_info("%s returns.\n", __func__);
 }
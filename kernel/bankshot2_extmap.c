@@ -0,0 +1,572 @@
+/*
+ * Bankshot2 extent-mapped inodes
+ *
+ * Cache fills are mostly large and physically contiguous, yet the block
+ * tree spends an 8 byte pointer per data block and a 4K node per 2MB of
+ * file on them. Inodes with BANKSHOT2_EXTMAP_FL map (block, len, start)
+ * extents instead, so a file filled in a few big runs is one 4K leaf and
+ * a lookup is one binary search. Fragmented files are still better off
+ * with the block tree, which stays the default.
+ *
+ * Lookups take no locks. Writers hold pi->tree_lock and only touch a live
+ * node in two ways a reader can't see half done: growing an extent's
+ * length, and appending past the last entry of a leaf (the entry is
+ * written before eh_entries covers it). Any other update copies the nodes
+ * from the leaf up to the root and switches pi->root over in one store
+ * under the inode's cursor seqcount, so a lookup that raced with it
+ * retries. The nodes it replaced are freed after an RCU grace period, so
+ * that lookup never reads a reused block. A crash leaves either the old
+ * or the new tree, so nothing here is journaled.
+ */
+
+#include "bankshot2.h"
+
+#define EXTMAP_ENTRIES(h)	((struct bankshot2_extmap_entry *)((h) + 1))
+/* Update scratch: the node being rebuilt, plus its parent */
+#define EXTMAP_BUF_ENTRIES	(BANKSHOT2_EXTMAP_ENTRIES + 2)
+
+struct bankshot2_extmap_path {
+	int depth;		/* Depth of the root */
+	u64 node[BANKSHOT2_EXTMAP_MAX_DEPTH + 1];
+	int slot[BANKSHOT2_EXTMAP_MAX_DEPTH + 1];
+	unsigned long end;	/* First file block past the leaf's range */
+	/* Nodes replaced by an update, freed by bankshot2_extmap_release */
+	int nr_old;
+	u64 old[BANKSHOT2_EXTMAP_MAX_DEPTH + 1];
+};
+
+/* Returns NULL if off doesn't point at a node, e.g. a freed one */
+static struct bankshot2_extmap_header *
+bankshot2_extmap_node(struct bankshot2_device *bs2_dev, u64 off)
+{
+	struct bankshot2_extmap_header *h;
+
+	if (!off || (off & (PAGE_SIZE - 1)) || off >= bs2_dev->size)
+		return NULL;
+
+	h = bankshot2_get_block(bs2_dev, off);
+	if (le16_to_cpu(h->eh_magic) != BANKSHOT2_EXTMAP_MAGIC)
+		return NULL;
+	return h;
+}
+
+/* Index of the last entry starting at or before blocknr, -1 if none */
+static int bankshot2_extmap_search(struct bankshot2_extmap_entry *e, int n,
+		unsigned long blocknr)
+{
+	int lo = 0, hi = n - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (le32_to_cpu(e[mid].block) <= blocknr)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return hi;
+}
+
+/*
+ * Walk from the root to the leaf covering blocknr, recording the path.
+ * Returns the leaf, or NULL for an empty tree or anything that doesn't
+ * look like a node, which for a lockless walk means it raced an update.
+ */
+static struct bankshot2_extmap_header *
+bankshot2_extmap_walk(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long blocknr,
+		struct bankshot2_extmap_path *path)
+{
+	struct bankshot2_extmap_header *h;
+	struct bankshot2_extmap_entry *e;
+	u64 off = le64_to_cpu(ACCESS_ONCE(pi->root));
+	int level, depth, n, i;
+
+	path->depth = 0;
+	path->node[0] = 0;
+	path->end = BANKSHOT2_EXTMAP_MAX_BLOCK;
+	path->nr_old = 0;
+
+	for (level = 0; level <= BANKSHOT2_EXTMAP_MAX_DEPTH; level++) {
+		h = bankshot2_extmap_node(bs2_dev, off);
+		if (!h)
+			return NULL;
+
+		depth = le16_to_cpu(h->eh_depth);
+		if (level == 0)
+			path->depth = depth;
+		else if (depth != path->depth - level)
+			return NULL;
+
+		n = le16_to_cpu(ACCESS_ONCE(h->eh_entries));
+		if (n > BANKSHOT2_EXTMAP_ENTRIES || (depth && n == 0))
+			return NULL;
+		smp_rmb();
+
+		e = EXTMAP_ENTRIES(h);
+		i = bankshot2_extmap_search(e, n, blocknr);
+		path->node[level] = off;
+		if (depth == 0) {
+			path->slot[level] = i;
+			return h;
+		}
+
+		/* Nothing is mapped below the first child, but inserts
+		 * there belong to it */
+		if (i < 0)
+			i = 0;
+		path->slot[level] = i;
+		if (i + 1 < n)
+			path->end = le32_to_cpu(e[i + 1].block);
+		off = le64_to_cpu(ACCESS_ONCE(e[i].start));
+	}
+
+	return NULL;
+}
+
+/*
+ * Find the data block mapping file block blocknr (in data block units).
+ * Returns its PM offset, or 0 for a hole. If len is set, it gets the
+ * number of blocks from blocknr to the end of the extent or hole.
+ */
+u64 bankshot2_extmap_lookup(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long blocknr,
+		unsigned long *len)
+{
+	struct bankshot2_extmap_path path;
+	struct bankshot2_extmap_header *h;
+	struct bankshot2_extmap_entry *e;
+	unsigned int data_bits = blk_type_to_shift[pi->i_blk_type];
+	unsigned long block, next;
+	unsigned int seq;
+	u64 bp;
+	int i, n;
+
+	rcu_read_lock();
+	do {
+		seq = read_seqcount_begin(&pi->cursor.seq);
+		bp = 0;
+		next = BANKSHOT2_EXTMAP_MAX_BLOCK;
+
+		h = bankshot2_extmap_walk(bs2_dev, pi, blocknr, &path);
+		if (!h)
+			continue;
+
+		e = EXTMAP_ENTRIES(h);
+		n = le16_to_cpu(ACCESS_ONCE(h->eh_entries));
+		i = path.slot[path.depth];
+		next = i + 1 < n ? le32_to_cpu(e[i + 1].block) : path.end;
+		if (i < 0)
+			continue;
+
+		block = le32_to_cpu(e[i].block);
+		if (blocknr < block + le32_to_cpu(ACCESS_ONCE(e[i].len))) {
+			next = block + le32_to_cpu(e[i].len);
+			bp = le64_to_cpu(e[i].start) +
+				((u64)(blocknr - block) << data_bits);
+		}
+	} while (read_seqcount_retry(&pi->cursor.seq, seq));
+	rcu_read_unlock();
+
+	if (len)
+		*len = next > blocknr ? next - blocknr : 1;
+	return bp;
+}
+
+static int bankshot2_extmap_new_node(struct bankshot2_device *bs2_dev,
+		int depth, struct bankshot2_extmap_entry *entries, int n,
+		u64 *node)
+{
+	struct bankshot2_extmap_header *h;
+	unsigned long blocknr;
+	int errval;
+
+	errval = bankshot2_new_block(bs2_dev, &blocknr,
+					BANKSHOT2_BLOCK_TYPE_4K, 0);
+	if (errval)
+		return errval;
+
+	*node = bankshot2_get_block_off(bs2_dev, blocknr,
+					BANKSHOT2_BLOCK_TYPE_4K);
+	h = bankshot2_get_block(bs2_dev, *node);
+	h->eh_magic = cpu_to_le16(BANKSHOT2_EXTMAP_MAGIC);
+	h->eh_entries = cpu_to_le16(n);
+	h->eh_depth = cpu_to_le16(depth);
+	h->eh_rsvd = 0;
+	h->eh_rsvd2 = 0;
+	memcpy(EXTMAP_ENTRIES(h), entries, n * sizeof(*entries));
+	bankshot2_flush_buffer(h, sizeof(*h) + n * sizeof(*entries), false);
+
+	return 0;
+}
+
+static void bankshot2_extmap_publish(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, u64 root, int depth)
+{
+	/* The new nodes must be durable before anything points at them */
+	PERSISTENT_BARRIER();
+	bankshot2_publish_root(pi, cpu_to_le64(root), depth);
+	bankshot2_flush_buffer(pi, CACHELINE_SIZE, true);
+}
+
+static void bankshot2_extmap_release(struct bankshot2_device *bs2_dev,
+		struct bankshot2_extmap_path *path)
+{
+	int i;
+
+	for (i = 0; i < path->nr_old; i++)
+		bankshot2_free_meta_block(bs2_dev,
+				bankshot2_get_blocknr(path->old[i]));
+	path->nr_old = 0;
+}
+
+/*
+ * Replace the leaf at the end of path with nodes holding the cnt entries
+ * in buf, copy each ancestor with its child pointers fixed up, and publish
+ * the new root. A node that overflows is split in two, one left empty is
+ * dropped. buf must hold 2 * EXTMAP_BUF_ENTRIES entries. The replaced
+ * nodes stay on path until bankshot2_extmap_release.
+ */
+static int bankshot2_extmap_replace(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, struct bankshot2_extmap_path *path,
+		struct bankshot2_extmap_entry *buf, int cnt)
+{
+	struct bankshot2_extmap_entry *pbuf = buf + EXTMAP_BUF_ENTRIES;
+	struct bankshot2_extmap_entry *tmp, *pe;
+	struct bankshot2_extmap_header *ph;
+	u64 created[2 * BANKSHOT2_EXTMAP_MAX_DEPTH + 3];
+	u64 new[2], root;
+	int nr_created = 0;
+	int level = path->depth, depth, nr, pn, slot, i;
+	int errval;
+	__le32 key;
+
+	for (;;) {
+		depth = path->depth - level;
+
+		/* An index root down to one child hands the root to it */
+		if (level == 0 && depth > 0 && cnt == 1) {
+			path->old[path->nr_old++] = path->node[0];
+			root = le64_to_cpu(buf[0].start);
+			depth--;
+			break;
+		}
+
+		nr = cnt == 0 ? 0 : cnt <= BANKSHOT2_EXTMAP_ENTRIES ? 1 : 2;
+		for (i = 0; i < nr; i++) {
+			errval = bankshot2_extmap_new_node(bs2_dev, depth,
+					buf + i * cnt / nr,
+					(i + 1) * cnt / nr - i * cnt / nr,
+					&new[i]);
+			if (errval)
+				goto fail;
+			created[nr_created++] = new[i];
+		}
+		if (path->node[level])
+			path->old[path->nr_old++] = path->node[level];
+
+		if (level == 0) {
+			if (nr < 2) {
+				root = nr ? new[0] : 0;
+				break;
+			}
+			/* Split root: grow the tree by a level */
+			if (depth == BANKSHOT2_EXTMAP_MAX_DEPTH) {
+				bs2_dbg("%s: pi %llu has too many extents\n",
+					__func__, pi->i_ino);
+				errval = -ENOSPC;
+				goto fail;
+			}
+			for (i = 0; i < 2; i++) {
+				pbuf[i].block = buf[i * cnt / 2].block;
+				pbuf[i].len = 0;
+				pbuf[i].start = cpu_to_le64(new[i]);
+			}
+			errval = bankshot2_extmap_new_node(bs2_dev, depth + 1,
+					pbuf, 2, &root);
+			if (errval)
+				goto fail;
+			created[nr_created++] = root;
+			depth++;
+			break;
+		}
+
+		/* Rebuild the parent around the new children */
+		ph = bankshot2_get_block(bs2_dev, path->node[level - 1]);
+		pe = EXTMAP_ENTRIES(ph);
+		pn = le16_to_cpu(ph->eh_entries);
+		slot = path->slot[level - 1];
+		key = pe[slot].block;
+
+		memcpy(pbuf, pe, slot * sizeof(*pe));
+		for (i = 0; i < nr; i++) {
+			/* The first child keeps covering the old key range */
+			if (i == 0 && le32_to_cpu(key) <= le32_to_cpu(buf[0].block))
+				pbuf[slot].block = key;
+			else
+				pbuf[slot + i].block = buf[i * cnt / nr].block;
+			pbuf[slot + i].len = 0;
+			pbuf[slot + i].start = cpu_to_le64(new[i]);
+		}
+		memcpy(pbuf + slot + nr, pe + slot + 1,
+				(pn - slot - 1) * sizeof(*pe));
+		cnt = pn - 1 + nr;
+
+		tmp = buf;
+		buf = pbuf;
+		pbuf = tmp;
+		level--;
+	}
+
+	bankshot2_extmap_publish(bs2_dev, pi, root, depth);
+	return 0;
+
+fail:
+	for (i = 0; i < nr_created; i++)
+		bankshot2_free_block(bs2_dev,
+				bankshot2_get_blocknr(created[i]),
+				BANKSHOT2_BLOCK_TYPE_4K);
+	path->nr_old = 0;
+	return errval;
+}
+
+/*
+ * Map len data blocks at file block block to the data at PM offset start.
+ * The range must be unmapped. Caller holds pi->tree_lock.
+ */
+int bankshot2_extmap_insert(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long block,
+		unsigned long len, u64 start)
+{
+	struct bankshot2_extmap_path path;
+	struct bankshot2_extmap_header *h;
+	struct bankshot2_extmap_entry *e, *buf;
+	unsigned int data_bits = blk_type_to_shift[pi->i_blk_type];
+	unsigned long last_end;
+	int i, n, cnt, errval;
+
+	if (len == 0 || block + len > BANKSHOT2_EXTMAP_MAX_BLOCK)
+		return -ENOSPC;
+
+	h = bankshot2_extmap_walk(bs2_dev, pi, block, &path);
+	if (!h && pi->root) {
+		bs2_info("%s: pi %llu has a bad extent tree\n", __func__,
+				pi->i_ino);
+		return -EIO;
+	}
+
+	if (h) {
+		e = EXTMAP_ENTRIES(h);
+		n = le16_to_cpu(h->eh_entries);
+		i = path.slot[path.depth];
+
+		/* Grow the previous extent if the new blocks follow it in
+		 * PM too */
+		if (i >= 0) {
+			last_end = le32_to_cpu(e[i].block) +
+					le32_to_cpu(e[i].len);
+			if (last_end == block && le64_to_cpu(e[i].start) +
+					((u64)le32_to_cpu(e[i].len) <<
+					data_bits) == start) {
+				e[i].len = cpu_to_le32(last_end + len -
+						le32_to_cpu(e[i].block));
+				bankshot2_flush_buffer(&e[i], sizeof(e[i]),
+							true);
+				return 0;
+			}
+		}
+
+		/* Fill the next free slot, then make it visible */
+		if (i == n - 1 && n < BANKSHOT2_EXTMAP_ENTRIES) {
+			e[n].block = cpu_to_le32(block);
+			e[n].len = cpu_to_le32(len);
+			e[n].start = cpu_to_le64(start);
+			bankshot2_flush_buffer(&e[n], sizeof(e[n]), true);
+			smp_wmb();
+			h->eh_entries = cpu_to_le16(n + 1);
+			bankshot2_flush_buffer(h, sizeof(*h), true);
+			return 0;
+		}
+	} else {
+		e = NULL;
+		n = 0;
+		i = -1;
+	}
+
+	buf = kmalloc(2 * EXTMAP_BUF_ENTRIES * sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	if (e)
+		memcpy(buf, e, (i + 1) * sizeof(*e));
+	buf[i + 1].block = cpu_to_le32(block);
+	buf[i + 1].len = cpu_to_le32(len);
+	buf[i + 1].start = cpu_to_le64(start);
+	if (e)
+		memcpy(buf + i + 2, e + i + 1, (n - i - 1) * sizeof(*e));
+	cnt = n + 1;
+
+	/* The new extent may close the gap to the one after it */
+	if (i + 2 < cnt && block + len == le32_to_cpu(buf[i + 2].block) &&
+	    start + ((u64)len << data_bits) == le64_to_cpu(buf[i + 2].start)) {
+		buf[i + 1].len = cpu_to_le32(len +
+					le32_to_cpu(buf[i + 2].len));
+		memmove(buf + i + 2, buf + i + 3,
+				(cnt - i - 3) * sizeof(*buf));
+		cnt--;
+	}
+
+	errval = bankshot2_extmap_replace(bs2_dev, pi, &path, buf, cnt);
+	if (errval == 0)
+		bankshot2_extmap_release(bs2_dev, &path);
+
+	kfree(buf);
+	return errval;
+}
+
+/*
+ * Unmap file blocks first_blocknr to last_blocknr and free their data
+ * blocks. Returns the number of data blocks freed. Caller holds
+ * pi->tree_lock.
+ */
+unsigned long bankshot2_extmap_truncate(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long first_blocknr,
+		unsigned long last_blocknr)
+{
+	struct bankshot2_extmap_path path;
+	struct bankshot2_extmap_header *h;
+	struct bankshot2_extmap_entry *e, *buf;
+	struct bankshot2_free_batch batch;
+	unsigned int data_bits = blk_type_to_shift[pi->i_blk_type];
+	unsigned long block, end, lo, hi, freed = 0;
+	int i, n, cnt;
+	bool changed;
+
+	if (last_blocknr >= BANKSHOT2_EXTMAP_MAX_BLOCK)
+		last_blocknr = BANKSHOT2_EXTMAP_MAX_BLOCK - 1;
+
+	buf = kmalloc(2 * EXTMAP_BUF_ENTRIES * sizeof(*buf), GFP_KERNEL);
+	if (!buf) {
+		bs2_info("%s: pi %llu out of memory\n", __func__, pi->i_ino);
+		return 0;
+	}
+
+	bankshot2_init_free_batch(&batch, pi->i_blk_type);
+
+	while (first_blocknr <= last_blocknr) {
+		h = bankshot2_extmap_walk(bs2_dev, pi, first_blocknr, &path);
+		if (!h)
+			break;
+
+		e = EXTMAP_ENTRIES(h);
+		n = le16_to_cpu(h->eh_entries);
+		cnt = 0;
+		changed = false;
+		for (i = 0; i < n; i++) {
+			block = le32_to_cpu(e[i].block);
+			end = block + le32_to_cpu(e[i].len);
+			if (end <= first_blocknr || block > last_blocknr) {
+				buf[cnt++] = e[i];
+				continue;
+			}
+
+			changed = true;
+			if (block < first_blocknr) {
+				buf[cnt] = e[i];
+				buf[cnt++].len =
+					cpu_to_le32(first_blocknr - block);
+			}
+			if (end > last_blocknr + 1) {
+				buf[cnt].block = cpu_to_le32(last_blocknr + 1);
+				buf[cnt].len = cpu_to_le32(end -
+							last_blocknr - 1);
+				buf[cnt++].start = cpu_to_le64(
+					le64_to_cpu(e[i].start) +
+					((u64)(last_blocknr + 1 - block) <<
+					data_bits));
+			}
+		}
+
+		if (changed) {
+			if (bankshot2_extmap_replace(bs2_dev, pi, &path,
+							buf, cnt)) {
+				bs2_info("%s: pi %llu failed to unmap blocks\n",
+					__func__, pi->i_ino);
+				break;
+			}
+
+			/* The old leaf is intact until it's released */
+			for (i = 0; i < n; i++) {
+				block = le32_to_cpu(e[i].block);
+				end = block + le32_to_cpu(e[i].len);
+				lo = max(block, first_blocknr);
+				hi = min(end, last_blocknr + 1);
+				for (; lo < hi; lo++, freed++)
+					bankshot2_free_batch_add(bs2_dev,
+						&batch, bankshot2_get_blocknr(
+						le64_to_cpu(e[i].start) +
+						((u64)(lo - block) <<
+						data_bits)));
+			}
+			bankshot2_extmap_release(bs2_dev, &path);
+		}
+
+		first_blocknr = path.end;
+	}
+
+	bankshot2_finish_free_batch(bs2_dev, &batch);
+	kfree(buf);
+	return freed;
+}
+
+static unsigned long bankshot2_extmap_free_node(
+		struct bankshot2_device *bs2_dev, u64 off,
+		unsigned int data_bits, struct bankshot2_free_batch *batch)
+{
+	struct bankshot2_extmap_header *h;
+	struct bankshot2_extmap_entry *e;
+	unsigned long k, len, freed = 0;
+	int i, n;
+
+	h = bankshot2_extmap_node(bs2_dev, off);
+	if (!h)
+		return 0;
+
+	e = EXTMAP_ENTRIES(h);
+	n = le16_to_cpu(h->eh_entries);
+	for (i = 0; i < n; i++) {
+		if (h->eh_depth) {
+			freed += bankshot2_extmap_free_node(bs2_dev,
+					le64_to_cpu(e[i].start), data_bits,
+					batch);
+			continue;
+		}
+
+		len = le32_to_cpu(e[i].len);
+		for (k = 0; k < len; k++)
+			bankshot2_free_batch_add(bs2_dev, batch,
+				bankshot2_get_blocknr(le64_to_cpu(e[i].start) +
+				((u64)k << data_bits)));
+		freed += len;
+	}
+
+	bankshot2_free_meta_block(bs2_dev, bankshot2_get_blocknr(off));
+	return freed;
+}
+
+/* Free a detached tree and everything it maps, e.g. on inode eviction */
+unsigned long bankshot2_extmap_free_tree(struct bankshot2_device *bs2_dev,
+		u64 root, unsigned short btype)
+{
+	struct bankshot2_free_batch batch;
+	unsigned long freed;
+
+	if (!root)
+		return 0;
+
+	bankshot2_init_free_batch(&batch, btype);
+	freed = bankshot2_extmap_free_node(bs2_dev, root,
+					blk_type_to_shift[btype], &batch);
+	bankshot2_finish_free_batch(bs2_dev, &batch);
+
+	return freed;
+}
@@ -0,0 +1,267 @@
+/*
+ * Bankshot2 block hash index
+ *
+ * A small random read pays for the cache inode lookup and then a walk of
+ * up to three tree levels for every page. With hash_entries set, a global
+ * open addressing table in PM maps (backing inode, data block) straight to
+ * the cache block, so such a lookup is usually one or two cache lines.
+ *
+ * The per-inode trees stay authoritative. Blocks enter the index after
+ * bankshot2_alloc_blocks has mapped them and leave it before truncate or
+ * eviction frees them, so the index never hands out a block the tree no
+ * longer has; a miss just falls back to the tree walk. Updates are not
+ * journaled: the undo journal only ever rolls a tree back to fewer
+ * mappings, and recovery drops the whole index after it has run.
+ *
+ * Lookups take no locks. Writers serialize on hash_lock and fill an
+ * entry's block before its key, and a reader re-checks the key after
+ * reading the block. Deleted slots are reused by later inserts, but never
+ * become empty again, so a lookup can stop at the first empty slot.
+ */
+
+#include "bankshot2.h"
+
+/* Data blocks past this don't fit the key */
+#define BANKSHOT2_HASH_MAX_BLOCK	0xffffffffUL
+/* 2^64 / phi. hash_64() here multiplies by a sparse prime that leaves
+ * keys differing only in their low bits clustered. */
+#define BANKSHOT2_HASH_MULT		0x9e3779b97f4a7c15ULL
+
+static inline u64 bankshot2_hash_key(struct bankshot2_inode *pi,
+		unsigned long blocknr)
+{
+	u64 ino = le64_to_cpu(pi->backup_ino);
+
+	/* The inode table and inodes being freed have no backing inode */
+	if (ino == 0 || ino > 0xffffffffULL ||
+			blocknr >= BANKSHOT2_HASH_MAX_BLOCK)
+		return BANKSHOT2_HASH_EMPTY;
+	return ino << 32 | blocknr;
+}
+
+static inline struct bankshot2_hash_entry *
+bankshot2_hash_slot(struct bankshot2_device *bs2_dev, u64 key, int probe)
+{
+	unsigned long mask = (1UL << bs2_dev->hash_bits) - 1;
+
+	return &bs2_dev->hash_table[(((key * BANKSHOT2_HASH_MULT) >>
+				(64 - bs2_dev->hash_bits)) + probe) & mask];
+}
+
+/* Bytes of PM an index of at least entries slots takes, 0 for none */
+unsigned long bankshot2_hash_index_size(unsigned long entries)
+{
+	if (!entries)
+		return 0;
+
+	entries = max_t(unsigned long, roundup_pow_of_two(entries),
+				BANKSHOT2_HASH_PROBE);
+	return PAGE_ALIGN(entries * sizeof(struct bankshot2_hash_entry));
+}
+
+/* Called at format time, on PM the caller has zeroed */
+void bankshot2_init_hash_index(struct bankshot2_device *bs2_dev,
+		u64 offset, unsigned long entries)
+{
+	spin_lock_init(&bs2_dev->hash_lock);
+	bs2_dev->hash_dropped = 0;
+	if (!entries) {
+		bs2_dev->hash_table = NULL;
+		return;
+	}
+
+	entries = max_t(unsigned long, roundup_pow_of_two(entries),
+				BANKSHOT2_HASH_PROBE);
+	bs2_dev->hash_table = bankshot2_get_block(bs2_dev, offset);
+	bs2_dev->hash_bits = ilog2(entries);
+	bs2_info("Hash index: %lu entries @ 0x%llx\n", entries, offset);
+}
+
+void bankshot2_clear_hash_index(struct bankshot2_device *bs2_dev)
+{
+	size_t size;
+
+	if (!bs2_dev->hash_table)
+		return;
+
+	size = sizeof(struct bankshot2_hash_entry) << bs2_dev->hash_bits;
+	spin_lock(&bs2_dev->hash_lock);
+	memset_nt(bs2_dev->hash_table, 0, size);
+	spin_unlock(&bs2_dev->hash_lock);
+	PERSISTENT_MARK();
+	PERSISTENT_BARRIER();
+}
+
+/*
+ * Cache offset of 4K file block file_blocknr, or 0 if the index doesn't
+ * have it. The caller pins the block the same way it would for the tree.
+ */
+u64 bankshot2_hash_lookup(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long file_blocknr)
+{
+	unsigned int blk_shift = blk_type_to_shift[pi->i_blk_type] -
+					bs2_dev->s_blocksize_bits;
+	unsigned long blk_offset = file_blocknr & ((1UL << blk_shift) - 1);
+	struct bankshot2_hash_entry *entry;
+	u64 key, cur, block;
+	int i;
+
+	if (!bs2_dev->hash_table)
+		return 0;
+
+	key = bankshot2_hash_key(pi, file_blocknr >> blk_shift);
+	if (key == BANKSHOT2_HASH_EMPTY)
+		return 0;
+
+	for (i = 0; i < BANKSHOT2_HASH_PROBE; i++) {
+		entry = bankshot2_hash_slot(bs2_dev, key, i);
+		cur = le64_to_cpu(ACCESS_ONCE(entry->key));
+		if (cur == BANKSHOT2_HASH_EMPTY)
+			break;
+		if (cur != key)
+			continue;
+
+		smp_rmb();
+		block = le64_to_cpu(ACCESS_ONCE(entry->block));
+		smp_rmb();
+		/* Deleted, and maybe reused, while we read it */
+		if (le64_to_cpu(ACCESS_ONCE(entry->key)) != key)
+			break;
+
+		percpu_counter_inc(&bs2_dev->hash_hit);
+		return block + (blk_offset << bs2_dev->s_blocksize_bits);
+	}
+
+	percpu_counter_inc(&bs2_dev->hash_miss);
+	return 0;
+}
+
+/* Caller holds hash_lock */
+static void bankshot2_hash_insert(struct bankshot2_device *bs2_dev,
+		u64 key, u64 block)
+{
+	struct bankshot2_hash_entry *entry, *slot = NULL;
+	u64 cur;
+	int i;
+
+	for (i = 0; i < BANKSHOT2_HASH_PROBE; i++) {
+		entry = bankshot2_hash_slot(bs2_dev, key, i);
+		cur = le64_to_cpu(entry->key);
+		if (cur == key) {
+			if (le64_to_cpu(entry->block) == block)
+				return;
+			/* Hide it while the block changes under it */
+			entry->key = cpu_to_le64(BANKSHOT2_HASH_DELETED);
+			slot = entry;
+			break;
+		}
+		if (!slot && (cur == BANKSHOT2_HASH_EMPTY ||
+				cur == BANKSHOT2_HASH_DELETED))
+			slot = entry;
+		if (cur == BANKSHOT2_HASH_EMPTY)
+			break;
+	}
+
+	if (!slot) {
+		/* Lookups of this block will walk the tree */
+		bs2_dev->hash_dropped++;
+		return;
+	}
+
+	slot->block = cpu_to_le64(block);
+	smp_wmb();
+	slot->key = cpu_to_le64(key);
+	bankshot2_flush_buffer(slot, sizeof(*slot), false);
+}
+
+/* Caller holds hash_lock */
+static void bankshot2_hash_remove(struct bankshot2_device *bs2_dev, u64 key)
+{
+	struct bankshot2_hash_entry *entry;
+	u64 cur;
+	int i;
+
+	for (i = 0; i < BANKSHOT2_HASH_PROBE; i++) {
+		entry = bankshot2_hash_slot(bs2_dev, key, i);
+		cur = le64_to_cpu(entry->key);
+		if (cur == BANKSHOT2_HASH_EMPTY)
+			return;
+		if (cur == key) {
+			entry->key = cpu_to_le64(BANKSHOT2_HASH_DELETED);
+			bankshot2_flush_buffer(entry, sizeof(*entry), false);
+			return;
+		}
+	}
+}
+
+/*
+ * Bring the index in line with what the tree maps in the 4K file blocks
+ * [file_blocknr, file_blocknr + num): add the mapped data blocks, or drop
+ * them. Holes are skipped a run at a time. Caller holds pi->tree_lock.
+ */
+static void bankshot2_hash_update_range(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long file_blocknr,
+		unsigned long num, bool insert)
+{
+	struct bankshot2_block_run runs[BANKSHOT2_LOOKUP_RUNS];
+	unsigned int blk_shift = blk_type_to_shift[pi->i_blk_type] -
+					bs2_dev->s_blocksize_bits;
+	unsigned long step = 1UL << blk_shift;
+	unsigned long end, off, limit;
+	u64 key;
+	int nr_runs, i;
+
+	if (!bs2_dev->hash_table ||
+			bankshot2_hash_key(pi, 0) == BANKSHOT2_HASH_EMPTY)
+		return;
+
+	/* Whole data blocks, and none the key can't hold */
+	limit = BANKSHOT2_HASH_MAX_BLOCK << blk_shift;
+	if (file_blocknr >= limit)
+		return;
+	end = num > limit - file_blocknr ? limit : file_blocknr + num;
+	file_blocknr = round_down(file_blocknr, step);
+	end = round_up(end, step);
+
+	while (file_blocknr < end) {
+		nr_runs = bankshot2_find_data_blocks(bs2_dev, pi, file_blocknr,
+				end - file_blocknr, runs, BANKSHOT2_LOOKUP_RUNS);
+		if (!nr_runs)
+			break;
+
+		for (i = 0; i < nr_runs; i++) {
+			if (runs[i].block) {
+				spin_lock(&bs2_dev->hash_lock);
+				for (off = 0; off < runs[i].num; off += step) {
+					key = bankshot2_hash_key(pi,
+						(file_blocknr + off) >>
+						blk_shift);
+					if (insert)
+						bankshot2_hash_insert(bs2_dev,
+							key, runs[i].block +
+							(off << bs2_dev->
+							 s_blocksize_bits));
+					else
+						bankshot2_hash_remove(bs2_dev,
+							key);
+				}
+				spin_unlock(&bs2_dev->hash_lock);
+			}
+			file_blocknr += runs[i].num;
+		}
+	}
+}
+
+void bankshot2_hash_insert_range(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long file_blocknr,
+		unsigned long num)
+{
+	bankshot2_hash_update_range(bs2_dev, pi, file_blocknr, num, true);
+}
+
+void bankshot2_hash_remove_range(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long file_blocknr,
+		unsigned long num)
+{
+	bankshot2_hash_update_range(bs2_dev, pi, file_blocknr, num, false);
+}
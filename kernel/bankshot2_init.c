@@ -15,6 +15,11 @@ static unsigned long phys_addr;
 static unsigned long cache_size;
 int measure_timing = 0;
 int bio_interception = 0;
+int data_block_type = BANKSHOT2_DEFAULT_BLOCK_TYPE;
+unsigned long data_block_size = 0;
+int alloc_stripes = 1;
+int extent_mapping = 0;
+unsigned long hash_entries = 0;
 char *backing_dev_name = "/dev/ram0";
 
 module_param(phys_addr, ulong, S_IRUGO);
@@ -25,6 +30,16 @@ module_param(measure_timing, int, S_IRUGO);
 MODULE_PARM_DESC(measure_timing, "Timing measurement");
 module_param(bio_interception, int, S_IRUGO);
 MODULE_PARM_DESC(bio_interception, "Bio to cache interception");
+module_param(data_block_type, int, S_IRUGO);
+MODULE_PARM_DESC(data_block_type, "Data block type: 0 = 4K, 1 = 2M, 3 = 16K, 4 = 64K");
+module_param(data_block_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(data_block_size, "Data block size in bytes, overrides data_block_type");
+module_param(alloc_stripes, int, S_IRUGO);
+MODULE_PARM_DESC(alloc_stripes, "Allocation stripes per NUMA node");
+module_param(extent_mapping, int, S_IRUGO);
+MODULE_PARM_DESC(extent_mapping, "Map new inodes with: 0 = block tree, 1 = extents");
+module_param(hash_entries, ulong, S_IRUGO);
+MODULE_PARM_DESC(hash_entries, "Slots in the PM block hash index, 0 = no index");
 module_param(backing_dev_name, charp, S_IRUGO);
 MODULE_PARM_DESC(backing_dev_name, "Backing store");
 
@@ -90,6 +105,28 @@ static int __init bankshot2_init(void)
 		goto check_fail;
 	}
 
+	if (data_block_size) {
+		ret = bankshot2_data_blk_size_to_type(data_block_size);
+		if (ret < 0) {
+			bs2_info("Unsupported data block size %lu\n",
+					data_block_size);
+			goto check_fail;
+		}
+		data_block_type = ret;
+	}
+
+	if (!bankshot2_data_blk_type_ok(data_block_type)) {
+		bs2_info("Unsupported data block type %d\n", data_block_type);
+		ret = -EINVAL;
+		goto check_fail;
+	}
+
+	if (alloc_stripes < 1 || alloc_stripes > BANKSHOT2_MAX_DOMAINS) {
+		bs2_info("Unsupported allocation stripes %d\n", alloc_stripes);
+		ret = -EINVAL;
+		goto check_fail;
+	}
+
 	ret = bankshot2_device_alloc();
 	if (ret) {
 		bs2_info("Bankshot2 device alloc failed.\n");
@@ -5,8 +5,10 @@
 
 #include "bankshot2.h"
 
-unsigned int blk_type_to_shift[3] = {12, 21, 30};
-uint32_t blk_type_to_size[3] = {0x1000, 0x200000, 0x40000000};
+unsigned int blk_type_to_shift[BANKSHOT2_BLOCK_TYPE_MAX] =
+					{12, 21, 30, 14, 16};
+uint32_t blk_type_to_size[BANKSHOT2_BLOCK_TYPE_MAX] =
+			{0x1000, 0x200000, 0x40000000, 0x4000, 0x10000};
 
 static inline struct bankshot2_inode *
 bankshot2_get_inode_table(struct bankshot2_device *bs2_dev)
@@ -17,6 +19,351 @@ bankshot2_get_inode_table(struct bankshot2_device *bs2_dev)
 			le64_to_cpu(ps->s_inode_table_offset));
 }
 
+/*
+ * Per-inode lookup cursor. Streaming readers keep landing in the leaf they
+ * used last, or the one right after it, so remember the last leaf and its
+ * parent and skip the interior levels when we can. The cursor is only
+ * trusted while pi->btree_gen has not moved since it was taken. Updates
+ * are best effort: a lookup that loses the trylock leaves it alone.
+ */
+static void bankshot2_init_btree_cursor(struct bankshot2_inode *pi)
+{
+	atomic_set(&pi->btree_gen, 0);
+	seqcount_init(&pi->cursor.seq);
+	spin_lock_init(&pi->cursor.lock);
+	pi->cursor.leaf = 0;
+	pi->cursor.parent = 0;
+	pi->mirror = NULL;
+}
+
+static void bankshot2_update_btree_cursor(struct bankshot2_inode *pi,
+		u32 gen, u32 leaf_index, u64 leaf, u64 parent)
+{
+	struct bankshot2_btree_cursor *cursor = &pi->cursor;
+
+	if (!spin_trylock(&cursor->lock))
+		return;
+
+	write_seqcount_begin(&cursor->seq);
+	cursor->gen = gen;
+	cursor->leaf_index = leaf_index;
+	cursor->leaf = leaf;
+	cursor->parent = parent;
+	write_seqcount_end(&cursor->seq);
+	spin_unlock(&cursor->lock);
+}
+
+/*
+ * DRAM mirror of the interior levels. Built on first lookup, kept in step
+ * by the writers below (which run under the tree lock, after their PM
+ * store) and thrown away whenever root or height changes. Everything is
+ * installed and modified under cursor.lock; lookups read it under
+ * rcu_read_lock() and check root and height before trusting it. Level 2
+ * copies are never freed on their own: clearing a top slot that has one
+ * retires the whole mirror instead.
+ */
+static void bankshot2_free_btree_mirror(struct bankshot2_btree_mirror *m)
+{
+	unsigned int i;
+
+	if (m->mid) {
+		for (i = 0; i < (1 << META_BLK_SHIFT); i++)
+			kfree(m->mid[i]);
+		kfree(m->mid);
+	}
+	kfree(m->top);
+	kfree(m);
+}
+
+static void bankshot2_free_btree_mirror_rcu(struct rcu_head *head)
+{
+	bankshot2_free_btree_mirror(container_of(head,
+				struct bankshot2_btree_mirror, rcu));
+}
+
+/* Unpublish the mirror, caller holds cursor.lock and hands the result to
+ * bankshot2_retire_btree_mirror() once it has dropped the lock */
+static struct bankshot2_btree_mirror *
+__bankshot2_unlink_btree_mirror(struct bankshot2_inode *pi)
+{
+	struct bankshot2_btree_mirror *m = pi->mirror;
+
+	rcu_assign_pointer(pi->mirror, NULL);
+	return m;
+}
+
+static void bankshot2_retire_btree_mirror(struct bankshot2_btree_mirror *m)
+{
+	if (m)
+		call_rcu(&m->rcu, bankshot2_free_btree_mirror_rcu);
+}
+
+void bankshot2_drop_btree_mirror(struct bankshot2_inode *pi)
+{
+	struct bankshot2_btree_mirror *m;
+
+	spin_lock(&pi->cursor.lock);
+	m = __bankshot2_unlink_btree_mirror(pi);
+	spin_unlock(&pi->cursor.lock);
+
+	bankshot2_retire_btree_mirror(m);
+}
+
+static struct bankshot2_btree_mirror *
+bankshot2_build_btree_mirror(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi)
+{
+	struct bankshot2_btree_mirror *m;
+	u32 height;
+
+	m = kzalloc(sizeof(*m), GFP_NOWAIT | __GFP_NOWARN);
+	if (!m)
+		return NULL;
+	m->top = kmalloc(PAGE_SIZE, GFP_NOWAIT | __GFP_NOWARN);
+	m->mid = kzalloc(PAGE_SIZE, GFP_NOWAIT | __GFP_NOWARN);
+	if (!m->top || !m->mid)
+		goto fail;
+
+	spin_lock(&pi->cursor.lock);
+	height = pi->height;
+	if (pi->mirror || height < 2 || height > 3 || !pi->root) {
+		spin_unlock(&pi->cursor.lock);
+		goto fail;
+	}
+	m->root = le64_to_cpu(pi->root);
+	m->height = height;
+	memcpy(m->top, bankshot2_get_block(bs2_dev, m->root), PAGE_SIZE);
+	if (height == 2) {
+		kfree(m->mid);
+		m->mid = NULL;
+	}
+	rcu_assign_pointer(pi->mirror, m);
+	spin_unlock(&pi->cursor.lock);
+	return m;
+
+fail:
+	bankshot2_free_btree_mirror(m);
+	return NULL;
+}
+
+static __le64 *bankshot2_build_mirror_mid(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, struct bankshot2_btree_mirror *m,
+		unsigned int index)
+{
+	__le64 *mid;
+	u64 bp;
+
+	mid = kmalloc(PAGE_SIZE, GFP_NOWAIT | __GFP_NOWARN);
+	if (!mid)
+		return NULL;
+
+	spin_lock(&pi->cursor.lock);
+	bp = le64_to_cpu(m->top[index]);
+	if (pi->mirror != m || m->mid[index] || !bp) {
+		spin_unlock(&pi->cursor.lock);
+		kfree(mid);
+		return NULL;
+	}
+	memcpy(mid, bankshot2_get_block(bs2_dev, bp), PAGE_SIZE);
+	rcu_assign_pointer(m->mid[index], mid);
+	spin_unlock(&pi->cursor.lock);
+	return mid;
+}
+
+/* Mirror copy of the node at height whose slot in its parent is mi, or -1
+ * for the root. Caller holds cursor.lock. */
+static __le64 *bankshot2_mirror_node(struct bankshot2_inode *pi,
+		u32 height, int mi)
+{
+	struct bankshot2_btree_mirror *m = pi->mirror;
+
+	if (!m || height < 2)
+		return NULL;
+	if (mi < 0)
+		return m->height == height ? m->top : NULL;
+	if (m->height == 3 && height == 2)
+		return m->mid[mi];
+	return NULL;
+}
+
+/* Does clearing top slots [start, end] orphan a level 2 copy? */
+static bool bankshot2_mirror_has_mid(struct bankshot2_inode *pi,
+		__le64 *node, unsigned int start, unsigned int end)
+{
+	struct bankshot2_btree_mirror *m = pi->mirror;
+	unsigned int i;
+
+	if (node != m->top || !m->mid)
+		return false;
+	for (i = start; i <= end; i++)
+		if (m->mid[i])
+			return true;
+	return false;
+}
+
+/* node[index] = val was just stored in PM */
+void bankshot2_mirror_set(struct bankshot2_inode *pi, u32 height, int mi,
+		unsigned int index, __le64 val)
+{
+	struct bankshot2_btree_mirror *m = NULL;
+	__le64 *node;
+
+	if (!pi || height < 2)
+		return;
+
+	spin_lock(&pi->cursor.lock);
+	node = bankshot2_mirror_node(pi, height, mi);
+	if (node && !val && bankshot2_mirror_has_mid(pi, node, index, index))
+		m = __bankshot2_unlink_btree_mirror(pi);
+	else if (node)
+		node[index] = val;
+	spin_unlock(&pi->cursor.lock);
+
+	bankshot2_retire_btree_mirror(m);
+}
+
+/* node[start..end] were just cleared in PM, children freed */
+void bankshot2_mirror_clear(struct bankshot2_inode *pi, u32 height, int mi,
+		unsigned int start, unsigned int end)
+{
+	struct bankshot2_btree_mirror *m = NULL;
+	__le64 *node;
+
+	if (!pi || height < 2)
+		return;
+
+	spin_lock(&pi->cursor.lock);
+	node = bankshot2_mirror_node(pi, height, mi);
+	if (node && bankshot2_mirror_has_mid(pi, node, start, end))
+		m = __bankshot2_unlink_btree_mirror(pi);
+	else if (node)
+		memset(&node[start], 0, (end - start + 1) * sizeof(u64));
+	spin_unlock(&pi->cursor.lock);
+
+	bankshot2_retire_btree_mirror(m);
+}
+
+/* Leaf offset for blocknr from the mirror, 0 for a hole. Returns false if
+ * there is no usable mirror for root and height and the caller has to walk
+ * PM. Caller holds rcu_read_lock(). */
+static bool bankshot2_mirror_find_leaf(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, u64 root, u32 height,
+		unsigned long blocknr, u64 *leaf)
+{
+	struct bankshot2_btree_mirror *m = rcu_dereference(pi->mirror);
+	unsigned int index;
+	__le64 *node;
+
+	if (height < 2)
+		return false;
+	if (!m) {
+		m = bankshot2_build_btree_mirror(bs2_dev, pi);
+		if (!m)
+			return false;
+	}
+	if (m->height != height || m->root != root)
+		return false;
+
+	node = m->top;
+	if (height == 3) {
+		index = blocknr >> (2 * META_BLK_SHIFT);
+		node = rcu_dereference(m->mid[index]);
+		if (!node) {
+			if (!ACCESS_ONCE(m->top[index])) {
+				*leaf = 0;
+				return true;
+			}
+			node = bankshot2_build_mirror_mid(bs2_dev, pi, m,
+							index);
+			if (!node)
+				return false;
+		}
+		blocknr &= (1UL << (2 * META_BLK_SHIFT)) - 1;
+	}
+	*leaf = le64_to_cpu(ACCESS_ONCE(node[blocknr >> META_BLK_SHIFT]));
+	return true;
+}
+
+/* Descend from root, height (a bankshot2_read_root() snapshot, at least
+ * one level high) to the leaf node covering data block blocknr. Returns
+ * NULL if the whole leaf is a hole. Caller holds rcu_read_lock(). Only
+ * range lookups pass hit: they move the cursor on a miss and report
+ * whether it helped. Random single lookups just read it. */
+static __le64 *bankshot2_find_leaf(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, u64 root, u32 height,
+		unsigned long blocknr, bool *hit)
+{
+	struct bankshot2_btree_cursor *cursor = &pi->cursor;
+	u32 leaf_index = blocknr >> META_BLK_SHIFT;
+	u32 cursor_index;
+	__le64 *level_ptr;
+	u64 bp = root, parent = 0, cursor_leaf, cursor_parent;
+	u32 bit_shift, gen, cursor_gen;
+	unsigned int seq;
+
+	gen = atomic_read(&pi->btree_gen);
+	/* Pairs with bankshot2_btree_changed(): walk no older a tree */
+	smp_rmb();
+	do {
+		seq = read_seqcount_begin(&cursor->seq);
+		cursor_gen = cursor->gen;
+		cursor_index = cursor->leaf_index;
+		cursor_leaf = cursor->leaf;
+		cursor_parent = cursor->parent;
+	} while (read_seqcount_retry(&cursor->seq, seq));
+
+	if (cursor_leaf && cursor_gen == gen && cursor_index == leaf_index) {
+		if (hit)
+			*hit = true;
+		return bankshot2_get_block(bs2_dev, cursor_leaf);
+	}
+
+	/* Interior levels from DRAM; leaves have no parent to remember */
+	if (bankshot2_mirror_find_leaf(bs2_dev, pi, root, height, blocknr,
+					&bp)) {
+		if (hit)
+			*hit = false;
+		if (bp == 0)
+			return NULL;
+		goto found;
+	}
+
+	/* Neighbouring leaf under the same parent */
+	if (cursor_leaf && cursor_gen == gen && cursor_parent &&
+			(cursor_index >> META_BLK_SHIFT) ==
+			(leaf_index >> META_BLK_SHIFT)) {
+		if (hit)
+			*hit = true;
+		height = 2;
+		bp = cursor_parent;
+		blocknr &= (1UL << (2 * META_BLK_SHIFT)) - 1;
+		goto descend;
+	}
+	if (hit)
+		*hit = false;
+
+descend:
+	if (bp == 0)
+		return NULL;
+
+	while (height > 1) {
+		if (height == 2)
+			parent = bp;
+		level_ptr = bankshot2_get_block(bs2_dev, bp);
+		bit_shift = (height - 1) * META_BLK_SHIFT;
+		bp = le64_to_cpu(ACCESS_ONCE(level_ptr[blocknr >> bit_shift]));
+		if (bp == 0)
+			return NULL;
+		blocknr = blocknr & ((1UL << bit_shift) - 1);
+		height--;
+	}
+
+found:
+	if (hit)
+		bankshot2_update_btree_cursor(pi, gen, leaf_index, bp, parent);
+	return bankshot2_get_block(bs2_dev, bp);
+}
+
 /*
  * find the offset to the block represented by the given inode's file
  * relative block number.
@@ -28,19 +375,32 @@ u64 bankshot2_find_data_block(struct bankshot2_device *bs2_dev,
 	unsigned long blk_offset, blocknr = file_blocknr;
 	unsigned int data_bits = blk_type_to_shift[pi->i_blk_type];
 	unsigned int meta_bits = META_BLK_SHIFT;
-	u64 bp;
+	u64 bp, root;
+	u32 height;
 
 	/* convert the 4K blocks into the actual blocks the inode is using */
 	blk_shift = data_bits - bs2_dev->s_blocksize_bits;
 	blk_offset = file_blocknr & ((1 << blk_shift) - 1);
 	blocknr = file_blocknr >> blk_shift;
 
-	if (blocknr >= (1UL << (pi->height * meta_bits)))
-		return 0;
+	rcu_read_lock();
+	height = bankshot2_read_root(pi, &root);
+	if (bankshot2_is_extmap(pi)) {
+		bp = bankshot2_extmap_lookup(bs2_dev, pi, blocknr, NULL);
+	} else if (blocknr >= (1UL << (height * meta_bits))) {
+		bp = 0;
+	} else if (height == 0) {
+		bp = root;
+	} else {
+		__le64 *leaf = bankshot2_find_leaf(bs2_dev, pi, root, height,
+						blocknr, NULL);
 
-	bp = __bankshot2_find_data_block(bs2_dev, pi, blocknr);
+		bp = leaf ? le64_to_cpu(ACCESS_ONCE(leaf[blocknr &
+				((1UL << meta_bits) - 1)])) : 0;
+	}
+	rcu_read_unlock();
 	bs2_dbg("find_data_block %lu, %x %llu blk_p %p blk_shift %x"
-		" blk_offset %lx\n", file_blocknr, pi->height, bp,
+		" blk_offset %lx\n", file_blocknr, height, bp,
 		bankshot2_get_block(bs2_dev, bp), blk_shift, blk_offset);
 
 	if (bp == 0)
@@ -62,10 +422,12 @@ u64 bankshot2_find_data_block_verbose(struct bankshot2_device *bs2_dev,
 	blk_offset = file_blocknr & ((1 << blk_shift) - 1);
 	blocknr = file_blocknr >> blk_shift;
 
-	if (blocknr >= (1UL << (pi->height * meta_bits)))
+	if (bankshot2_is_extmap(pi))
+		bp = bankshot2_extmap_lookup(bs2_dev, pi, blocknr, NULL);
+	else if (blocknr >= (1UL << (pi->height * meta_bits)))
 		return 0;
-
-	bp = __bankshot2_find_data_block_verbose(bs2_dev, pi, blocknr);
+	else
+		bp = __bankshot2_find_data_block_verbose(bs2_dev, pi, blocknr);
 	bs2_info("find_data_block %lu, %x %llu blk_p %p blk_shift %x"
 		" blk_offset %lx\n", file_blocknr, pi->height, bp,
 		bankshot2_get_block(bs2_dev, bp), blk_shift, blk_offset);
@@ -75,6 +437,306 @@ u64 bankshot2_find_data_block_verbose(struct bankshot2_device *bs2_dev,
 	return bp + (blk_offset << bs2_dev->s_blocksize_bits);
 }
 
+/* Append num pages at block to the run list, merging with the last run
+ * when contiguous. Returns false if a new run is needed but none is left. */
+static bool bankshot2_add_block_run(struct bankshot2_device *bs2_dev,
+		struct bankshot2_block_run *runs, int *nr_runs, int max_runs,
+		u64 block, unsigned long num)
+{
+	struct bankshot2_block_run *last;
+
+	if (*nr_runs) {
+		last = &runs[*nr_runs - 1];
+		if ((block == 0 && last->block == 0) ||
+				(block && last->block && block == last->block +
+				 (last->num << bs2_dev->s_blocksize_bits))) {
+			last->num += num;
+			return true;
+		}
+	}
+
+	if (*nr_runs == max_runs)
+		return false;
+
+	runs[*nr_runs].block = block;
+	runs[*nr_runs].num = num;
+	(*nr_runs)++;
+	return true;
+}
+
+/* bankshot2_find_data_blocks for extent-mapped inodes: one lookup per
+ * extent or hole */
+static int bankshot2_find_extmap_blocks(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long file_blocknr,
+		unsigned long num, struct bankshot2_block_run *runs,
+		int max_runs)
+{
+	unsigned int blk_shift = blk_type_to_shift[pi->i_blk_type] -
+					bs2_dev->s_blocksize_bits;
+	unsigned long blk_offset, len, end = file_blocknr + num;
+	u64 bp, block;
+	int nr_runs = 0;
+
+	while (file_blocknr < end) {
+		blk_offset = file_blocknr & ((1UL << blk_shift) - 1);
+		bp = bankshot2_extmap_lookup(bs2_dev, pi,
+					file_blocknr >> blk_shift, &len);
+		/* len is in data blocks, runs are in 4K pages */
+		len = min(len, (end - file_blocknr + blk_offset +
+				(1UL << blk_shift) - 1) >> blk_shift);
+		len = min((len << blk_shift) - blk_offset, end - file_blocknr);
+		block = bp ? bp + (blk_offset << bs2_dev->s_blocksize_bits) : 0;
+		if (!bankshot2_add_block_run(bs2_dev, runs, &nr_runs,
+				max_runs, block, len))
+			break;
+		file_blocknr += len;
+	}
+
+	return nr_runs;
+}
+
+/*
+ * Range version of bankshot2_find_data_block: map the 4K file blocks
+ * [file_blocknr, file_blocknr + num) to runs of contiguous cache pages,
+ * descending the tree once per leaf. Holes come back as runs with block 0.
+ * Returns the number of runs filled; they cover the range from
+ * file_blocknr on, all of it unless max_runs ran out first.
+ */
+int bankshot2_find_data_blocks(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long file_blocknr,
+		unsigned long num, struct bankshot2_block_run *runs,
+		int max_runs)
+{
+	u32 blk_shift;
+	unsigned long blk_offset, blocknr, leaf_end, len;
+	unsigned long end = file_blocknr + num;
+	unsigned int data_bits = blk_type_to_shift[pi->i_blk_type];
+	unsigned int meta_bits = META_BLK_SHIFT;
+	__le64 *leaf;
+	u64 bp, block, root;
+	u32 height;
+	int nr_runs = 0;
+	int hits = 0, misses = 0;
+	bool hit;
+
+	if (bankshot2_is_extmap(pi))
+		return bankshot2_find_extmap_blocks(bs2_dev, pi, file_blocknr,
+						num, runs, max_runs);
+
+	/* convert the 4K blocks into the actual blocks the inode is using */
+	blk_shift = data_bits - bs2_dev->s_blocksize_bits;
+
+	rcu_read_lock();
+	height = bankshot2_read_root(pi, &root);
+	while (file_blocknr < end) {
+		blocknr = file_blocknr >> blk_shift;
+		if (blocknr >= (1UL << (height * meta_bits))) {
+			/* Beyond what the tree can map */
+			bankshot2_add_block_run(bs2_dev, runs, &nr_runs,
+					max_runs, 0, end - file_blocknr);
+			break;
+		}
+
+		if (height == 0) {
+			leaf = NULL;
+			leaf_end = 1;
+		} else {
+			leaf = bankshot2_find_leaf(bs2_dev, pi, root, height,
+						blocknr, &hit);
+			if (hit)
+				hits++;
+			else
+				misses++;
+			leaf_end = (blocknr | ((1UL << meta_bits) - 1)) + 1;
+			if (!leaf) {
+				/* No leaf: all of its range is one hole */
+				len = min((leaf_end << blk_shift) -
+					file_blocknr, end - file_blocknr);
+				if (!bankshot2_add_block_run(bs2_dev, runs,
+						&nr_runs, max_runs, 0, len))
+					goto out;
+				file_blocknr += len;
+				continue;
+			}
+		}
+
+		for (; blocknr < leaf_end && file_blocknr < end; blocknr++) {
+			if (height == 0)
+				bp = root;
+			else
+				bp = le64_to_cpu(ACCESS_ONCE(leaf[blocknr &
+						((1UL << meta_bits) - 1)]));
+
+			blk_offset = file_blocknr & ((1UL << blk_shift) - 1);
+			len = min((1UL << blk_shift) - blk_offset,
+					end - file_blocknr);
+			block = bp ? bp + (blk_offset <<
+					bs2_dev->s_blocksize_bits) : 0;
+			if (!bankshot2_add_block_run(bs2_dev, runs, &nr_runs,
+					max_runs, block, len))
+				goto out;
+			file_blocknr += len;
+		}
+	}
+
+out:
+	rcu_read_unlock();
+	if (hits)
+		percpu_counter_add(&bs2_dev->cursor_hit, hits);
+	if (misses)
+		percpu_counter_add(&bs2_dev->cursor_miss, misses);
+	return nr_runs;
+}
+
+void bankshot2_block_iter_init(struct bankshot2_block_iter *iter,
+		struct bankshot2_inode *pi, unsigned long file_blocknr,
+		unsigned long num)
+{
+	iter->pi = pi;
+	iter->next = file_blocknr;
+	iter->end = file_blocknr + num;
+	iter->nr_runs = 0;
+	iter->run = 0;
+	iter->off = 0;
+}
+
+static void bankshot2_block_iter_fill(struct bankshot2_device *bs2_dev,
+		struct bankshot2_block_iter *iter)
+{
+	int i;
+
+	iter->nr_runs = bankshot2_find_data_blocks(bs2_dev, iter->pi,
+				iter->next, iter->end - iter->next,
+				iter->runs, BANKSHOT2_LOOKUP_RUNS);
+	for (i = 0; i < iter->nr_runs; i++)
+		iter->next += iter->runs[i].num;
+	iter->run = 0;
+	iter->off = 0;
+}
+
+/* Return the cache offset of the next file block in the range, 0 if it is
+ * a hole or the range is exhausted */
+u64 bankshot2_block_iter_next(struct bankshot2_device *bs2_dev,
+		struct bankshot2_block_iter *iter)
+{
+	struct bankshot2_block_run *run;
+	u64 block;
+
+	if (iter->run == iter->nr_runs) {
+		if (iter->next >= iter->end)
+			return 0;
+		/* Small random reads go to the hash index first */
+		if (iter->end - iter->next <= BANKSHOT2_HASH_MAX_PAGES) {
+			block = bankshot2_hash_lookup(bs2_dev, iter->pi,
+						iter->next);
+			if (block) {
+				iter->next++;
+				return block;
+			}
+		}
+		bankshot2_block_iter_fill(bs2_dev, iter);
+	}
+
+	run = &iter->runs[iter->run];
+	block = run->block ? run->block +
+		(iter->off << bs2_dev->s_blocksize_bits) : 0;
+	if (++iter->off == run->num) {
+		iter->run++;
+		iter->off = 0;
+	}
+	return block;
+}
+
+/*
+ * Consume up to max file blocks that are contiguous in the cache, or all
+ * holes, so callers can copy a whole run at once. Returns the cache offset
+ * of the first one, 0 for a hole, and the run length in *num, which is 0
+ * once the range is exhausted.
+ */
+u64 bankshot2_block_iter_next_run(struct bankshot2_device *bs2_dev,
+		struct bankshot2_block_iter *iter, unsigned long max,
+		unsigned long *num)
+{
+	struct bankshot2_block_run *run;
+	unsigned long n = 0, len;
+	u64 block = 0, next;
+
+	while (n < max) {
+		if (iter->run == iter->nr_runs) {
+			if (iter->next >= iter->end)
+				break;
+			/* Same hash shortcut as the page walk */
+			if (!n && iter->end - iter->next <=
+					BANKSHOT2_HASH_MAX_PAGES) {
+				block = bankshot2_hash_lookup(bs2_dev,
+						iter->pi, iter->next);
+				if (block) {
+					iter->next++;
+					n = 1;
+					break;
+				}
+			}
+			bankshot2_block_iter_fill(bs2_dev, iter);
+		}
+
+		run = &iter->runs[iter->run];
+		next = run->block ? run->block +
+			(iter->off << bs2_dev->s_blocksize_bits) : 0;
+		if (!n)
+			block = next;
+		else if (!block != !next || (block && next != block +
+					(n << bs2_dev->s_blocksize_bits)))
+			break;
+
+		len = min(run->num - iter->off, max - n);
+		n += len;
+		iter->off += len;
+		if (iter->off == run->num) {
+			iter->run++;
+			iter->off = 0;
+		}
+	}
+
+	*num = n;
+	return block;
+}
+
+/*
+ * Prefetch the head of the block the iterator returns next, so that the
+ * misses on it overlap the copy of the current run. Looks up the next
+ * batch of runs early if need be, which chases the tree pointers ahead
+ * of the copy too. write is for blocks about to be stored to.
+ */
+void bankshot2_block_iter_prefetch(struct bankshot2_device *bs2_dev,
+		struct bankshot2_block_iter *iter, int write)
+{
+	struct bankshot2_block_run *run;
+	char *xmem;
+	int i;
+
+	if (iter->run == iter->nr_runs) {
+		/* Short tails go to the hash index, leave them be */
+		if (iter->end - iter->next <= BANKSHOT2_HASH_MAX_PAGES)
+			return;
+		bankshot2_block_iter_fill(bs2_dev, iter);
+		if (!iter->nr_runs)
+			return;
+	}
+
+	run = &iter->runs[iter->run];
+	if (!run->block)
+		return;
+
+	xmem = bankshot2_get_block(bs2_dev, run->block +
+				(iter->off << bs2_dev->s_blocksize_bits));
+	for (i = 0; i < BANKSHOT2_PREFETCH_LINES; i++) {
+		if (write)
+			prefetchw(xmem + i * CACHELINE_SIZE);
+		else
+			prefetch(xmem + i * CACHELINE_SIZE);
+	}
+}
+
 /* Initialize the inode table. The bankshot2_inode struct corresponding to the
  * inode table has already been zero'd out */
 int bankshot2_init_inode_table(struct bankshot2_device *bs2_dev)
@@ -100,6 +762,7 @@ int bankshot2_init_inode_table(struct bankshot2_device *bs2_dev)
 	pi->height = 0;
 	pi->i_dtime = 0;
 	pi->i_blk_type = BANKSHOT2_BLOCK_TYPE_4K;
+	bankshot2_init_btree_cursor(pi);
 
 	// Allocate 1 block for now
 	num_blocks = (init_inode_table_size + bankshot2_inode_blk_size(pi) - 1) 
@@ -116,7 +779,8 @@ int bankshot2_init_inode_table(struct bankshot2_device *bs2_dev)
 	/* calculate num_blocks in terms of 4k blocksize */
 	num_blocks = num_blocks << (bankshot2_inode_blk_shift(pi) -
 				bs2_dev->s_blocksize_bits);
-	errval = __bankshot2_alloc_blocks(NULL, bs2_dev, pi, 0, num_blocks, true);
+	errval = __bankshot2_alloc_blocks(NULL, bs2_dev, pi, 0, num_blocks, true,
+						NULL);
 
 	if (errval != 0) {
 		bs2_info("Err: initializing the Inode Table: %d\n", errval);
@@ -146,7 +810,7 @@ static int bankshot2_increase_inode_table_size(struct bankshot2_device *bs2_dev)
 
 	errval = __bankshot2_alloc_blocks(trans, bs2_dev, pi,
 			le64_to_cpup(&pi->i_size) >> bs2_dev->s_blocksize_bits,
-			1, true);
+			1, true, NULL);
 
 	if (errval == 0) {
 		u64 i_size = le64_to_cpu(pi->i_size);
@@ -278,15 +942,16 @@ retry:
 	bankshot2_add_logentry(bs2_dev, trans, pi, sizeof(*pi), LE_DATA);
 
 //	bankshot2_memunlock_inode(sb, pi);
-	pi->i_blk_type = BANKSHOT2_DEFAULT_BLOCK_TYPE;
+	pi->i_blk_type = data_block_type;
 //	pi->i_flags = bankshot2_mask_flags(mode, diri->i_flags);
+	pi->i_flags = extent_mapping ? cpu_to_le32(BANKSHOT2_EXTMAP_FL) : 0;
 	pi->height = 0;
 	pi->start_index = ULONG_MAX;
 	pi->root = 0;
 	pi->i_dtime = 0;
 	pi->extent_tree = RB_ROOT;
 	pi->access_tree = RB_ROOT;
-	init_waitqueue_head(&pi->wait_queue);
+	bankshot2_init_btree_cursor(pi);
 //	pi->extent_tree_lock = __RW_LOCK_UNLOCKED(extent_tree_lock);
 	mutex_init(&pi->tree_lock);
 	pi->num_extents = 0;
@@ -575,7 +1240,7 @@ static int bankshot2_free_inode(struct bankshot2_device *bs2_dev,
 
 //	bankshot2_memunlock_inode(sb, pi);
 
-	pi->root = 0;
+	bankshot2_publish_root(pi, 0, 0);
 //	pi->i_links_count = 0;
 //	pi->i_xattr = 0;
 	pi->start_index = ULONG_MAX;
@@ -606,8 +1271,12 @@ static int bankshot2_free_inode(struct bankshot2_device *bs2_dev,
 
 	bankshot2_remove_inode_hash_array(bs2_dev, pi);
 	pi->backup_ino = 0;
-	pi->height = 0;
+	bankshot2_drop_btree_mirror(pi);
+	/* Subtrees of this life of the inode still queued keep off it */
+	spin_lock_bh(&bs2_dev->deferred_lock);
+	pi->free_gen++;
 	pi->i_blocks = 0;
+	spin_unlock_bh(&bs2_dev->deferred_lock);
 out:
 	mutex_unlock(&bs2_dev->inode_table_mutex);
 	return err;
@@ -616,6 +1285,7 @@ out:
 unsigned int bankshot2_free_inode_subtree(struct bankshot2_device *bs2_dev,
 		__le64 root, u32 height, u32 btype, unsigned long last_blocknr)
 {
+	struct bankshot2_free_batch batch;
 	unsigned long first_blocknr;
 	unsigned int freed;
 	bool mpty;
@@ -630,12 +1300,14 @@ unsigned int bankshot2_free_inode_subtree(struct bankshot2_device *bs2_dev,
 	} else {
 		first_blocknr = 0;
 
+		bankshot2_init_free_batch(&batch, btype);
 		freed = recursive_truncate_blocks(bs2_dev, root, height, btype,
-				first_blocknr, last_blocknr, &mpty);
+				first_blocknr, last_blocknr, &mpty, &batch,
+				NULL, -1);
+		bankshot2_finish_free_batch(bs2_dev, &batch);
 		BUG_ON(!mpty);
 		first_blocknr = bankshot2_get_blocknr(le64_to_cpu(root));
-		bankshot2_free_block(bs2_dev, first_blocknr,
-					BANKSHOT2_BLOCK_TYPE_4K);
+		bankshot2_free_meta_block(bs2_dev, first_blocknr);
 	}
 
 	return freed;
@@ -647,6 +1319,7 @@ void bankshot2_evict_inode(struct bankshot2_device *bs2_dev,
 	__le64 root;
 	unsigned long last_blocknr;
 	unsigned int height, btype;
+	bool extmap;
 	int err = 0;
 
 	if (!pi)
@@ -657,6 +1330,7 @@ void bankshot2_evict_inode(struct bankshot2_device *bs2_dev,
 	root = pi->root;
 	height = pi->height;
 	btype = pi->i_blk_type;
+	extmap = bankshot2_is_extmap(pi);
 
 	if (likely(pi->i_size))
 		last_blocknr = (pi->i_size - 1) >>
@@ -664,7 +1338,18 @@ void bankshot2_evict_inode(struct bankshot2_device *bs2_dev,
 	else
 		last_blocknr = 0;
 
-	last_blocknr = bankshot2_sparse_last_blocknr(pi->height, last_blocknr);
+	if (!extmap)
+		last_blocknr = bankshot2_sparse_last_blocknr(height,
+							last_blocknr);
+	/*
+	 * Needs backup_ino, which bankshot2_free_inode clears. Nothing is
+	 * mapped past i_size, so neither is anything indexed.
+	 */
+	if (root)
+		bankshot2_hash_remove_range(bs2_dev, pi, 0,
+				(last_blocknr + 1) <<
+				(bankshot2_inode_blk_shift(pi) -
+				 bs2_dev->s_blocksize_bits));
 	err = bankshot2_free_inode(bs2_dev, pi);
 	if (err) {
 		bs2_info("%s: free_inode failed %d\n", __func__, err);
@@ -672,8 +1357,11 @@ void bankshot2_evict_inode(struct bankshot2_device *bs2_dev,
 	}
 	pi = NULL;
 
-	bankshot2_free_inode_subtree(bs2_dev, root, height, btype,
-					last_blocknr);
+	if (extmap)
+		bankshot2_extmap_free_tree(bs2_dev, le64_to_cpu(root), btype);
+	else
+		bankshot2_free_inode_subtree(bs2_dev, root, height, btype,
+						last_blocknr);
 	bs2_dev->cache_stats.inode_evict++;
 }
 
@@ -288,6 +288,7 @@ int bankshot2_submit_to_cache(struct bankshot2_device *bs2_dev, struct job_descr
 	struct bankshot2_inode *pi;
 	struct bio *bio = jd->bio;
 	struct bio_vec *bvec;
+	struct bankshot2_block_iter iter;
 	unsigned int i;
 	char *buf;
 	unsigned long index;
@@ -299,16 +300,18 @@ int bankshot2_submit_to_cache(struct bankshot2_device *bs2_dev, struct job_descr
 	pi = jd->inode;
 	array_index = (jd->job_offset - jd->start_offset) >> PAGE_SHIFT;
 	index = jd->job_offset >> bs2_dev->s_blocksize_bits;
+	bankshot2_block_iter_init(&iter, pi, index, bio->bi_vcnt - bio->bi_idx);
 
 	bio_for_each_segment(bvec, bio, i) {
+		block = bankshot2_block_iter_next(bs2_dev, &iter);
 		if (void_array[array_index] == 0x1) {
-			block = bankshot2_find_data_block(bs2_dev, pi, index);
 			if (!block) {
 				bs2_info("%s: get block failed, index 0x%lx\n",
 						__func__, index);
 				bio_endio(bio, 0);
 				return -EINVAL;
 			}
+			bankshot2_block_iter_prefetch(bs2_dev, &iter, read);
 			xmem = bankshot2_get_block(bs2_dev, block);
 			buf = kmap_atomic(bvec->bv_page);
 			if (read)
@@ -528,7 +531,7 @@ static unsigned long find_continuous_pages(char *void_array, size_t nr_pages,
 		return 0;
 
 	while(i < nr_pages) {
-		if (void_array[i] == 0)
+		if (void_array[i] != 0x1)
 			break;
 		last = i;
 		i++;
@@ -543,122 +546,67 @@ static unsigned long find_continuous_pages(char *void_array, size_t nr_pages,
 	return (last - *first + 1);	
 }
 
-#if 0
+/*
+ * How many of the length pages from file offset job_offset sit in one
+ * physically contiguous stretch of cache, so that a single copy can target
+ * it; *xmem is set to its start. Returns 0 if the first page has no block.
+ */
 static unsigned long
 find_continuous_cache_pages(struct bankshot2_device *bs2_dev,
-		struct bankshot2_inode *pi, char *void_array, u64 pos,
-		size_t nr_pages, unsigned long start, unsigned long *first,
+		struct bankshot2_inode *pi, u64 job_offset, unsigned long length,
 		char **xmem)
 {
-	unsigned long i = start;
-	unsigned long last = 0;
-	unsigned long index;
-	u64 job_offset;
+	struct bankshot2_block_iter iter;
+	unsigned long num;
 	u64 block;
-	char *start_xmem, *prev_xmem, *new_xmem;
 
-	while(i < nr_pages) {
-		if (void_array[i] == 0x1)
-			break;
-		i++;
-	}
-
-	if (i < nr_pages)
-		*first = i;
-	else
+	bankshot2_block_iter_init(&iter, pi,
+			job_offset >> bs2_dev->s_blocksize_bits, length);
+	block = bankshot2_block_iter_next_run(bs2_dev, &iter, length, &num);
+	if (!block)
 		return 0;
 
-	// Get the start xmem address
-	job_offset = pos + (*first << PAGE_SHIFT);
-	index = job_offset >> bs2_dev->s_blocksize_bits;
-	block = bankshot2_find_data_block(bs2_dev, pi, index);
-	if (!block) {
-		bs2_info("%s: get block failed, index 0x%lx\n",
-			__func__, index);
-		return -EINVAL;
-	}
-	start_xmem = (char *)bankshot2_get_block(bs2_dev, block);
-	prev_xmem = start_xmem;
-	last = *first;
-	i++;
-
-	while(i < nr_pages) {
-		if (void_array[i] == 0)
-			break;
-		job_offset = pos + (i << PAGE_SHIFT);
-		index = job_offset >> bs2_dev->s_blocksize_bits;
-		block = bankshot2_find_data_block(bs2_dev, pi, index);
-		if (!block) {
-			bs2_info("%s: get block failed, index 0x%lx\n",
-				__func__, index);
-			return -EINVAL;
-		}
-		new_xmem = (char *)bankshot2_get_block(bs2_dev, block);
-		if (new_xmem != prev_xmem + PAGE_SIZE) {
-			// Not contiguous
-			break;
-		}
-		prev_xmem = new_xmem;
-		
-		last = i;
-		i++;
-	}
-
-	if (last < *first) {
-		bs2_info("%s: last smaller than first, first %lu, last %lu\n",
-				__func__, *first, last);
-		return 0;
-	}
-
-	*xmem = start_xmem;
-	return (last - *first + 1);	
+	*xmem = (char *)bankshot2_get_block(bs2_dev, block);
+	return num;
 }
-#endif
 
 static size_t do_vfs_cache_fill(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, char *buf, u64 job_offset,
-		u64 start_offset, size_t done, char* void_array, int read)
+		size_t done, int read)
 {
-	unsigned long index;
-	int array_index;
+	struct bankshot2_block_iter iter;
+	unsigned long index, nr_pages, num;
 	u64 block;
 	void *xmem;
-	size_t ret = 0;
-	int i = 0;
+	size_t ret = 0, bytes;
 
 	/* get the file offset and index */
-	array_index = (job_offset - start_offset) >> PAGE_SHIFT;
 	index = job_offset >> bs2_dev->s_blocksize_bits;
+	nr_pages = DIV_ROUND_UP(done, PAGE_SIZE);
+	bankshot2_block_iter_init(&iter, pi, index, nr_pages);
 
-	while(done) {
-		if (void_array[array_index] != 0x1) {
-			bs2_info("%s: ERROR: void_array is zero\n", __func__);
-			goto next;
-		}
-
-		block = bankshot2_find_data_block(bs2_dev, pi, index);
+	/* One copy per run of pages that are contiguous in the cache */
+	while (nr_pages) {
+		block = bankshot2_block_iter_next_run(bs2_dev, &iter,
+							nr_pages, &num);
 		if (!block) {
 			bs2_info("%s: get block failed, index 0x%lx\n",
 					__func__, index);
 			return -EINVAL;
 		}
+		bankshot2_block_iter_prefetch(bs2_dev, &iter, read);
 		xmem = bankshot2_get_block(bs2_dev, block);
+		bytes = num << PAGE_SHIFT;
 		if (read)
-			memcpy(xmem, buf + i * PAGE_SIZE, PAGE_SIZE);
+			memcpy(xmem, buf + ret, bytes);
 		else
-			memcpy(buf + i * PAGE_SIZE, xmem, PAGE_SIZE);
+			memcpy(buf + ret, xmem, bytes);
 		bankshot2_flush_edge_cachelines(
 				index << bs2_dev->s_blocksize_bits,
-				PAGE_SIZE, xmem);
-next:
-		array_index++;
-		index++;
-		i++;
-		if (done < PAGE_SIZE)
-			done = 0;
-		else
-			done -= PAGE_SIZE;
-		ret += PAGE_SIZE;
+				bytes, xmem);
+		index += num;
+		nr_pages -= num;
+		ret += bytes;
 	}
 
 	return ret;
@@ -676,10 +624,12 @@ int bankshot2_copy_to_cache(struct bankshot2_device *bs2_dev,
 	uint8_t result;
 	unsigned long start, first, length;
 	u64 job_offset, start_b_offset;
+	unsigned long contiguous;
 	char *buf;
-//	char *xmem = NULL;
+	char *xmem = NULL;
+	int ret = 0;
 	timing_t vfs_read_time, cache_fill_time, mmap_fill_time;
-//	mm_segment_t old_fs;
+	mm_segment_t old_fs;
 
 	if (required == 0)
 		return 0;
@@ -689,6 +639,7 @@ int bankshot2_copy_to_cache(struct bankshot2_device *bs2_dev,
 	start_b_offset = b_offset;
 
 	nr_pages = count >> bs2_dev->s_blocksize_bits;
+	start = first = 0;
 
 	if (nr_pages == 0 || nr_pages < required)
 	{
@@ -700,47 +651,17 @@ int bankshot2_copy_to_cache(struct bankshot2_device *bs2_dev,
 	file = fget(data->file);
 	if (!file) {
 		bs2_info("fget failed\n");
-		return -EINVAL;
+		ret = -EINVAL;
+		goto out;
 	}
 
 	buf = data->carrier;
 	if (!buf) {
-		fput(file);
-		return -ENOMEM;
+		ret = -ENOMEM;
+		goto out_put;
 	}
 
-	start = first = 0;
 	while(required) {
-		//FIXME: Copy to xmem directly may result in uncontigupus pages
-#if 0
-		length = find_continuous_cache_pages(bs2_dev, pi, void_array, pos,
-						nr_pages, start, &first, &xmem);
-
-		if (length < required)
-			bs2_info("length: %lu, required %lu\n", length, required);
-		if (length == 0 || length > required) {
-			bs2_info("ERROR: Consecutive pages get error, "
-				"required %lu, start %lu, first %lu, "
-				"length %lu\n", required, start, first, length);
-			fput(file);
-			return -EINVAL;
-		}
-
-		b_offset = start_b_offset + (first << PAGE_SHIFT);
-		job_offset = pos + (first << PAGE_SHIFT);
-
-		old_fs = get_fs();
-		set_fs(KERNEL_DS);
-		done = vfs_read(file, xmem, length << PAGE_SHIFT, &b_offset);
-		set_fs(old_fs);
-		if (done >= (unsigned long)(-64)) {
-			bs2_info("vfs read failed, returned %d\n", (int)done);
-			fput(file);
-			return -EINVAL;
-		}
-
-		goto update_length;
-#endif
 		length = find_continuous_pages(void_array, nr_pages,
 						start, &first);
 
@@ -748,8 +669,8 @@ int bankshot2_copy_to_cache(struct bankshot2_device *bs2_dev,
 			bs2_info("ERROR: Consecutive pages get error, "
 				"required %lu, start %lu, first %lu, "
 				"length %lu\n", required, start, first, length);
-			fput(file);
-			return -EINVAL;
+			ret = -EINVAL;
+			goto out_put;
 		}
 
 		b_offset = start_b_offset + (first << PAGE_SHIFT);
@@ -776,11 +697,54 @@ int bankshot2_copy_to_cache(struct bankshot2_device *bs2_dev,
 				 	data->mmap_addr, pos, job_offset,
 					length, b_offset, read,
 					data->read, data->write);
-				return -EINVAL;
+				ret = -EINVAL;
+				goto out_put;
 			}
+			/* Short read: zero the rest of the last page */
+			if (done & (PAGE_SIZE - 1))
+				clear_user((char *)(data->mmap_addr +
+					(job_offset - pos) + done),
+					PAGE_SIZE - (done & (PAGE_SIZE - 1)));
+			done = PAGE_ALIGN(done);
 			goto update_length;
 		}
 
+		/*
+		 * If the whole run is contiguous in the cache, read straight
+		 * into it and skip the carrier. Backing files that can't
+		 * target kernel memory (O_DIRECT) fail here and take the
+		 * carrier path instead.
+		 */
+		contiguous = find_continuous_cache_pages(bs2_dev, pi,
+						job_offset, length, &xmem);
+		if (contiguous == length) {
+			BANKSHOT2_START_TIMING(bs2_dev, vfs_fill_direct_t,
+						vfs_read_time);
+			old_fs = get_fs();
+			set_fs(KERNEL_DS);
+			done = vfs_read(file, (char __user *)xmem,
+					length << PAGE_SHIFT, &b_offset);
+			set_fs(old_fs);
+			BANKSHOT2_END_TIMING(bs2_dev, vfs_fill_direct_t,
+						vfs_read_time);
+			if (done > 0 && done < (unsigned long)(-64)) {
+				/* Short read: zero the rest of the last page */
+				if (done & (PAGE_SIZE - 1))
+					memset(xmem + done, 0, PAGE_SIZE -
+						(done & (PAGE_SIZE - 1)));
+				done = PAGE_ALIGN(done);
+				/* Flushed as the carrier path flushes */
+				bankshot2_flush_edge_cachelines(job_offset,
+							done, xmem);
+				goto update_length;
+			}
+			/*
+			 * Whatever the failed read left in the cache pages
+			 * is overwritten as the carrier path copies in.
+			 */
+			b_offset = start_b_offset + (first << PAGE_SHIFT);
+		}
+
 		if (read) {
 			BANKSHOT2_START_TIMING(bs2_dev, vfs_read_read_t,
 						vfs_read_time);
@@ -800,8 +764,8 @@ int bankshot2_copy_to_cache(struct bankshot2_device *bs2_dev,
 		}
 		if (done >= (unsigned long)(-64)) {
 			bs2_info("vfs read failed, returned %d\n", (int)done);
-			fput(file);
-			return -EINVAL;
+			ret = -EINVAL;
+			goto out_put;
 		}
 
 		bs2_dbg("vfs read: offset %llu, request %lu, done %lu\n",
@@ -813,6 +777,11 @@ int bankshot2_copy_to_cache(struct bankshot2_device *bs2_dev,
 			bs2_dbg("read length unmatch: request %lu, done %lu\n",
 						length << PAGE_SHIFT, done);
 
+		/* The whole last page goes to the cache, so don't let stale
+		 * carrier bytes past a short read follow it */
+		if (done & (PAGE_SIZE - 1))
+			memset(buf + done, 0, PAGE_SIZE - (done & (PAGE_SIZE - 1)));
+
 		if (read) {
 			BANKSHOT2_START_TIMING(bs2_dev, vfs_cache_fill_read_t,
 						cache_fill_time);
@@ -820,8 +789,8 @@ int bankshot2_copy_to_cache(struct bankshot2_device *bs2_dev,
 			BANKSHOT2_START_TIMING(bs2_dev, vfs_cache_fill_write_t,
 						cache_fill_time);
 		}
-		done = do_vfs_cache_fill(bs2_dev, pi, buf, job_offset, pos,
-						done, void_array, 1);
+		done = do_vfs_cache_fill(bs2_dev, pi, buf, job_offset,
+						done, 1);
 
 		if (read) {
 			BANKSHOT2_END_TIMING(bs2_dev, vfs_cache_fill_read_t,
@@ -842,41 +811,92 @@ update_length:
 		start = first + (done >> bs2_dev->s_blocksize_bits);
 	}
 //	atomic64_set(&bs2_dev->last_offset, b_offset);
-	fput(file);
 	bs2_dbg("%s result: %d\n", __func__, result);
 
-	return 0;
+out_put:
+	fput(file);
+out:
+	/* The blocks were not zeroed at allocation; whatever we failed to
+	 * fill must not expose stale data */
+	if (required)
+		bankshot2_zero_unfilled_pages(bs2_dev, pi, pos, void_array,
+					start, nr_pages, 0x1);
+	return ret;
+}
+
+/*
+ * Zero the cache pages flagged in void_array from index start on. Their
+ * blocks were allocated unzeroed because they were to be fully written;
+ * this is the fallback when that write stops short. pos is the file
+ * offset of void_array[0].
+ */
+void bankshot2_zero_unfilled_pages(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, u64 pos, char *void_array,
+		unsigned long start, size_t nr_pages, char flag)
+{
+	unsigned long index = (pos >> bs2_dev->s_blocksize_bits) + start;
+	struct bankshot2_block_iter iter;
+	unsigned long len, num;
+	bool zero;
+	u64 block;
+	void *xmem;
+
+	if (start >= nr_pages)
+		return;
+
+	bankshot2_block_iter_init(&iter, pi, index, nr_pages - start);
+	while (start < nr_pages) {
+		/* A stretch of pages that are all flagged, or none */
+		zero = void_array[start] == flag;
+		for (len = 1; start + len < nr_pages &&
+				(void_array[start + len] == flag) == zero; len++)
+			;
+
+		while (len) {
+			block = bankshot2_block_iter_next_run(bs2_dev, &iter,
+								len, &num);
+			if (zero && block) {
+				xmem = bankshot2_get_block(bs2_dev, block);
+				memset_nt(xmem, 0, num << PAGE_SHIFT);
+			}
+			start += num;
+			len -= num;
+		}
+	}
 }
 
 static int do_fsync_cache_fill(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, char *buf, u64 start_offset,
 		size_t length)
 {
-	unsigned long index;
+	struct bankshot2_block_iter iter;
+	unsigned long index, nr_pages, num;
 	u64 block;
 	void *xmem;
-	int i = 0;
+	size_t bytes;
 
 	index = start_offset >> bs2_dev->s_blocksize_bits;
+	nr_pages = DIV_ROUND_UP(length, PAGE_SIZE);
+	bankshot2_block_iter_init(&iter, pi, index, nr_pages);
 
-	while(length) {
-		block = bankshot2_find_data_block(bs2_dev, pi, index);
+	while (nr_pages) {
+		block = bankshot2_block_iter_next_run(bs2_dev, &iter,
+							nr_pages, &num);
 		if (!block) {
 			bs2_info("%s: get block failed, index 0x%lx\n",
 					__func__, index);
 			return -EINVAL;
 		}
+		bankshot2_block_iter_prefetch(bs2_dev, &iter, 0);
 		xmem = bankshot2_get_block(bs2_dev, block);
-		memcpy(buf + i * PAGE_SIZE, xmem, PAGE_SIZE);
+		bytes = num << PAGE_SHIFT;
+		memcpy(buf, xmem, bytes);
 		bankshot2_flush_edge_cachelines(
 				index << bs2_dev->s_blocksize_bits,
-				PAGE_SIZE, xmem);
-		index++;
-		i++;
-		if (length < PAGE_SIZE)
-			length = 0;
-		else
-			length -= PAGE_SIZE;
+				bytes, xmem);
+		buf += bytes;
+		index += num;
+		nr_pages -= num;
 	}
 
 	return 0;
@@ -856,6 +856,8 @@ int bankshot2_recover_journal(struct bankshot2_device *bs2_dev)
 		bankshot2_recover_redo_journal(bs2_dev);
 	else
 		bankshot2_recover_undo_journal(bs2_dev);
+	/* Rolled back tree slots may still be in the index */
+	bankshot2_clear_hash_index(bs2_dev);
 	return 0;
 }
 
@@ -24,144 +24,831 @@ static void __bankshot2_free_blocknode(struct bankshot2_device *bs2_dev,
 	kmem_cache_free(bs2_dev->bs2_blocknode_cachep, bnode);
 }
 
-static struct bankshot2_blocknode *bankshot2_next_blocknode(
-		struct bankshot2_blocknode *i, struct list_head *head)
+/*
+ * Free space is kept as runs of free blocks, split into placement domains
+ * (see bankshot2_init_domains()). Every run lives in exactly one domain and
+ * is linked into two of its rbtrees: block_free_tree, ordered by block_low,
+ * and block_free_size_tree, ordered by run length (ties broken by block_low).
+ * Allocation is a best-fit lookup in the size tree and free is a neighbour
+ * lookup in the address tree, so both stay O(log n) no matter how
+ * fragmented the cache gets. All domains are protected by s_lock.
+ */
+static inline unsigned long
+bankshot2_blocknode_size(struct bankshot2_blocknode *i)
+{
+	return i->block_high - i->block_low + 1;
+}
+
+static void bankshot2_insert_blocknode_size(struct bankshot2_domain *dom,
+		struct bankshot2_blocknode *new)
+{
+	struct rb_node **temp = &(dom->block_free_size_tree.rb_node);
+	struct rb_node *parent = NULL;
+	struct bankshot2_blocknode *curr;
+	unsigned long size = bankshot2_blocknode_size(new);
+
+	while (*temp) {
+		curr = container_of(*temp, struct bankshot2_blocknode,
+					size_node);
+		parent = *temp;
+
+		if (size < bankshot2_blocknode_size(curr) ||
+				(size == bankshot2_blocknode_size(curr) &&
+				 new->block_low < curr->block_low))
+			temp = &((*temp)->rb_left);
+		else
+			temp = &((*temp)->rb_right);
+	}
+
+	rb_link_node(&new->size_node, parent, temp);
+	rb_insert_color(&new->size_node, &dom->block_free_size_tree);
+}
+
+static void bankshot2_insert_blocknode(struct bankshot2_domain *dom,
+		struct bankshot2_blocknode *new)
+{
+	struct rb_node **temp = &(dom->block_free_tree.rb_node);
+	struct rb_node *parent = NULL;
+	struct bankshot2_blocknode *curr;
+
+	while (*temp) {
+		curr = container_of(*temp, struct bankshot2_blocknode,
+					addr_node);
+		parent = *temp;
+
+		if (new->block_low < curr->block_low)
+			temp = &((*temp)->rb_left);
+		else
+			temp = &((*temp)->rb_right);
+	}
+
+	rb_link_node(&new->addr_node, parent, temp);
+	rb_insert_color(&new->addr_node, &dom->block_free_tree);
+
+	bankshot2_insert_blocknode_size(dom, new);
+}
+
+static void bankshot2_remove_blocknode(struct bankshot2_domain *dom,
+		struct bankshot2_blocknode *i)
+{
+	rb_erase(&i->addr_node, &dom->block_free_tree);
+	rb_erase(&i->size_node, &dom->block_free_size_tree);
+}
+
+/*
+ * Change the range of a free run. Runs never overlap, so the address order
+ * is unaffected and only the size tree needs to be fixed up.
+ */
+static void bankshot2_resize_blocknode(struct bankshot2_domain *dom,
+		struct bankshot2_blocknode *i, unsigned long block_low,
+		unsigned long block_high)
 {
-	if (list_is_last(&i->link, head))
+	rb_erase(&i->size_node, &dom->block_free_size_tree);
+	i->block_low = block_low;
+	i->block_high = block_high;
+	bankshot2_insert_blocknode_size(dom, i);
+}
+
+static inline struct bankshot2_blocknode *
+bankshot2_next_blocknode(struct bankshot2_blocknode *i)
+{
+	struct rb_node *next = rb_next(&i->addr_node);
+
+	if (!next)
 		return NULL;
-	return list_first_entry(&i->link, typeof(*i), link);
+	return container_of(next, struct bankshot2_blocknode, addr_node);
 }
 
-int bankshot2_new_block(struct bankshot2_device *bs2_dev,
-		unsigned long *blocknr, unsigned short btype, int zero)
+/* Find the free run with the highest block_low <= blocknr */
+static struct bankshot2_blocknode *
+bankshot2_find_prev_blocknode(struct bankshot2_domain *dom,
+		unsigned long blocknr)
+{
+	struct rb_node *temp = dom->block_free_tree.rb_node;
+	struct bankshot2_blocknode *curr, *prev = NULL;
+
+	while (temp) {
+		curr = container_of(temp, struct bankshot2_blocknode,
+					addr_node);
+
+		if (blocknr < curr->block_low) {
+			temp = temp->rb_left;
+		} else {
+			prev = curr;
+			temp = temp->rb_right;
+		}
+	}
+
+	return prev;
+}
+
+/* Find the smallest free run with at least num_blocks blocks */
+static struct bankshot2_blocknode *
+bankshot2_find_fit_blocknode(struct bankshot2_domain *dom,
+		unsigned long num_blocks)
+{
+	struct rb_node *temp = dom->block_free_size_tree.rb_node;
+	struct bankshot2_blocknode *curr, *fit = NULL;
+
+	while (temp) {
+		curr = container_of(temp, struct bankshot2_blocknode,
+					size_node);
+
+		if (bankshot2_blocknode_size(curr) >= num_blocks) {
+			fit = curr;
+			temp = temp->rb_left;
+		} else {
+			temp = temp->rb_right;
+		}
+	}
+
+	return fit;
+}
+
+/* Remove [new_block_low, new_block_high] from free run i.
+ * Caller must hold s_lock. */
+static int __bankshot2_carve_blocknode(struct bankshot2_device *bs2_dev,
+		struct bankshot2_domain *dom, struct bankshot2_blocknode *i,
+		unsigned long new_block_low, unsigned long new_block_high)
 {
-	struct list_head *head = &(bs2_dev->block_inuse_head);
-	struct bankshot2_blocknode *i, *next_i;
-	struct bankshot2_blocknode *free_blocknode = NULL;
-	void *bp;
-	unsigned long num_blocks = 0;
 	struct bankshot2_blocknode *curr_node;
-	int errval = 0;
-	bool found = 0;
-	unsigned long next_block_low;
+
+	if ((new_block_low == i->block_low) &&
+		(new_block_high == i->block_high)) {
+		/* Takes the whole free run */
+		bankshot2_remove_blocknode(dom, i);
+		__bankshot2_free_blocknode(bs2_dev, i);
+		bs2_dev->num_blocknode_allocated--;
+	} else if (new_block_low == i->block_low) {
+		/* Aligns to left */
+		bankshot2_resize_blocknode(dom, i, new_block_high + 1,
+						i->block_high);
+	} else if (new_block_high == i->block_high) {
+		/* Aligns to right */
+		bankshot2_resize_blocknode(dom, i, i->block_low,
+						new_block_low - 1);
+	} else {
+		/* Aligns somewhere in the middle */
+		curr_node = bankshot2_alloc_blocknode(bs2_dev);
+		if (curr_node == NULL)
+			return -ENOSPC;
+		curr_node->block_low = new_block_high + 1;
+		curr_node->block_high = i->block_high;
+		bankshot2_resize_blocknode(dom, i, i->block_low,
+						new_block_low - 1);
+		bankshot2_insert_blocknode(dom, curr_node);
+	}
+
+	dom->num_free -= new_block_high - new_block_low + 1;
+	return 0;
+}
+
+/*
+ * Carve num_blocks blocks starting at an align boundary (power of two)
+ * out of one domain.
+ * Caller must hold s_lock. Does not touch num_free_blocks.
+ */
+static int __bankshot2_domain_alloc_run(struct bankshot2_device *bs2_dev,
+		struct bankshot2_domain *dom, unsigned long num_blocks,
+		unsigned long align, unsigned long *blocknr)
+{
+	struct bankshot2_blocknode *i = NULL;
+	struct rb_node *temp;
+	unsigned long new_block_low = 0;
+	unsigned long new_block_high = 0;
+
+	/*
+	 * Best fit. Runs are visited in size order; a run that is big enough
+	 * can still fail the alignment check, in which case we move on to
+	 * the next larger one.
+	 */
+	i = bankshot2_find_fit_blocknode(dom, num_blocks);
+	while (i) {
+		new_block_low = (i->block_low + align - 1) & ~(align - 1);
+		new_block_high = new_block_low + num_blocks - 1;
+
+		if (new_block_high <= i->block_high)
+			break;
+
+		temp = rb_next(&i->size_node);
+		i = temp ? container_of(temp, struct bankshot2_blocknode,
+					size_node) : NULL;
+	}
+
+	if (!i)
+		return -ENOSPC;
+
+	if (__bankshot2_carve_blocknode(bs2_dev, dom, i, new_block_low,
+					new_block_high))
+		return -ENOSPC;
+
+	*blocknr = new_block_low;
+	return 0;
+}
+
+/*
+ * Carve as many units of unit blocks as the largest free run of one domain
+ * can give, up to max_units. Returns the number of units, or -ENOSPC.
+ * Caller must hold s_lock. Does not touch num_free_blocks.
+ */
+static long __bankshot2_domain_alloc_largest(struct bankshot2_device *bs2_dev,
+		struct bankshot2_domain *dom, unsigned long unit,
+		unsigned long max_units, unsigned long *blocknr)
+{
+	struct bankshot2_blocknode *i;
+	struct rb_node *temp;
 	unsigned long new_block_low;
-	unsigned long new_block_high;
+	unsigned long units;
 
-	num_blocks = bankshot2_get_numblocks(btype);
+	temp = rb_last(&dom->block_free_size_tree);
+	if (!temp)
+		return -ENOSPC;
+
+	i = container_of(temp, struct bankshot2_blocknode, size_node);
+	new_block_low = (i->block_low + unit - 1) & ~(unit - 1);
+	if (new_block_low > i->block_high)
+		return -ENOSPC;
+
+	units = min((i->block_high - new_block_low + 1) / unit, max_units);
+	if (units == 0)
+		return -ENOSPC;
+
+	if (__bankshot2_carve_blocknode(bs2_dev, dom, i, new_block_low,
+					new_block_low + units * unit - 1))
+		return -ENOSPC;
+
+	*blocknr = new_block_low;
+	return units;
+}
+
+/*
+ * Fill order[] with the domains to allocate from, best first: the domains
+ * on the calling CPU's node, starting at the next stripe in rotation so
+ * that consecutive allocations spread over the stripes, then the domains of
+ * the other nodes. Returns the number of entries.
+ */
+static int bankshot2_domain_order(struct bankshot2_device *bs2_dev,
+		int *order)
+{
+	int nid = cpu_to_node(raw_smp_processor_id());
+	int i, rank, local = 0, n = 0;
+	unsigned int first;
+
+	for (i = 0; i < bs2_dev->num_domains; i++)
+		if (bs2_dev->domains[i].nid == nid)
+			local++;
+
+	if (local) {
+		first = (unsigned int)atomic_inc_return(
+					&bs2_dev->domain_rotor) % local;
+		for (i = 0, rank = 0; i < bs2_dev->num_domains; i++)
+			if (bs2_dev->domains[i].nid == nid && rank++ >= first)
+				order[n++] = i;
+		for (i = 0, rank = 0; i < bs2_dev->num_domains; i++)
+			if (bs2_dev->domains[i].nid == nid && rank++ < first)
+				order[n++] = i;
+	}
+
+	for (i = 0; i < bs2_dev->num_domains; i++)
+		if (bs2_dev->domains[i].nid != nid)
+			order[n++] = i;
+
+	return n;
+}
+
+/* Find the domain blocknr belongs to. Domains are sorted by address. */
+static struct bankshot2_domain *
+bankshot2_block_domain(struct bankshot2_device *bs2_dev,
+		unsigned long blocknr)
+{
+	int low = 0, high = bs2_dev->num_domains - 1, mid;
+	struct bankshot2_domain *dom;
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+		dom = &bs2_dev->domains[mid];
+		if (blocknr < dom->block_low)
+			high = mid - 1;
+		else if (blocknr > dom->block_high)
+			low = mid + 1;
+		else
+			return dom;
+	}
+
+	return NULL;
+}
+
+/*
+ * Carve num_blocks blocks starting at an align boundary (power of two),
+ * trying the domains in preference order.
+ * Caller must hold s_lock. Does not touch num_free_blocks.
+ */
+static int __bankshot2_alloc_run(struct bankshot2_device *bs2_dev,
+		unsigned long num_blocks, unsigned long align,
+		unsigned long *blocknr)
+{
+	int order[BANKSHOT2_MAX_DOMAINS];
+	int i, n;
+
+	n = bankshot2_domain_order(bs2_dev, order);
+	for (i = 0; i < n; i++)
+		if (__bankshot2_domain_alloc_run(bs2_dev,
+				&bs2_dev->domains[order[i]], num_blocks,
+				align, blocknr) == 0)
+			return 0;
+
+	return -ENOSPC;
+}
+
+/*
+ * Carve up to max_units physically contiguous units of unit blocks each.
+ * Takes the best fitting run of the most preferred domain that has one,
+ * otherwise as much of the largest free run as is usable. Returns the
+ * number of units, or -ENOSPC.
+ * Caller must hold s_lock. Does not touch num_free_blocks.
+ */
+static long __bankshot2_alloc_range(struct bankshot2_device *bs2_dev,
+		unsigned long unit, unsigned long max_units,
+		unsigned long *blocknr)
+{
+	int order[BANKSHOT2_MAX_DOMAINS];
+	int i, n;
+	long units;
+
+	n = bankshot2_domain_order(bs2_dev, order);
+	for (i = 0; i < n; i++)
+		if (__bankshot2_domain_alloc_run(bs2_dev,
+				&bs2_dev->domains[order[i]], unit * max_units,
+				unit, blocknr) == 0)
+			return max_units;
+
+	/* Nothing big enough, take what the largest run can give */
+	for (i = 0; i < n; i++) {
+		units = __bankshot2_domain_alloc_largest(bs2_dev,
+				&bs2_dev->domains[order[i]], unit, max_units,
+				blocknr);
+		if (units > 0)
+			return units;
+	}
+
+	return -ENOSPC;
+}
+
+static int __bankshot2_free_run(struct bankshot2_device *bs2_dev,
+		unsigned long blocknr, unsigned long num_blocks,
+		struct bankshot2_blocknode **start_hint);
+
+/*
+ * Allocator latency accounting. Samples go into per-CPU log2 histograms so
+ * that the hot paths never share a cache line; bankshot2_get_alloc_stats()
+ * folds them together.
+ */
+static inline u64 bankshot2_elapsed_ns(timing_t *start)
+{
+	timing_t end;
+
+	getrawmonotonic(&end);
+	return (end.tv_sec - start->tv_sec) * NSEC_PER_SEC +
+		(end.tv_nsec - start->tv_nsec);
+}
+
+static void bankshot2_account_latency(struct bankshot2_device *bs2_dev,
+		int type, u64 ns)
+{
+	struct bankshot2_alloc_lat *lat;
+	int bucket = min_t(int, fls64(ns), BANKSHOT2_HIST_BUCKETS - 1);
+
+	lat = get_cpu_ptr(bs2_dev->alloc_lat);
+	lat->hist[type][bucket]++;
+	lat->total_ns[type] += ns;
+	if (ns > lat->max_ns[type])
+		lat->max_ns[type] = ns;
+	put_cpu_ptr(bs2_dev->alloc_lat);
+}
+
+/* Take s_lock. Only contended acquisitions pay for the clock reads. */
+static void bankshot2_lock_blocks(struct bankshot2_device *bs2_dev)
+{
+	timing_t start;
 
+	if (mutex_trylock(&bs2_dev->s_lock)) {
+		bankshot2_account_latency(bs2_dev, BANKSHOT2_LAT_LOCK_WAIT, 0);
+		return;
+	}
+
+	getrawmonotonic(&start);
 	mutex_lock(&bs2_dev->s_lock);
+	bankshot2_account_latency(bs2_dev, BANKSHOT2_LAT_LOCK_WAIT,
+					bankshot2_elapsed_ns(&start));
+}
 
-	list_for_each_entry(i, head, link) {
-		if (i->link.next == head) {
-			next_i = NULL;
-			next_block_low = bs2_dev->block_end;
-		} else {
-			next_i = list_entry(i->link.next, typeof(*i), link);
-			next_block_low = next_i->block_low;
+/*
+ * Per-CPU magazines. Each CPU keeps a small stack of free 4K blocks so that
+ * the common single block alloc/free only takes the (uncontended) magazine
+ * spinlock. Magazines are refilled from and drained to the free trees
+ * BANKSHOT2_MAGAZINE_BATCH blocks at a time under one s_lock hold. Blocks
+ * sitting in a magazine still count as free in num_free_blocks.
+ */
+static inline struct bankshot2_magazine *
+bankshot2_get_magazine(struct bankshot2_device *bs2_dev)
+{
+	return per_cpu_ptr(bs2_dev->magazines, raw_smp_processor_id());
+}
+
+static void bankshot2_drain_blocks(struct bankshot2_device *bs2_dev,
+		unsigned long *blocks, int num)
+{
+	struct bankshot2_blocknode *start_hint = NULL;
+	int i;
+
+	bankshot2_lock_blocks(bs2_dev);
+	for (i = 0; i < num; i++)
+		__bankshot2_free_run(bs2_dev, blocks[i], 1, &start_hint);
+	mutex_unlock(&bs2_dev->s_lock);
+}
+
+static void bankshot2_refill_magazine(struct bankshot2_device *bs2_dev,
+		struct bankshot2_magazine *mag)
+{
+	unsigned long blocks[BANKSHOT2_MAGAZINE_BATCH];
+	int i, num;
+
+	bankshot2_lock_blocks(bs2_dev);
+	for (num = 0; num < BANKSHOT2_MAGAZINE_BATCH; num++) {
+		if (__bankshot2_alloc_run(bs2_dev, 1, 1, &blocks[num]))
+			break;
+	}
+	mutex_unlock(&bs2_dev->s_lock);
+
+	/* Push in reverse so the lowest block is handed out first */
+	spin_lock(&mag->lock);
+	for (i = num - 1; i >= 0 && mag->count < BANKSHOT2_MAGAZINE_SIZE; i--)
+		mag->blocks[mag->count++] = blocks[i];
+	spin_unlock(&mag->lock);
+
+	/* Someone else refilled it meanwhile */
+	if (i >= 0)
+		bankshot2_drain_blocks(bs2_dev, blocks, i + 1);
+}
+
+static int bankshot2_magazine_alloc(struct bankshot2_device *bs2_dev,
+		unsigned long *blocknr)
+{
+	struct bankshot2_magazine *mag = bankshot2_get_magazine(bs2_dev);
+
+	spin_lock(&mag->lock);
+	if (mag->count == 0) {
+		spin_unlock(&mag->lock);
+		bankshot2_refill_magazine(bs2_dev, mag);
+		spin_lock(&mag->lock);
+		if (mag->count == 0) {
+			spin_unlock(&mag->lock);
+			return -ENOSPC;
 		}
+	}
+	*blocknr = mag->blocks[--mag->count];
+	spin_unlock(&mag->lock);
 
-		new_block_low = (i->block_high + num_blocks) & ~(num_blocks - 1);
-		new_block_high = new_block_low + num_blocks - 1;
+	return 0;
+}
 
-		if (new_block_high >= next_block_low) {
-			/* Does not fit - skip to next blocknode */
-			continue;
+static void bankshot2_magazine_free(struct bankshot2_device *bs2_dev,
+		unsigned long blocknr)
+{
+	struct bankshot2_magazine *mag = bankshot2_get_magazine(bs2_dev);
+	unsigned long blocks[BANKSHOT2_MAGAZINE_BATCH];
+	int num = 0;
+
+	spin_lock(&mag->lock);
+	if (mag->count == BANKSHOT2_MAGAZINE_SIZE) {
+		/* Full. Return the oldest batch to the free trees */
+		num = BANKSHOT2_MAGAZINE_BATCH;
+		memcpy(blocks, mag->blocks, num * sizeof(blocks[0]));
+		memmove(mag->blocks, mag->blocks + num,
+			(mag->count - num) * sizeof(blocks[0]));
+		mag->count -= num;
+	}
+	mag->blocks[mag->count++] = blocknr;
+	spin_unlock(&mag->lock);
+
+	if (num)
+		bankshot2_drain_blocks(bs2_dev, blocks, num);
+}
+
+/* Give every cached block back to the free trees */
+static void bankshot2_drain_magazines(struct bankshot2_device *bs2_dev)
+{
+	struct bankshot2_magazine *mag;
+	unsigned long blocks[BANKSHOT2_MAGAZINE_BATCH];
+	int cpu, num;
+
+	for_each_possible_cpu(cpu) {
+		mag = per_cpu_ptr(bs2_dev->magazines, cpu);
+		do {
+			spin_lock(&mag->lock);
+			num = min_t(int, mag->count, BANKSHOT2_MAGAZINE_BATCH);
+			mag->count -= num;
+			memcpy(blocks, mag->blocks + mag->count,
+				num * sizeof(blocks[0]));
+			spin_unlock(&mag->lock);
+
+			if (num)
+				bankshot2_drain_blocks(bs2_dev, blocks, num);
+		} while (num);
+	}
+}
+
+/*
+ * Take up to max contiguous blocks off the zeroed pool. Returns the number
+ * of blocks taken, 0 if the pool is empty. Pool blocks are still counted
+ * in num_free_blocks; the caller does the accounting.
+ */
+static unsigned long bankshot2_zero_pool_alloc(struct bankshot2_device *bs2_dev,
+		unsigned long *blocknr, unsigned long max)
+{
+	unsigned long num = 0;
+	int count, low;
+
+	spin_lock(&bs2_dev->zero_pool_lock);
+	count = bs2_dev->zero_pool_count;
+	if (count) {
+		*blocknr = bs2_dev->zero_pool[--count];
+		num = 1;
+		while (num < max && count &&
+				bs2_dev->zero_pool[count - 1] == *blocknr + num) {
+			count--;
+			num++;
 		}
+		bs2_dev->zero_pool_count = count;
+	}
+	low = count < BANKSHOT2_ZERO_POOL_LOW;
+	spin_unlock(&bs2_dev->zero_pool_lock);
 
-		if ((new_block_low == (i->block_high + 1)) &&
-			(new_block_high == (next_block_low - 1)))
-		{
-			/* Fill the gap completely */
-			if (next_i) {
-				i->block_high = next_i->block_high;
-				list_del(&next_i->link);
-				free_blocknode = next_i;
-				bs2_dev->num_blocknode_allocated--;
-			} else {
-				i->block_high = new_block_high;
-			}
-			found = 1;
+	if (low)
+		bankshot2_wakeup_zero_thread(bs2_dev);
+
+	return num;
+}
+
+static void bankshot2_refill_zero_pool(struct bankshot2_device *bs2_dev)
+{
+	unsigned long blocknr;
+	long units;
+	int room, i;
+	void *bp;
+
+	while (!kthread_should_stop()) {
+		spin_lock(&bs2_dev->zero_pool_lock);
+		room = BANKSHOT2_ZERO_POOL_SIZE - bs2_dev->zero_pool_count;
+		spin_unlock(&bs2_dev->zero_pool_lock);
+		if (room == 0)
 			break;
-		}
 
-		if ((new_block_low == (i->block_high + 1)) &&
-			(new_block_high < (next_block_low - 1))) {
-			/* Aligns to left */
-			i->block_high = new_block_high;
-			found = 1;
+		/* Don't hoard blocks the cache is about to evict for */
+		if (bankshot2_count_free_blocks(bs2_dev) <
+				BANKSHOT2_ZERO_POOL_SIZE * 2)
 			break;
-		}
 
-		if ((new_block_low > (i->block_high + 1)) &&
-			(new_block_high == (next_block_low - 1))) {
-			/* Aligns to right */
-			if (next_i) {
-				/* right node exist */
-				next_i->block_low = new_block_low;
-			} else {
-				/* right node does NOT exist */
-				curr_node = bankshot2_alloc_blocknode(bs2_dev);
-				BUG_ON(!curr_node);
-				if (curr_node == NULL) {
-					errval = -ENOSPC;
-					break;
-				}
-				curr_node->block_low = new_block_low;
-				curr_node->block_high = new_block_high;
-				list_add(&curr_node->link, &i->link);
-			}
-			found = 1;
+		bankshot2_lock_blocks(bs2_dev);
+		units = __bankshot2_alloc_range(bs2_dev, 1,
+				min(room, BANKSHOT2_ZERO_POOL_BATCH), &blocknr);
+		mutex_unlock(&bs2_dev->s_lock);
+		if (units < 0)
 			break;
-		}
 
-		if ((new_block_low > (i->block_high + 1)) &&
-			(new_block_high < (next_block_low - 1))) {
-			/* Aligns somewhere in the middle */
-			curr_node = bankshot2_alloc_blocknode(bs2_dev);
-			BUG_ON(!curr_node);
-			if (curr_node == NULL) {
-				errval = -ENOSPC;
-				break;
-			}
-			curr_node->block_low = new_block_low;
-			curr_node->block_high = new_block_high;
-			list_add(&curr_node->link, &i->link);
-			found = 1;
+		bp = bankshot2_get_block(bs2_dev, bankshot2_get_block_off(bs2_dev,
+					blocknr, BANKSHOT2_BLOCK_TYPE_4K));
+		memset_nt(bp, 0, (size_t)units << PAGE_SHIFT);
+
+		/* Only this thread pushes, so the room is still there.
+		 * Push in reverse so the lowest block is on top. */
+		spin_lock(&bs2_dev->zero_pool_lock);
+		for (i = units - 1; i >= 0; i--)
+			bs2_dev->zero_pool[bs2_dev->zero_pool_count++] =
+							blocknr + i;
+		spin_unlock(&bs2_dev->zero_pool_lock);
+
+		cond_resched();
+	}
+}
+
+static int bankshot2_zero_thread(void *arg)
+{
+	struct bankshot2_device *bs2_dev = (struct bankshot2_device *)arg;
+
+	bs2_dbg("Running zeroing thread\n");
+	set_user_nice(current, 19);
+	for (;;) {
+		wait_event_interruptible(bs2_dev->zero_wait,
+				bs2_dev->zero_pool_wanted ||
+				!list_empty(&bs2_dev->deferred_list) ||
+				kthread_should_stop());
+
+		if (kthread_should_stop())
 			break;
-		}
+
+		bankshot2_free_deferred_blocks(bs2_dev);
+		if (!bs2_dev->zero_pool_wanted)
+			continue;
+
+		bs2_dev->zero_pool_wanted = 0;
+		bankshot2_refill_zero_pool(bs2_dev);
 	}
-	
-	if (found == 1) {
-		bs2_dev->num_free_blocks -= num_blocks;
-	}	
+	bs2_dbg("Exiting zeroing thread\n");
+	return 0;
+}
 
-	mutex_unlock(&bs2_dev->s_lock);
+void bankshot2_wakeup_zero_thread(struct bankshot2_device *bs2_dev)
+{
+	bs2_dev->zero_pool_wanted = 1;
+	wake_up_interruptible(&bs2_dev->zero_wait);
+}
 
-	if (free_blocknode)
-		__bankshot2_free_blocknode(bs2_dev, free_blocknode);
+int bankshot2_zero_thread_run(struct bankshot2_device *bs2_dev)
+{
+	bs2_dev->zero_thread = kthread_run(bankshot2_zero_thread,
+		bs2_dev, "bankshot2_zero_0x%lx", bs2_dev->phys_addr);
+	if (IS_ERR(bs2_dev->zero_thread)) {
+		bs2_info("Failed to start bankshot2 zeroing thread\n");
+		bs2_dev->zero_thread = NULL;
+		return -1;
+	}
+	bs2_info("Start bankshot2 zeroing thread.\n");
+	return 0;
+}
 
-	if (found == 0) {
-		return -ENOSPC;
+void bankshot2_zero_thread_stop(struct bankshot2_device *bs2_dev)
+{
+	if (bs2_dev->zero_thread) {
+		bs2_info("Stop bankshot2 zeroing thread.\n");
+		kthread_stop(bs2_dev->zero_thread);
+		bs2_dev->zero_thread = NULL;
 	}
+}
+
+int bankshot2_new_block(struct bankshot2_device *bs2_dev,
+		unsigned long *blocknr, unsigned short btype, int zero)
+{
+	void *bp;
+	unsigned long num_blocks = 0;
+	unsigned long new_block_low = 0;
+	timing_t start;
+	int errval;
+
+	if (measure_timing)
+		getrawmonotonic(&start);
+
+	num_blocks = bankshot2_get_numblocks(btype);
+
+	if (num_blocks == 1 && zero &&
+			bankshot2_zero_pool_alloc(bs2_dev, &new_block_low, 1)) {
+		bs2_dev->zero_pool_hit++;
+		zero = 0;
+		goto found;
+	}
+
+retry:
+	if (num_blocks == 1) {
+		errval = bankshot2_magazine_alloc(bs2_dev, &new_block_low);
+	} else {
+		bankshot2_lock_blocks(bs2_dev);
+		errval = __bankshot2_alloc_run(bs2_dev, num_blocks,
+						num_blocks, &new_block_low);
+		mutex_unlock(&bs2_dev->s_lock);
+	}
+
+	if (errval) {
+		/* Free blocks may be stranded in other CPUs' magazines */
+		bankshot2_drain_magazines(bs2_dev);
+		bankshot2_lock_blocks(bs2_dev);
+		errval = __bankshot2_alloc_run(bs2_dev, num_blocks,
+						num_blocks, &new_block_low);
+		mutex_unlock(&bs2_dev->s_lock);
+		/* The zeroed pool is the last resort */
+		if (errval && (num_blocks != 1 ||
+				!bankshot2_zero_pool_alloc(bs2_dev,
+						&new_block_low, 1))) {
+			/* Short of waiting for evicted subtrees */
+			if (bankshot2_reclaim_deferred(bs2_dev))
+				goto retry;
+			return -ENOSPC;
+		}
+		if (errval)
+			zero = 0;
+	}
+
+found:
+	percpu_counter_sub(&bs2_dev->num_free_blocks, num_blocks);
 
 	if (zero) {
 		size_t size;
+		bs2_dev->zero_pool_miss += num_blocks;
 		bp = bankshot2_get_block(bs2_dev,
 			bankshot2_get_block_off(bs2_dev, new_block_low, btype));
 //		bankshot2_memunlock_block(bs2_dev, bp); //TBDTBD: Need to fix this
-		if (btype == BANKSHOT2_BLOCK_TYPE_4K)
-			size = 0x1 << 12;
-		else if (btype == BANKSHOT2_BLOCK_TYPE_2M)
-			size = 0x1 << 21;
-		else
-			size = 0x1 << 30;
+		size = (size_t)1 << blk_type_to_shift[btype];
 		memset_nt(bp, 0, size);
 //		bankshot2_memlock_block(bs2_dev, bp);
 	}
 	*blocknr = new_block_low;
 
+	if (measure_timing)
+		bankshot2_account_latency(bs2_dev, BANKSHOT2_LAT_ALLOC,
+					bankshot2_elapsed_ns(&start));
 	bs2_dbg("Allocate block at %lu\n", new_block_low);
-	return errval;
+	return 0;
+}
+
+/*
+ * Allocate up to *num physically contiguous blocks of type btype.
+ * Best effort: on return *num holds the number of blocks actually
+ * allocated, which is at least one. Callers wanting more keep calling
+ * for the remainder.
+ */
+int bankshot2_new_blocks(struct bankshot2_device *bs2_dev,
+		unsigned long *blocknr, unsigned long *num, unsigned short btype,
+		int zero)
+{
+	void *bp;
+	unsigned long num_blocks;
+	unsigned long new_block_low = 0;
+	timing_t start;
+	long units;
+
+	if (*num <= 1) {
+		*num = 1;
+		return bankshot2_new_block(bs2_dev, blocknr, btype, zero);
+	}
+
+	if (measure_timing)
+		getrawmonotonic(&start);
+
+	num_blocks = bankshot2_get_numblocks(btype);
+
+	if (zero && num_blocks == 1) {
+		units = bankshot2_zero_pool_alloc(bs2_dev, &new_block_low,
+							*num);
+		if (units) {
+			bs2_dev->zero_pool_hit += units;
+			percpu_counter_sub(&bs2_dev->num_free_blocks, units);
+			*blocknr = new_block_low;
+			*num = units;
+			goto out;
+		}
+	}
+
+	bankshot2_lock_blocks(bs2_dev);
+	units = __bankshot2_alloc_range(bs2_dev, num_blocks, *num,
+					&new_block_low);
+	mutex_unlock(&bs2_dev->s_lock);
+
+	if (units < 0) {
+		/* Free space is down to the magazines */
+		*num = 1;
+		return bankshot2_new_block(bs2_dev, blocknr, btype, zero);
+	}
+
+	percpu_counter_sub(&bs2_dev->num_free_blocks, units * num_blocks);
+
+	if (zero) {
+		bs2_dev->zero_pool_miss += units * num_blocks;
+		bp = bankshot2_get_block(bs2_dev,
+			bankshot2_get_block_off(bs2_dev, new_block_low, btype));
+		memset_nt(bp, 0, (size_t)units << blk_type_to_shift[btype]);
+	}
+
+	*blocknr = new_block_low;
+	*num = units;
+
+	bs2_dbg("Allocate %ld blocks at %lu\n", units, new_block_low);
+out:
+	if (measure_timing)
+		bankshot2_account_latency(bs2_dev, BANKSHOT2_LAT_ALLOC,
+					bankshot2_elapsed_ns(&start));
+	return 0;
+}
+
+/*
+ * Switch the inode to a new root and height. root and height share the
+ * inode's first 16 bytes and are swapped with one cmpxchg16b, so a crash
+ * can't tear them; lockless lookups read them through
+ * bankshot2_read_root(), so they can't either. Whatever root points to
+ * must be in place before this is called.
+ */
+void bankshot2_publish_root(struct bankshot2_inode *pi, __le64 root,
+		u32 height)
+{
+	char b[8];
+
+	spin_lock(&pi->cursor.lock);
+	write_seqcount_begin(&pi->cursor.seq);
+	*(u64 *)b = *(u64 *)pi;
+	/* pi->height at offset 2 from pi */
+	b[2] = (u8)height;
+	cmpxchg_double_local((u64 *)pi, &pi->root, *(u64 *)pi, pi->root,
+		*(u64 *)b, root);
+	write_seqcount_end(&pi->cursor.seq);
+	spin_unlock(&pi->cursor.lock);
 }
 
 static int bankshot2_increase_btree_height(struct bankshot2_device *bs2_dev,
@@ -176,6 +863,7 @@ static int bankshot2_increase_btree_height(struct bankshot2_device *bs2_dev,
 	unsigned int newroot = 0;
 
 	bs2_dbg("increasing tree height %x:%x\n", height, new_height);
+	bankshot2_btree_changed(pi);
 
 	/* If the tree is growing from 0 to 2 or more, we should be careful
 	 * about root assignment */
@@ -208,9 +896,9 @@ static int bankshot2_increase_btree_height(struct bankshot2_device *bs2_dev,
 		height++;
 	}
 //	bankshot2_memunlock_inode(bs2_dev, pi);
-	pi->root = prev_root;
-	pi->height = height;
+	bankshot2_publish_root(pi, prev_root, height);
 //	bankshot2_memlock_inode(bs2_dev, pi);
+	bankshot2_drop_btree_mirror(pi);
 	return errval;
 }
 
@@ -219,11 +907,13 @@ static void bankshot2_decrease_btree_height(struct bankshot2_device *bs2_dev,
 {
 	unsigned int height = pi->height, new_height = 0;
 	unsigned long blocknr, last_blocknr;
+	unsigned long unlinked[3];
+	int i, nr_unlinked = 0;
 	__le64 *root;
-	char b[8];
 
 	bs2_dbg("pi blocks %llu, height %u\n", pi->i_blocks, height);
-	if (pi->i_blocks == 0 || newsize == 0)
+	/* i_blocks lags behind for subtrees still being freed */
+	if (!newroot || pi->i_blocks == 0 || newsize == 0)
 		goto update_root_and_height;
 
 	last_blocknr = ((newsize + bankshot2_inode_blk_size(pi) - 1) >>
@@ -242,6 +932,8 @@ static void bankshot2_decrease_btree_height(struct bankshot2_device *bs2_dev,
 		BUG();
 	}
 
+	bankshot2_btree_changed(pi);
+
 	while (height > new_height) {
 		/* Free the meta block */
 		root = bankshot2_get_block(bs2_dev, le64_to_cpu(newroot));
@@ -249,18 +941,18 @@ static void bankshot2_decrease_btree_height(struct bankshot2_device *bs2_dev,
 		bs2_dbg("Free meta block @ 0x%lx\n", blocknr);
 
 		newroot = root[0];
-		bankshot2_free_block(bs2_dev, blocknr,
-				BANKSHOT2_BLOCK_TYPE_4K);
+		unlinked[nr_unlinked++] = blocknr;
 		height--;
 	}
 
 update_root_and_height:
-	/* Update pi->height and pi->root atomically. */
-	*(u64 *)b = *(u64 *)pi;
-	/* pi->height at offset 2 from pi */
-	b[2] = (u8)new_height;
-	cmpxchg_double_local((u64 *)pi, &pi->root, *(u64 *)pi, pi->root,
-		*(u64 *)b, newroot);
+	bankshot2_publish_root(pi, newroot, new_height);
+	bankshot2_drop_btree_mirror(pi);
+	/* Only now are the old top nodes out of readers' reach, but not yet
+	 * out of cursors taken meanwhile */
+	bankshot2_btree_changed(pi);
+	for (i = 0; i < nr_unlinked; i++)
+		bankshot2_free_meta_block(bs2_dev, unlinked[i]);
 }
 
 /*
@@ -270,15 +962,36 @@ update_root_and_height:
 static int bankshot2_new_data_block(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, unsigned long *blocknr, int zero)
 {
-	unsigned int data_bits = PAGE_SHIFT;
+	unsigned int data_bits = blk_type_to_shift[pi->i_blk_type];
+
+	int errval = bankshot2_new_block(bs2_dev, blocknr, pi->i_blk_type, zero);
+
+	if (!errval) {
+//		bankshot2_memunlock_inode(bs2_dev, pi);
+		bankshot2_add_iblocks(pi,
+			(1 << (data_bits - bs2_dev->s_blocksize_bits)));
+//		bankshot2_memlock_inode(bs2_dev, pi);
+	}
+
+	return errval;
+}
+
+/*
+ * Like bankshot2_new_data_block, but tries to get *num contiguous data
+ * blocks. *num is updated with the number actually allocated.
+ */
+static int bankshot2_new_data_blocks(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned long *blocknr,
+		unsigned long *num, int zero)
+{
+	unsigned int data_bits = blk_type_to_shift[pi->i_blk_type];
 
-	int errval = bankshot2_new_block(bs2_dev, blocknr, pi->i_blk_type, zero);
+	int errval = bankshot2_new_blocks(bs2_dev, blocknr, num,
+						pi->i_blk_type, zero);
 
 	if (!errval) {
-//		bankshot2_memunlock_inode(bs2_dev, pi);
-		le64_add_cpu(&pi->i_blocks,
-			(1 << (data_bits - bs2_dev->s_blocksize_bits)));
-//		bankshot2_memlock_inode(bs2_dev, pi);
+		bankshot2_add_iblocks(pi,
+			(*num << (data_bits - bs2_dev->s_blocksize_bits)));
 	}
 
 	return errval;
@@ -292,17 +1005,21 @@ static int bankshot2_new_data_block(struct bankshot2_device *bs2_dev,
  * first_blocknr: first block in the specified range
  * last_blocknr: last_blocknr in the specified range
  * zero: whether to zero-out the allocated block(s)
+ * zero_map: if set, overrides zero per block; zero_map[0] is first_blocknr
+ * mi: slot of block in its parent, -1 for the root (for the DRAM mirror)
  */
 static int recursive_alloc_blocks(bankshot2_transaction_t *trans,
 	struct bankshot2_device *bs2_dev, struct bankshot2_inode *pi,
-	__le64 block, u32 height, unsigned long first_blocknr,
-	unsigned long last_blocknr, bool new_node, bool zero)
+	__le64 block, u32 height, int mi, unsigned long first_blocknr,
+	unsigned long last_blocknr, bool new_node, bool zero,
+	const char *zero_map)
 {
-	int i, errval;
+	int i, j, errval;
+	bool blk_zero;
 	unsigned int meta_bits = META_BLK_SHIFT, node_bits;
 	__le64 *node;
 	bool journal_saved = 0;
-	unsigned long blocknr, first_blk, last_blk;
+	unsigned long blocknr, first_blk, last_blk, num;
 	unsigned int first_index, last_index;
 	unsigned int flush_bytes;
 
@@ -321,9 +1038,20 @@ static int recursive_alloc_blocks(bankshot2_transaction_t *trans,
 	for (i = first_index; i <= last_index; i++) {
 		if (height == 1) {
 			if (node[i] == 0) {
-				errval = bankshot2_new_data_block(bs2_dev, pi, &blocknr,
-							zero);
-				bs2_dbg("Allocating data block 0x%lx\n", blocknr);
+				/* Grab the whole hole at once, as one physically
+				 * contiguous run if the allocator has one. Split
+				 * it where the need for zeroing changes. */
+				blk_zero = zero_map ? zero_map[i - first_index] :
+							zero;
+				for (j = i + 1; j <= last_index && node[j] == 0; j++)
+					if (zero_map &&
+					    zero_map[j - first_index] != blk_zero)
+						break;
+				num = j - i;
+				errval = bankshot2_new_data_blocks(bs2_dev, pi,
+							&blocknr, &num, blk_zero);
+				bs2_dbg("Allocating %lu data blocks at 0x%lx\n",
+						num, blocknr);
 				if (errval) {
 					bs2_dbg("alloc data blk failed %d\n", errval);
 					/* For later recovery in truncate... */
@@ -342,9 +1070,13 @@ static int recursive_alloc_blocks(bankshot2_transaction_t *trans,
 					journal_saved = 1;
 				}
 //				bankshot2_memunlock_block(bs2_dev, node);
-				node[i] = cpu_to_le64(bankshot2_get_block_off(bs2_dev,
-						blocknr, pi->i_blk_type));
+				for (j = 0; j < num; j++)
+					node[i + j] = cpu_to_le64(
+						bankshot2_get_block_off(bs2_dev,
+						blocknr + j * bankshot2_get_numblocks(
+						pi->i_blk_type), pi->i_blk_type));
 //				bankshot2_memlock_block(bs2_dev, node);
+				i += num - 1;
 			}
 		} else {
 			if (node[i] == 0) {
@@ -369,6 +1101,7 @@ static int recursive_alloc_blocks(bankshot2_transaction_t *trans,
 				node[i] = cpu_to_le64(bankshot2_get_block_off(bs2_dev,
 					    blocknr, BANKSHOT2_BLOCK_TYPE_4K));
 //				bankshot2_memlock_block(bs2_dev, node);
+				bankshot2_mirror_set(pi, height, mi, i, node[i]);
 				new_node = 1;
 			}
 
@@ -382,8 +1115,10 @@ static int recursive_alloc_blocks(bankshot2_transaction_t *trans,
 				bs2_info("ERROR3: pi %llu node[i] is NULL!\n",
 					pi->i_ino);
 			errval = recursive_alloc_blocks(trans, bs2_dev, pi,
-					node[i], height - 1, first_blk,
-					last_blk, new_node, zero);
+					node[i], height - 1, i, first_blk,
+					last_blk, new_node, zero, zero_map ?
+					zero_map + ((unsigned long)i << node_bits)
+					+ first_blk - first_blocknr : NULL);
 			if (errval < 0)
 				goto fail;
 		}
@@ -399,15 +1134,106 @@ fail:
 	return errval;
 }
 
+/*
+ * Extent-mapped counterpart of recursive_alloc_blocks: fill each hole in
+ * [first_blocknr, last_blocknr] with as few contiguous runs as the
+ * allocator gives us, one extent each.
+ */
+static int bankshot2_extmap_alloc_blocks(struct bankshot2_device *bs2_dev,
+	struct bankshot2_inode *pi, unsigned long first_blocknr,
+	unsigned long last_blocknr, bool zero, const char *zero_map)
+{
+	unsigned long i, len, num, blocknr, k;
+	bool blk_zero;
+	int errval;
+
+	if (last_blocknr >= BANKSHOT2_EXTMAP_MAX_BLOCK) {
+		bs2_dbg("[%s:%d] Max file size. Cant grow the file\n",
+			__func__, __LINE__);
+		return -ENOSPC;
+	}
+
+	for (i = first_blocknr; i <= last_blocknr; i += len) {
+		if (bankshot2_extmap_lookup(bs2_dev, pi, i, &len))
+			continue;
+
+		/* Split the hole where the need for zeroing changes */
+		len = min(len, last_blocknr - i + 1);
+		blk_zero = zero_map ? zero_map[i - first_blocknr] : zero;
+		for (num = 1; num < len; num++)
+			if (zero_map &&
+			    zero_map[i + num - first_blocknr] != blk_zero)
+				break;
+
+		errval = bankshot2_new_data_blocks(bs2_dev, pi, &blocknr,
+						&num, blk_zero);
+		if (errval) {
+			bs2_dbg("alloc data blk failed %d\n", errval);
+			return errval;
+		}
+		bs2_dbg("Allocating %lu data blocks at 0x%lx\n", num, blocknr);
+
+		errval = bankshot2_extmap_insert(bs2_dev, pi, i, num,
+				bankshot2_get_block_off(bs2_dev, blocknr,
+							pi->i_blk_type));
+		if (errval) {
+			for (k = 0; k < num; k++)
+				bankshot2_free_block(bs2_dev, blocknr + k *
+					bankshot2_get_numblocks(pi->i_blk_type),
+					pi->i_blk_type);
+			bankshot2_add_iblocks(pi, -(num <<
+				(blk_type_to_shift[pi->i_blk_type] -
+				 bs2_dev->s_blocksize_bits)));
+			return errval;
+		}
+		len = num;
+	}
+
+	return 0;
+}
+
+/*
+ * Build a per-block zeroing map for [first_blocknr, last_blocknr] from the
+ * caller's mask of 4K pages that will be fully written after allocation.
+ * A block may skip zeroing only if every page in it is marked written.
+ */
+static char *bankshot2_build_zero_map(struct bankshot2_device *bs2_dev,
+	struct bankshot2_inode *pi, unsigned long file_blocknr, unsigned int num,
+	const char *written, unsigned long first_blocknr,
+	unsigned long last_blocknr)
+{
+	unsigned int blk_shift;
+	unsigned long i, page, end;
+	char *zero_map;
+
+	blk_shift = blk_type_to_shift[pi->i_blk_type] -
+				bs2_dev->s_blocksize_bits;
+
+	zero_map = kmalloc(last_blocknr - first_blocknr + 1, GFP_KERNEL);
+	if (!zero_map)
+		return NULL;
+
+	for (i = 0; i <= last_blocknr - first_blocknr; i++) {
+		page = (first_blocknr + i) << blk_shift;
+		end = page + (1UL << blk_shift);
+		zero_map[i] = page < file_blocknr || end > file_blocknr + num;
+		for (; !zero_map[i] && page < end; page++)
+			zero_map[i] = !written[page - file_blocknr];
+	}
+
+	return zero_map;
+}
+
 int __bankshot2_alloc_blocks(bankshot2_transaction_t *trans,
 	struct bankshot2_device *bs2_dev,
 	struct bankshot2_inode *pi, unsigned long file_blocknr, unsigned int num,
-	bool zero)
+	bool zero, const char *written)
 {
 	int errval;
+	char *zero_map = NULL;
 	unsigned long max_blocks;
 	unsigned int height;
-	unsigned int data_bits = PAGE_SHIFT;
+	unsigned int data_bits = blk_type_to_shift[pi->i_blk_type];
 	unsigned int blk_shift, meta_bits = META_BLK_SHIFT;
 	unsigned long blocknr, first_blocknr, last_blocknr, total_blocks;
 	/* convert the 4K blocks into the actual blocks the inode is using */
@@ -419,6 +1245,17 @@ int __bankshot2_alloc_blocks(bankshot2_transaction_t *trans,
 	bs2_dbg("alloc_blocks height %d file_blocknr %lx num %x, "
 		   "first blocknr 0x%lx, last_blocknr 0x%lx\n",
 		   pi->height, file_blocknr, num, first_blocknr, last_blocknr);
+	bankshot2_btree_changed(pi);
+
+	if (bankshot2_is_extmap(pi)) {
+		if (zero && written)
+			zero_map = bankshot2_build_zero_map(bs2_dev, pi,
+					file_blocknr, num, written,
+					first_blocknr, last_blocknr);
+		errval = bankshot2_extmap_alloc_blocks(bs2_dev, pi,
+				first_blocknr, last_blocknr, zero, zero_map);
+		goto fail;
+	}
 
 	height = pi->height;
 
@@ -441,10 +1278,17 @@ int __bankshot2_alloc_blocks(bankshot2_transaction_t *trans,
 		}
 	}
 
+	/* Without a map, e.g. if kmalloc fails, every block gets zeroed */
+	if (zero && written)
+		zero_map = bankshot2_build_zero_map(bs2_dev, pi, file_blocknr,
+					num, written, first_blocknr,
+					last_blocknr);
+
 	if (!pi->root) {
 		if (height == 0) {
 			__le64 root;
-			errval = bankshot2_new_data_block(bs2_dev, pi, &blocknr, zero);
+			errval = bankshot2_new_data_block(bs2_dev, pi, &blocknr,
+					zero_map ? zero_map[0] : zero);
 			bs2_dbg("Allocating root @ 0x%lx\n", blocknr);
 			if (errval) {
 				bs2_dbg("[%s:%d] failed: alloc data"
@@ -454,8 +1298,7 @@ int __bankshot2_alloc_blocks(bankshot2_transaction_t *trans,
 			root = cpu_to_le64(bankshot2_get_block_off(bs2_dev, blocknr,
 					   pi->i_blk_type));
 //			bankshot2_memunlock_inode(bs2_dev, pi);
-			pi->root = root;
-			pi->height = height;
+			bankshot2_publish_root(pi, root, height);
 //			bankshot2_memlock_inode(bs2_dev, pi);
 		} else {
 			errval = bankshot2_increase_btree_height(bs2_dev, pi,
@@ -469,15 +1312,17 @@ int __bankshot2_alloc_blocks(bankshot2_transaction_t *trans,
 				bs2_info("ERROR1: pi %llu root is NULL!\n",
 					pi->i_ino);
 			errval = recursive_alloc_blocks(trans, bs2_dev, pi,
-					pi->root, pi->height, first_blocknr,
-					last_blocknr, 1, zero);
+					pi->root, pi->height, -1, first_blocknr,
+					last_blocknr, 1, zero, zero_map);
 			if (errval < 0)
 				goto fail;
 		}
 	} else {
 		/* Go forward only if the height of the tree is non-zero. */
-		if (height == 0)
-			return 0;
+		if (height == 0) {
+			errval = 0;
+			goto fail;
+		}
 
 		if (height > pi->height) {
 			errval = bankshot2_increase_btree_height(bs2_dev, pi,
@@ -491,30 +1336,40 @@ int __bankshot2_alloc_blocks(bankshot2_transaction_t *trans,
 		if (!pi->root)
 			bs2_info("ERROR2: pi %llu root is NULL!\n", pi->i_ino);
 		errval = recursive_alloc_blocks(trans, bs2_dev, pi, pi->root,
-				height,	first_blocknr, last_blocknr, 0, zero);
+				height, -1, first_blocknr, last_blocknr, 0, zero,
+				zero_map);
 		if (errval < 0)
 			goto fail;
 	}
-	return 0;
+	errval = 0;
 fail:
+	kfree(zero_map);
 	return errval;
 }
 
 /*
  * Allocate num data blocks for inode, starting at given file-relative
- * block number.
+ * block number. If written is set, written[i] marks 4K page file_blocknr + i
+ * as about to be fully overwritten, so its block need not be zeroed.
  */
 int bankshot2_alloc_blocks(bankshot2_transaction_t *trans,
 		struct bankshot2_device *bs2_dev, struct bankshot2_inode *pi,
-		unsigned long file_blocknr, unsigned int num, bool zero)
+		unsigned long file_blocknr, unsigned int num, bool zero,
+		const char *written)
 {
+	unsigned long first_blocknr;
 	int errval;
 
-	if (pi->start_index > file_blocknr)
-		pi->start_index = file_blocknr;
+	/* start_index is kept in the inode's own block units */
+	first_blocknr = file_blocknr >> (blk_type_to_shift[pi->i_blk_type] -
+					bs2_dev->s_blocksize_bits);
+	if (pi->start_index > first_blocknr)
+		pi->start_index = first_blocknr;
 
 	errval = __bankshot2_alloc_blocks(trans, bs2_dev, pi, file_blocknr,
-						num, zero);
+						num, zero, written);
+	if (!errval)
+		bankshot2_hash_insert_range(bs2_dev, pi, file_blocknr, num);
 //	inode->i_blocks = le64_to_cpu(pi->i_blocks);
 
 	return errval;
@@ -538,100 +1393,408 @@ static inline bool is_empty_meta_block(__le64 *node, unsigned int start_idx,
 	return true;
 }
 
-/* Caller must hold super_block lock. If start_hint procided, it is
- * only valid until the caller releases the super_block lock */
-void __bankshot2_free_block(struct bankshot2_device *bs2_dev,
-		unsigned long blocknr, unsigned short btype,
+/* Return a run of blocks that lies within one domain to its free trees. */
+static int __bankshot2_domain_free_run(struct bankshot2_device *bs2_dev,
+		struct bankshot2_domain *dom, unsigned long blocknr,
+		unsigned long num_blocks,
 		struct bankshot2_blocknode **start_hint)
 {
-	struct list_head *head = &(bs2_dev->block_inuse_head);
 	unsigned long new_block_low;
 	unsigned long new_block_high;
-	unsigned long num_blocks = 0;
-	struct bankshot2_blocknode *i;
-	struct bankshot2_blocknode *free_blocknode = NULL;
+	struct bankshot2_blocknode *prev = NULL, *next = NULL;
 	struct bankshot2_blocknode *curr_node;
+	bool merge_prev, merge_next;
 
-	num_blocks = bankshot2_get_numblocks(btype);
 	new_block_low = blocknr;
 	new_block_high = blocknr + num_blocks - 1;
 
-	BUG_ON(list_empty(head));
-
 	if (start_hint && *start_hint &&
-			new_block_low >= (*start_hint)->block_low)
-		i = *start_hint;
-	else
-		i = list_first_entry(head, typeof(*i), link);
-
-	list_for_each_entry_from(i, head, link) {
-		if (new_block_low > i->block_high) {
-			// Skip to next blocknode
-			continue;
-		}
-
-		if ((new_block_low == i->block_low) &&
-		    (new_block_high == i->block_high)) {
-			// Fits entire datablock
-			if (start_hint)
-				*start_hint = bankshot2_next_blocknode(i, head);
-			list_del(&i->link);
-			free_blocknode = i;
-			bs2_dev->num_blocknode_allocated--;
-			bs2_dev->num_free_blocks += num_blocks;
-			goto block_found;
-		}
+			(*start_hint)->block_low >= dom->block_low &&
+			(*start_hint)->block_high <= dom->block_high &&
+			new_block_low > (*start_hint)->block_high) {
+		next = bankshot2_next_blocknode(*start_hint);
+		if (!next || next->block_low > new_block_low)
+			prev = *start_hint;
+	}
 
-		if ((new_block_low == i->block_low) &&
-		    (new_block_high < i->block_high)) {
-			// Align to left
-			i->block_low = new_block_high + 1;
-			bs2_dev->num_free_blocks += num_blocks;
-			if (start_hint)
-				*start_hint = i;
-			goto block_found;
+	if (!prev) {
+		prev = bankshot2_find_prev_blocknode(dom, new_block_low);
+		if (prev) {
+			next = bankshot2_next_blocknode(prev);
+		} else if (!RB_EMPTY_ROOT(&dom->block_free_tree)) {
+			next = container_of(rb_first(&dom->block_free_tree),
+					struct bankshot2_blocknode, addr_node);
+		} else {
+			next = NULL;
 		}
+	}
 
-		if ((new_block_low > i->block_low) &&
-		    (new_block_high == i->block_high)) {
-			// Align to right
-			i->block_high = new_block_low - 1;
-			bs2_dev->num_free_blocks += num_blocks;
-			if (start_hint)
-				*start_hint = bankshot2_next_blocknode(i, head);
-			goto block_found;
-		}
+	if ((prev && new_block_low <= prev->block_high) ||
+			(next && new_block_high >= next->block_low) ||
+			new_block_high > dom->block_high) {
+		/* Already (partially) free, or out of range */
+		goto fail;
+	}
 
-		if ((new_block_low > i->block_low) &&
-		    (new_block_high < i->block_high)) {
-			// Align in the middle
-			curr_node = bankshot2_alloc_blocknode(bs2_dev);
-			if (!curr_node)
-				goto block_found;
-			curr_node->block_low = new_block_high + 1;
-			curr_node->block_high = i->block_high;
-			i->block_high = new_block_low - 1;
-			list_add(&curr_node->link, &i->link);
-			bs2_dev->num_free_blocks += num_blocks;
-			if (start_hint)
-				*start_hint = curr_node;
-			goto block_found;
-		}
+	merge_prev = prev && (prev->block_high + 1 == new_block_low);
+	merge_next = next && (new_block_high + 1 == next->block_low);
+
+	if (merge_prev && merge_next) {
+		/* Fills the gap between two free runs */
+		bankshot2_remove_blocknode(dom, next);
+		bankshot2_resize_blocknode(dom, prev, prev->block_low,
+						next->block_high);
+		__bankshot2_free_blocknode(bs2_dev, next);
+		bs2_dev->num_blocknode_allocated--;
+		curr_node = prev;
+	} else if (merge_prev) {
+		bankshot2_resize_blocknode(dom, prev, prev->block_low,
+						new_block_high);
+		curr_node = prev;
+	} else if (merge_next) {
+		bankshot2_resize_blocknode(dom, next, new_block_low,
+						next->block_high);
+		curr_node = next;
+	} else {
+		curr_node = bankshot2_alloc_blocknode(bs2_dev);
+		if (!curr_node)
+			goto fail;
+		curr_node->block_low = new_block_low;
+		curr_node->block_high = new_block_high;
+		bankshot2_insert_blocknode(dom, curr_node);
 	}
 
+	dom->num_free += num_blocks;
+	if (start_hint)
+		*start_hint = curr_node;
+	return 0;
+
+fail:
 	bs2_info("Unable to free block %ld\n", blocknr);
+	return -EINVAL;
+}
+
+/* Return a run of blocks to the free trees. Caller must hold s_lock.
+ * If start_hint procided, it is only valid until the caller releases
+ * the super_block lock. start_hint is set to the free run that now contains
+ * blocknr, so freeing ascending block numbers skips the tree lookup.
+ * The run must not cross a domain boundary.
+ * Does not touch num_free_blocks. */
+static int __bankshot2_free_run(struct bankshot2_device *bs2_dev,
+		unsigned long blocknr, unsigned long num_blocks,
+		struct bankshot2_blocknode **start_hint)
+{
+	struct bankshot2_domain *dom;
+
+	dom = bankshot2_block_domain(bs2_dev, blocknr);
+	if (!dom || blocknr + num_blocks - 1 > dom->block_high) {
+		bs2_info("Unable to free block %ld\n", blocknr);
+		return -EINVAL;
+	}
+
+	return __bankshot2_domain_free_run(bs2_dev, dom, blocknr, num_blocks,
+						start_hint);
+}
+
+/* Caller must hold super_block lock. Bypasses the per-CPU magazines so
+ * that callers freeing many blocks at once (truncate) pay for s_lock
+ * once and keep the freed range contiguous. */
+void __bankshot2_free_block(struct bankshot2_device *bs2_dev,
+		unsigned long blocknr, unsigned short btype,
+		struct bankshot2_blocknode **start_hint)
+{
+	unsigned long num_blocks = bankshot2_get_numblocks(btype);
 
-block_found:
-	if (free_blocknode)
-		__bankshot2_free_blocknode(bs2_dev, free_blocknode);
+	if (__bankshot2_free_run(bs2_dev, blocknr, num_blocks, start_hint) == 0)
+		percpu_counter_add(&bs2_dev->num_free_blocks, num_blocks);
 }
 
 void bankshot2_free_block(struct bankshot2_device *bs2_dev,
 		unsigned long blocknr, unsigned short btype)
 {
-	mutex_lock(&bs2_dev->s_lock);
-	__bankshot2_free_block(bs2_dev, blocknr, btype, NULL);
+	unsigned long num_blocks = bankshot2_get_numblocks(btype);
+	timing_t start;
+
+	if (measure_timing)
+		getrawmonotonic(&start);
+
+	if (num_blocks == 1) {
+		bankshot2_magazine_free(bs2_dev, blocknr);
+		percpu_counter_add(&bs2_dev->num_free_blocks, num_blocks);
+	} else {
+		bankshot2_lock_blocks(bs2_dev);
+		__bankshot2_free_block(bs2_dev, blocknr, btype, NULL);
+		mutex_unlock(&bs2_dev->s_lock);
+	}
+
+	if (measure_timing)
+		bankshot2_account_latency(bs2_dev, BANKSHOT2_LAT_FREE,
+					bankshot2_elapsed_ns(&start));
+}
+
+static int bankshot2_cmp_blocknr(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+void bankshot2_init_free_batch(struct bankshot2_free_batch *batch,
+		unsigned short btype)
+{
+	batch->btype = btype;
+	batch->count = 0;
+	/* Without a buffer, blocks are freed one at a time */
+	batch->blocks = kmalloc(BANKSHOT2_FREE_BATCH_SIZE *
+				sizeof(unsigned long), GFP_KERNEL);
+}
+
+/* Sort the batch and free it as runs of contiguous blocks, taking s_lock
+ * once. */
+static void bankshot2_flush_free_batch(struct bankshot2_device *bs2_dev,
+		struct bankshot2_free_batch *batch)
+{
+	struct bankshot2_blocknode *start_hint = NULL;
+	struct bankshot2_domain *dom;
+	unsigned long num_blocks = bankshot2_get_numblocks(batch->btype);
+	unsigned long low, high, len, freed = 0;
+	int i, j, k;
+
+	if (batch->count == 0)
+		return;
+
+	sort(batch->blocks, batch->count, sizeof(unsigned long),
+			bankshot2_cmp_blocknr, NULL);
+
+	bankshot2_lock_blocks(bs2_dev);
+	for (i = 0; i < batch->count; i = j) {
+		low = batch->blocks[i];
+		/* Free runs never span placement domains */
+		dom = bankshot2_block_domain(bs2_dev, low);
+		high = dom ? dom->block_high : low;
+		for (j = i + 1; j < batch->count &&
+			batch->blocks[j] == low + (j - i) * num_blocks &&
+			batch->blocks[j] <= high; j++)
+			;
+		len = (j - i) * num_blocks;
+		if (__bankshot2_free_run(bs2_dev, low, len, &start_hint) == 0) {
+			freed += len;
+			continue;
+		}
+		/* Part of the run is already free; salvage the rest */
+		for (k = i; k < j; k++)
+			__bankshot2_free_block(bs2_dev, batch->blocks[k],
+					batch->btype, &start_hint);
+	}
 	mutex_unlock(&bs2_dev->s_lock);
+
+	percpu_counter_add(&bs2_dev->num_free_blocks, freed);
+	batch->count = 0;
+}
+
+void bankshot2_free_batch_add(struct bankshot2_device *bs2_dev,
+		struct bankshot2_free_batch *batch, unsigned long blocknr)
+{
+	if (!batch->blocks) {
+		bankshot2_free_block(bs2_dev, blocknr, batch->btype);
+		return;
+	}
+
+	batch->blocks[batch->count++] = blocknr;
+	if (batch->count == BANKSHOT2_FREE_BATCH_SIZE)
+		bankshot2_flush_free_batch(bs2_dev, batch);
+}
+
+void bankshot2_finish_free_batch(struct bankshot2_device *bs2_dev,
+		struct bankshot2_free_batch *batch)
+{
+	if (!batch->blocks)
+		return;
+
+	bankshot2_flush_free_batch(bs2_dev, batch);
+	kfree(batch->blocks);
+	batch->blocks = NULL;
+}
+
+/*
+ * Tree nodes are walked without locks, under rcu_read_lock(). One that has
+ * been unlinked goes back to the allocator only after a grace period. The
+ * RCU callback can't take s_lock, so it queues the node for the zeroing
+ * thread instead.
+ */
+static void bankshot2_deferred_free_rcu(struct rcu_head *head)
+{
+	struct bankshot2_deferred_free *df =
+		container_of(head, struct bankshot2_deferred_free, rcu);
+	struct bankshot2_device *bs2_dev = df->bs2_dev;
+
+	spin_lock(&bs2_dev->deferred_lock);
+	list_add_tail(&df->list, &bs2_dev->deferred_list);
+	spin_unlock(&bs2_dev->deferred_lock);
+	wake_up_interruptible(&bs2_dev->zero_wait);
+}
+
+static void bankshot2_defer_free(struct bankshot2_device *bs2_dev,
+		unsigned long blocknr, u32 height, u32 btype,
+		struct bankshot2_inode *pi);
+
+/* Free a 4K tree node. The caller must have unlinked it already. */
+void bankshot2_free_meta_block(struct bankshot2_device *bs2_dev,
+		unsigned long blocknr)
+{
+	bankshot2_defer_free(bs2_dev, blocknr, 0, BANKSHOT2_BLOCK_TYPE_4K,
+				NULL);
+}
+
+/*
+ * Free the node at blocknr and, for height > 0, everything below it: data
+ * blocks go to data_batch, tree nodes to meta_batch. Only for subtrees
+ * nobody can reach any more, so no further grace period is needed.
+ * Returns the data freed in 4K units, as i_blocks counts it.
+ */
+static unsigned long bankshot2_free_detached_subtree(
+		struct bankshot2_device *bs2_dev, unsigned long blocknr,
+		u32 height, struct bankshot2_free_batch *meta_batch,
+		struct bankshot2_free_batch *data_batch)
+{
+	unsigned long units = 0;
+	__le64 *node;
+	unsigned int i;
+
+	if (height) {
+		node = bankshot2_get_block(bs2_dev, bankshot2_get_block_off(
+				bs2_dev, blocknr, BANKSHOT2_BLOCK_TYPE_4K));
+		for (i = 0; i < (1 << META_BLK_SHIFT); i++) {
+			if (!node[i])
+				continue;
+			if (height == 1) {
+				bankshot2_free_batch_add(bs2_dev, data_batch,
+					bankshot2_get_blocknr(
+						le64_to_cpu(node[i])));
+				units += bankshot2_get_numblocks(
+							data_batch->btype);
+			} else {
+				units += bankshot2_free_detached_subtree(
+					bs2_dev, bankshot2_get_blocknr(
+						le64_to_cpu(node[i])),
+					height - 1, meta_batch, data_batch);
+			}
+		}
+		cond_resched();
+	}
+	bankshot2_free_batch_add(bs2_dev, meta_batch, blocknr);
+	return units;
+}
+
+/* Take a freed subtree's data off its inode, unless that is gone since */
+static void bankshot2_put_detached_blocks(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, unsigned int free_gen,
+		unsigned long units)
+{
+	spin_lock_bh(&bs2_dev->deferred_lock);
+	if (pi && pi->free_gen == free_gen)
+		bankshot2_add_iblocks(pi, -units);
+	spin_unlock_bh(&bs2_dev->deferred_lock);
+}
+
+/* Hand nodes whose grace period is over back to the allocator */
+void bankshot2_free_deferred_blocks(struct bankshot2_device *bs2_dev)
+{
+	struct bankshot2_deferred_free *df, *next;
+	struct bankshot2_free_batch batch, data_batch;
+	unsigned long units;
+	LIST_HEAD(list);
+
+	spin_lock_bh(&bs2_dev->deferred_lock);
+	list_splice_init(&bs2_dev->deferred_list, &list);
+	spin_unlock_bh(&bs2_dev->deferred_lock);
+
+	if (list_empty(&list))
+		return;
+
+	bankshot2_init_free_batch(&batch, BANKSHOT2_BLOCK_TYPE_4K);
+	list_for_each_entry_safe(df, next, &list, list) {
+		if (df->height) {
+			bankshot2_init_free_batch(&data_batch, df->btype);
+			units = bankshot2_free_detached_subtree(bs2_dev,
+					df->blocknr, df->height, &batch,
+					&data_batch);
+			bankshot2_finish_free_batch(bs2_dev, &data_batch);
+			bankshot2_put_detached_blocks(bs2_dev, df->pi,
+					df->free_gen, units);
+
+			spin_lock_bh(&bs2_dev->deferred_lock);
+			bs2_dev->deferred_subtrees--;
+			spin_unlock_bh(&bs2_dev->deferred_lock);
+		} else {
+			bankshot2_free_batch_add(bs2_dev, &batch, df->blocknr);
+		}
+		kfree(df);
+	}
+	bankshot2_finish_free_batch(bs2_dev, &batch);
+}
+
+/*
+ * Queue the node at blocknr, and for height > 0 the subtree below it, for
+ * freeing once lockless lookups are done with it. The subtree is walked
+ * only then, so unlinking it costs the same whatever its size; its data
+ * comes off pi's i_blocks as it is freed.
+ */
+static void bankshot2_defer_free(struct bankshot2_device *bs2_dev,
+		unsigned long blocknr, u32 height, u32 btype,
+		struct bankshot2_inode *pi)
+{
+	struct bankshot2_deferred_free *df;
+	struct bankshot2_free_batch batch, data_batch;
+	unsigned long units;
+
+	/* Nobody else to pick up what's past its grace period */
+	if (!bs2_dev->zero_thread && !list_empty(&bs2_dev->deferred_list))
+		bankshot2_free_deferred_blocks(bs2_dev);
+
+	df = kmalloc(sizeof(*df), GFP_KERNEL);
+	if (!df) {
+		/* Wait the readers out here instead */
+		synchronize_rcu();
+		bankshot2_init_free_batch(&batch, BANKSHOT2_BLOCK_TYPE_4K);
+		bankshot2_init_free_batch(&data_batch, btype);
+		units = bankshot2_free_detached_subtree(bs2_dev, blocknr,
+					height, &batch, &data_batch);
+		bankshot2_finish_free_batch(bs2_dev, &data_batch);
+		bankshot2_finish_free_batch(bs2_dev, &batch);
+		if (pi)
+			bankshot2_add_iblocks(pi, -units);
+		return;
+	}
+
+	df->bs2_dev = bs2_dev;
+	df->blocknr = blocknr;
+	df->height = height;
+	df->btype = btype;
+	df->pi = pi;
+	if (height) {
+		spin_lock_bh(&bs2_dev->deferred_lock);
+		df->free_gen = pi ? pi->free_gen : 0;
+		bs2_dev->deferred_subtrees++;
+		spin_unlock_bh(&bs2_dev->deferred_lock);
+	}
+	call_rcu(&df->rcu, bankshot2_deferred_free_rcu);
+}
+
+/*
+ * Out of space with evicted subtrees still queued: wait out their grace
+ * period and free them here rather than fail. Returns true if there was
+ * anything to wait for.
+ */
+bool bankshot2_reclaim_deferred(struct bankshot2_device *bs2_dev)
+{
+	if (!ACCESS_ONCE(bs2_dev->deferred_subtrees))
+		return false;
+
+	rcu_barrier();
+	bankshot2_free_deferred_blocks(bs2_dev);
+	return true;
 }
 
 #if 0
@@ -667,12 +1830,18 @@ void bankshot2_free_blocks(struct bankshot2_device *bs2_dev,
  * first_blocknr: first block in the specified range
  * last_blocknr: last blocknr in the specified range
  * end: last byte offset of the range
+ * pi, mi: owning inode and slot of block in its parent (-1 for the root),
+ *	   to keep the DRAM mirror in step; pi is NULL for detached trees
+ * Subtrees of a live inode that fall wholly inside the range are unlinked
+ * and freed later by the zeroing thread, so evicting a whole leaf costs the
+ * same as evicting one block.
  */
 int recursive_truncate_blocks(struct bankshot2_device *bs2_dev, __le64 block,
 		u32 height, u32 btype, unsigned long first_blocknr,
-		unsigned long last_blocknr, bool *meta_empty)
+		unsigned long last_blocknr, bool *meta_empty,
+		struct bankshot2_free_batch *batch,
+		struct bankshot2_inode *pi, int mi)
 {
-	struct bankshot2_blocknode *start_hint = NULL;
 	unsigned long blocknr, first_blk, last_blk;
 	unsigned int node_bits, first_index, last_index, i;
 	__le64 *node;
@@ -687,18 +1856,15 @@ int recursive_truncate_blocks(struct bankshot2_device *bs2_dev, __le64 block,
 	end = last_index = last_blocknr >> node_bits;
 
 	if (height == 1) {
-		mutex_lock(&bs2_dev->s_lock);
 		for (i = first_index; i <= last_index; i++) {
 			if (unlikely(!node[i]))
 				continue;
 			/* Freeing the data block */
 			blocknr = bankshot2_get_blocknr(le64_to_cpu(node[i]));
 			bs2_dbg("Freeing data block 0x%lx\n", blocknr);
-			__bankshot2_free_block(bs2_dev, blocknr, btype,
-						&start_hint);
+			bankshot2_free_batch_add(bs2_dev, batch, blocknr);
 			freed++;
 		}
-		mutex_unlock(&bs2_dev->s_lock);
 	} else {
 		for (i = first_index; i <= last_index; i++) {
 			if (unlikely(!node[i]))
@@ -708,17 +1874,42 @@ int recursive_truncate_blocks(struct bankshot2_device *bs2_dev, __le64 block,
 			last_blk = (i == last_index) ? (last_blocknr &
 				((1 << node_bits) - 1)) : (1 << node_bits) - 1;
 
+			if (pi && first_blk == 0 &&
+					last_blk == (1 << node_bits) - 1) {
+				/*
+				 * The whole subtree goes: unlink it with one
+				 * 8-byte store and leave the walk, the
+				 * freeing and its i_blocks to the zeroing
+				 * thread.
+				 */
+				blocknr = bankshot2_get_blocknr(
+							le64_to_cpu(node[i]));
+				node[i] = 0;
+				bankshot2_flush_buffer(&node[i], sizeof(node[i]),
+							false);
+				bankshot2_mirror_set(pi, height, mi, i, 0);
+				bankshot2_btree_changed(pi);
+				bs2_dbg("Deferring subtree @ 0x%lx\n", blocknr);
+				bankshot2_defer_free(bs2_dev, blocknr,
+						height - 1, btype, pi);
+				continue;
+			}
+
 			freed += recursive_truncate_blocks(bs2_dev, node[i],
 					height - 1, btype, first_blk,
-					last_blk, &mpty);
+					last_blk, &mpty, batch, pi, i);
 
 			if (mpty) {
-				/* Free the meta-data block; */
+				/* Unlink, then free the meta-data block once
+				 * lockless lookups are done with it */
 				blocknr = bankshot2_get_blocknr(
 							le64_to_cpu(node[i]));
+				node[i] = 0;
+				bankshot2_mirror_set(pi, height, mi, i, 0);
+				if (pi)
+					bankshot2_btree_changed(pi);
 				bs2_dbg("Freeing meta block 0x%lx\n", blocknr);
-				bankshot2_free_block(bs2_dev, blocknr,
-						BANKSHOT2_BLOCK_TYPE_4K);
+				bankshot2_free_meta_block(bs2_dev, blocknr);
 			} else {
 				if (i == first_index)
 					start++;
@@ -740,6 +1931,7 @@ int recursive_truncate_blocks(struct bankshot2_device *bs2_dev, __le64 block,
 			memset(&node[start], 0, bzero);
 //			bankshot2_memlock_block(bs2_dev, node);
 			bankshot2_flush_buffer(&node[start], bzero, false);
+			bankshot2_mirror_clear(pi, height, mi, start, end);
 		}
 		*meta_empty = false;
 	}
@@ -750,9 +1942,10 @@ int recursive_truncate_blocks(struct bankshot2_device *bs2_dev, __le64 block,
 void bankshot2_truncate_blocks(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, off_t start, off_t end)
 {
+	struct bankshot2_free_batch batch;
 	unsigned long first_blocknr, last_blocknr;
 	__le64 root;
-	unsigned int freed = 0;
+	unsigned long freed = 0, dead_root = 0;
 	unsigned int data_bits = blk_type_to_shift[pi->i_blk_type];
 //	unsigned int meta_bits = META_BLK_SHIFT;
 	bool mpty;
@@ -767,7 +1960,9 @@ void bankshot2_truncate_blocks(struct bankshot2_device *bs2_dev,
 
 	first_blocknr = start >> data_bits;
 	last_blocknr = (end - 1) >> data_bits;
-	last_blocknr = bankshot2_sparse_last_blocknr(pi->height, last_blocknr);
+	if (!bankshot2_is_extmap(pi))
+		last_blocknr = bankshot2_sparse_last_blocknr(pi->height,
+							last_blocknr);
 
 	if (first_blocknr > last_blocknr)
 		goto end_truncate_blocks;
@@ -776,35 +1971,51 @@ void bankshot2_truncate_blocks(struct bankshot2_device *bs2_dev,
 			pi->start_index <= last_blocknr)
 		pi->start_index = last_blocknr + 1;
 
+	/* Out of the index before anything is freed */
+	bankshot2_hash_remove_range(bs2_dev, pi, first_blocknr <<
+			(data_bits - bs2_dev->s_blocksize_bits),
+			(last_blocknr - first_blocknr + 1) <<
+			(data_bits - bs2_dev->s_blocksize_bits));
+
+	bankshot2_btree_changed(pi);
 	root = pi->root;
 
-	if (pi->height == 0) {
+	if (bankshot2_is_extmap(pi)) {
+		freed = bankshot2_extmap_truncate(bs2_dev, pi, first_blocknr,
+						last_blocknr);
+	} else if (pi->height == 0) {
 		first_blocknr = bankshot2_get_blocknr(le64_to_cpu(root));
 		bs2_dbg("Freeing root @ 0x%lx\n", first_blocknr);
 		bankshot2_free_block(bs2_dev, first_blocknr, pi->i_blk_type);
 		root = 0;
 		freed = 1;
 	} else {
+		bankshot2_init_free_batch(&batch, pi->i_blk_type);
 		freed = recursive_truncate_blocks(bs2_dev, root, pi->height,
-			pi->i_blk_type, first_blocknr, last_blocknr, &mpty);
+			pi->i_blk_type, first_blocknr, last_blocknr, &mpty,
+			&batch, pi, -1);
+		bankshot2_finish_free_batch(bs2_dev, &batch);
 		if (mpty) {
-			first_blocknr =
-				bankshot2_get_blocknr(le64_to_cpu(root));
-		bs2_dbg("Freeing root @ 0x%lx\n", first_blocknr);
-			bankshot2_free_block(bs2_dev, first_blocknr,
-				BANKSHOT2_BLOCK_TYPE_4K);
+			/* Freed once the new root is published below */
+			dead_root = bankshot2_get_blocknr(le64_to_cpu(root));
+			bs2_dbg("Freeing root @ 0x%lx\n", dead_root);
 			root = 0;
 		}
 	}
 
-	pi->i_blocks -= (freed * (1 << (data_bits -
-			bs2_dev->s_blocksize_bits)));
+	bankshot2_add_iblocks(pi, -(freed * (1 << (data_bits -
+			bs2_dev->s_blocksize_bits))));
 
 	newsize = pi->i_size > end ? pi->i_size : pi->i_size - (end - start);
 	bankshot2_update_isize(pi, newsize);
-	bs2_dbg("Decrease btree height: pi %p newsize 0x%llx, "
-			"root 0x%llx\n", pi, newsize, root);
-	bankshot2_decrease_btree_height(bs2_dev, pi, newsize, root);
+	/* Extent trees shrink as they are unmapped */
+	if (!bankshot2_is_extmap(pi)) {
+		bs2_dbg("Decrease btree height: pi %p newsize 0x%llx, "
+				"root 0x%llx\n", pi, newsize, root);
+		bankshot2_decrease_btree_height(bs2_dev, pi, newsize, root);
+		if (dead_root)
+			bankshot2_free_meta_block(bs2_dev, dead_root);
+	}
 	bs2_dbg("After decrease: pi root @ 0x%llx, height %u", pi->root, pi->height);
 
 end_truncate_blocks:
@@ -812,32 +2023,226 @@ end_truncate_blocks:
 	return;
 }
 
+/* The node backing blocknr, or NUMA_NO_NODE if nothing says */
+static int bankshot2_block_nid(struct bankshot2_device *bs2_dev,
+		unsigned long blocknr)
+{
+	unsigned long pfn = bankshot2_get_pfn(bs2_dev,
+					blocknr << PAGE_SHIFT);
+	int nid = NUMA_NO_NODE;
+
+	if (pfn_valid(pfn))
+		return pfn_to_nid(pfn);
+#ifdef CONFIG_MEMORY_HOTPLUG
+	/*
+	 * Reserved PM mostly has no memmap behind it. The firmware's
+	 * memory affinity ranges still cover it, so go by those.
+	 */
+	nid = memory_add_physaddr_to_nid((u64)pfn << PAGE_SHIFT);
+	if (nid < 0 || !node_online(nid))
+		nid = NUMA_NO_NODE;
+#endif
+	return nid;
+}
+
+static void bankshot2_add_domain(struct bankshot2_device *bs2_dev, int nid,
+		unsigned long block_low, unsigned long block_high)
+{
+	struct bankshot2_domain *dom;
+
+	if (bs2_dev->num_domains == BANKSHOT2_MAX_DOMAINS) {
+		/* Out of slots, fold the rest into the last domain */
+		dom = &bs2_dev->domains[bs2_dev->num_domains - 1];
+		dom->block_high = block_high;
+		return;
+	}
+
+	dom = &bs2_dev->domains[bs2_dev->num_domains++];
+	dom->block_low = block_low;
+	dom->block_high = block_high;
+	dom->nid = nid;
+	dom->num_free = 0;
+	dom->block_free_tree = RB_ROOT;
+	dom->block_free_size_tree = RB_ROOT;
+}
+
+/* Cut the range of one node into alloc_stripes 2MB aligned stripes */
+static void bankshot2_add_node_domains(struct bankshot2_device *bs2_dev,
+		int nid, unsigned long block_low, unsigned long block_high)
+{
+	unsigned long step = bankshot2_get_numblocks(BANKSHOT2_BLOCK_TYPE_2M);
+	unsigned long len = block_high - block_low + 1;
+	unsigned long stripe, low;
+	unsigned long stripes = alloc_stripes;
+
+	stripes = max(min(stripes, len / step), 1UL);
+	stripe = round_up(DIV_ROUND_UP(len, stripes), step);
+
+	for (low = block_low; low <= block_high; low += stripe)
+		bankshot2_add_domain(bs2_dev, nid, low,
+				min(low + stripe - 1, block_high));
+}
+
+/*
+ * Split the cache into placement domains. The region is scanned in 2MB
+ * steps and cut wherever the backing NUMA node changes, then each node
+ * range is cut into stripes. Must be called before bankshot2_init_blockmap.
+ */
+void bankshot2_init_domains(struct bankshot2_device *bs2_dev)
+{
+	unsigned long step = bankshot2_get_numblocks(BANKSHOT2_BLOCK_TYPE_2M);
+	unsigned long low, high;
+	bool unknown = false;
+	int i, nid;
+
+	bs2_dev->num_domains = 0;
+	atomic_set(&bs2_dev->domain_rotor, 0);
+
+	for (low = bs2_dev->block_start; low < bs2_dev->block_end;
+			low = high) {
+		nid = bankshot2_block_nid(bs2_dev, low);
+		high = round_down(low, step) + step;
+		while (high < bs2_dev->block_end &&
+				bankshot2_block_nid(bs2_dev, high) == nid)
+			high += step;
+		high = min(high, bs2_dev->block_end);
+
+		if (nid == NUMA_NO_NODE) {
+			if (!unknown)
+				bs2_info("No NUMA node for PM block 0x%lx, "
+					"placing it on node %d\n", low,
+					first_online_node);
+			unknown = true;
+			nid = first_online_node;
+		}
+		bankshot2_add_node_domains(bs2_dev, nid, low, high - 1);
+	}
+
+	for (i = 0; i < bs2_dev->num_domains; i++)
+		bs2_info("Domain %d: node %d, blocks 0x%lx - 0x%lx\n", i,
+			bs2_dev->domains[i].nid, bs2_dev->domains[i].block_low,
+			bs2_dev->domains[i].block_high);
+}
+
+/*
+ * Snapshot the allocator state. The free trees are walked under s_lock, so
+ * this is O(free runs) and meant for monitoring, not for hot paths.
+ */
+void bankshot2_get_alloc_stats(struct bankshot2_device *bs2_dev,
+		struct bankshot2_alloc_stats *stats)
+{
+	struct bankshot2_alloc_lat *lat;
+	struct bankshot2_blocknode *i;
+	struct rb_node *temp;
+	unsigned long size;
+	int cpu, d, t, b;
+
+	memset(stats, 0, sizeof(struct bankshot2_alloc_stats));
+	stats->total_blocks = bs2_dev->block_end - bs2_dev->block_start;
+	stats->free_blocks = bankshot2_count_free_blocks(bs2_dev);
+
+	mutex_lock(&bs2_dev->s_lock);
+	for (d = 0; d < bs2_dev->num_domains; d++) {
+		temp = rb_first(&bs2_dev->domains[d].block_free_tree);
+		for (; temp; temp = rb_next(temp)) {
+			i = container_of(temp, struct bankshot2_blocknode,
+						addr_node);
+			size = bankshot2_blocknode_size(i);
+			stats->free_runs++;
+			stats->free_run_hist[min_t(int, ilog2(size),
+					BANKSHOT2_HIST_BUCKETS - 1)]++;
+			if (size > stats->largest_free_run)
+				stats->largest_free_run = size;
+		}
+	}
+	mutex_unlock(&bs2_dev->s_lock);
+
+	for_each_possible_cpu(cpu) {
+		lat = per_cpu_ptr(bs2_dev->alloc_lat, cpu);
+		for (t = 0; t < BANKSHOT2_LAT_NUM; t++) {
+			for (b = 0; b < BANKSHOT2_HIST_BUCKETS; b++) {
+				stats->lat_hist[t][b] += lat->hist[t][b];
+				stats->lat_count[t] += lat->hist[t][b];
+			}
+			stats->lat_total_ns[t] += lat->total_ns[t];
+			stats->lat_max_ns[t] = max(stats->lat_max_ns[t],
+							lat->max_ns[t]);
+		}
+	}
+}
+
+/* Racy against concurrent samples on other CPUs; good enough for stats */
+void bankshot2_clear_alloc_stats(struct bankshot2_device *bs2_dev)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(bs2_dev->alloc_lat, cpu), 0,
+			sizeof(struct bankshot2_alloc_lat));
+}
+
 int bankshot2_init_blockmap(struct bankshot2_device *bs2_dev,
 				unsigned long init_used_size)
 {
 	unsigned long num_used_block;
 	struct bankshot2_blocknode *blknode;
+	struct bankshot2_domain *dom;
+	int i;
 
 	num_used_block = (init_used_size + bs2_dev->blocksize - 1) >>
 		bs2_dev->s_blocksize_bits;
 
 	bs2_info("blockmap init: used %lu blocks\n", num_used_block);
-	blknode = bankshot2_alloc_blocknode(bs2_dev);
-	if (blknode == NULL) {
-		bs2_info("WARNING: blocknode allocation failed\n");
-		return -ENOMEM;
-	}
+	percpu_counter_sub(&bs2_dev->num_free_blocks, num_used_block);
+
+	for (i = 0; i < bs2_dev->num_domains; i++) {
+		dom = &bs2_dev->domains[i];
+		if (bs2_dev->block_start + num_used_block > dom->block_high)
+			continue;
+
+		blknode = bankshot2_alloc_blocknode(bs2_dev);
+		if (blknode == NULL) {
+			bs2_info("WARNING: blocknode allocation failed\n");
+			return -ENOMEM;
+		}
 
-	blknode->block_low = bs2_dev->block_start;
-	blknode->block_high = bs2_dev->block_start + num_used_block - 1;
-	bs2_dev->num_free_blocks -= num_used_block;
-	list_add(&blknode->link, &bs2_dev->block_inuse_head);
+		blknode->block_low = max(dom->block_low,
+				bs2_dev->block_start + num_used_block);
+		blknode->block_high = dom->block_high;
+		bankshot2_insert_blocknode(dom, blknode);
+		dom->num_free = bankshot2_blocknode_size(blknode);
+	}
 
 	return 0;
 }
 
+static void bankshot2_destroy_blockmap(struct bankshot2_device *bs2_dev)
+{
+	struct bankshot2_blocknode *i;
+	struct bankshot2_domain *dom;
+	struct rb_node *temp;
+	int d;
+
+	for (d = 0; d < bs2_dev->num_domains; d++) {
+		dom = &bs2_dev->domains[d];
+		temp = rb_first(&dom->block_free_tree);
+		while (temp) {
+			i = container_of(temp, struct bankshot2_blocknode,
+						addr_node);
+			temp = rb_next(temp);
+			bankshot2_remove_blocknode(dom, i);
+			__bankshot2_free_blocknode(bs2_dev, i);
+			bs2_dev->num_blocknode_allocated--;
+		}
+		dom->num_free = 0;
+	}
+}
+
 int bankshot2_init_kmem(struct bankshot2_device *bs2_dev)
 {
+	struct bankshot2_magazine *mag;
+	int cpu;
+
 	bs2_dev->bs2_blocknode_cachep = kmem_cache_create(
 					"bankshot2_blocknode_cache",
 					sizeof(struct bankshot2_blocknode),
@@ -845,12 +2250,84 @@ int bankshot2_init_kmem(struct bankshot2_device *bs2_dev)
                                         SLAB_MEM_SPREAD), NULL);
 	if (bs2_dev->bs2_blocknode_cachep == NULL)
 		return -ENOMEM;
+
+	bs2_dev->magazines = alloc_percpu(struct bankshot2_magazine);
+	if (!bs2_dev->magazines)
+		goto mag_fail;
+
+	for_each_possible_cpu(cpu) {
+		mag = per_cpu_ptr(bs2_dev->magazines, cpu);
+		spin_lock_init(&mag->lock);
+		mag->count = 0;
+	}
+
+	bs2_dev->alloc_lat = alloc_percpu(struct bankshot2_alloc_lat);
+	if (!bs2_dev->alloc_lat)
+		goto lat_fail;
+
+	if (percpu_counter_init(&bs2_dev->num_free_blocks, 0))
+		goto counter_fail;
+
+	if (percpu_counter_init(&bs2_dev->cursor_hit, 0))
+		goto hit_fail;
+
+	if (percpu_counter_init(&bs2_dev->cursor_miss, 0))
+		goto miss_fail;
+
+	if (percpu_counter_init(&bs2_dev->hash_hit, 0))
+		goto hash_hit_fail;
+
+	if (percpu_counter_init(&bs2_dev->hash_miss, 0))
+		goto hash_miss_fail;
+
+	bs2_dev->zero_pool = kmalloc(BANKSHOT2_ZERO_POOL_SIZE *
+				sizeof(unsigned long), GFP_KERNEL);
+	if (!bs2_dev->zero_pool)
+		goto pool_fail;
+
+	spin_lock_init(&bs2_dev->zero_pool_lock);
+	bs2_dev->zero_pool_count = 0;
+	bs2_dev->zero_pool_wanted = 0;
+	init_waitqueue_head(&bs2_dev->zero_wait);
+	spin_lock_init(&bs2_dev->deferred_lock);
+	INIT_LIST_HEAD(&bs2_dev->deferred_list);
+	bs2_dev->deferred_subtrees = 0;
+
 	return 0;
+
+pool_fail:
+	percpu_counter_destroy(&bs2_dev->hash_miss);
+hash_miss_fail:
+	percpu_counter_destroy(&bs2_dev->hash_hit);
+hash_hit_fail:
+	percpu_counter_destroy(&bs2_dev->cursor_miss);
+miss_fail:
+	percpu_counter_destroy(&bs2_dev->cursor_hit);
+hit_fail:
+	percpu_counter_destroy(&bs2_dev->num_free_blocks);
+counter_fail:
+	free_percpu(bs2_dev->alloc_lat);
+lat_fail:
+	free_percpu(bs2_dev->magazines);
+mag_fail:
+	kmem_cache_destroy(bs2_dev->bs2_blocknode_cachep);
+	return -ENOMEM;
 }
 
 void bankshot2_destroy_kmem(struct bankshot2_device *bs2_dev)
 {
+	/* Let pending RCU callbacks run before their code goes away */
+	rcu_barrier();
+	bankshot2_free_deferred_blocks(bs2_dev);
+	bankshot2_destroy_blockmap(bs2_dev);
+	kfree(bs2_dev->zero_pool);
+	percpu_counter_destroy(&bs2_dev->hash_miss);
+	percpu_counter_destroy(&bs2_dev->hash_hit);
+	percpu_counter_destroy(&bs2_dev->cursor_miss);
+	percpu_counter_destroy(&bs2_dev->cursor_hit);
+	percpu_counter_destroy(&bs2_dev->num_free_blocks);
+	free_percpu(bs2_dev->alloc_lat);
+	free_percpu(bs2_dev->magazines);
 	kmem_cache_destroy(bs2_dev->bs2_blocknode_cachep);
 	bs2_info("%s returns.\n", __func__);
 }
-
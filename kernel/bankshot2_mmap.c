@@ -198,8 +198,7 @@ static int bankshot2_check_existing_mmap(struct bankshot2_device *bs2_dev,
 				vm_munmap_page(mm, vma->vm_start,
 					vma->vm_end - vma->vm_start);
 
-				list_del(&delete->list);
-				kfree(delete);
+				bankshot2_remove_vma(bs2_dev, extent, delete);
 				return 1;
 			}
 		}
@@ -215,6 +214,39 @@ not_mmaped:
 	return 1;
 }
 
+/*
+ * The case bankshot2_check_existing_mmap() returns 2 for, found without
+ * unmapping anything on the way: the window is mapped for current mm
+ * already. Updates data with mmap_addr if so. Caller holds tree_lock.
+ */
+bool bankshot2_mmap_hit(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, struct bankshot2_cache_data *data)
+{
+	struct extent_entry *extent;
+	struct vma_list *entry;
+	struct vm_area_struct *vma;
+	unsigned long pgoff = data->mmap_offset >> PAGE_SHIFT;
+
+	extent = bankshot2_find_extent(bs2_dev, pi, data->mmap_offset);
+	if (!extent || data->mmap_offset != extent->offset ||
+			data->mmap_length > extent->length)
+		return false;
+
+	list_for_each_entry(entry, &extent->vma_list, list) {
+		vma = entry->vma;
+		if (vma->vm_mm == current->mm &&
+				pgoff >= vma_start_pgoff(vma) &&
+				pgoff <= vma_last_pgoff(vma)) {
+			data->mmap_addr = vma->vm_start;
+			data->mmap_length = extent->length;
+			bs2_dev->mmap_hit++;
+			return true;
+		}
+	}
+
+	return false;
+}
+
 int bankshot2_mmap_extent(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, struct bankshot2_cache_data *data,
 		struct extent_entry **access_extent, int *mmaped)
@@ -28,6 +28,7 @@ const char *Timingstring[TIMING_NUM] =
 	"vfs_cache_fill_for_read",
 	"vfs_cache_fill_for_write",
 	"vfs_fill_mmap_directly",
+	"vfs_fill_cache_directly",
 	"copy_from_cache",
 	"copy_to_user",
 	"copy_from_user",
@@ -45,6 +46,13 @@ const char *Timingstring[TIMING_NUM] =
 	"fsync_to_cache",
 };
 
+static const char *AllocLatstring[BANKSHOT2_LAT_NUM] =
+{
+	"alloc",
+	"free",
+	"s_lock_wait",
+};
+
 void bankshot2_print_time_stats(struct bankshot2_device *bs2_dev)
 {
 	int i;
@@ -72,6 +80,8 @@ void bankshot2_print_io_stats(struct bankshot2_device *bs2_dev)
 	int i;
 	int num_pi = 0;
 	unsigned long allocated_blocks = 0;
+	u64 cursor_hit, cursor_miss;
+	u64 hash_hit, hash_miss;
 	struct bankshot2_inode *pi;
 
 	bs2_info("======== Bankshot2 kernel IO stats: ========\n");
@@ -103,7 +113,8 @@ void bankshot2_print_io_stats(struct bankshot2_device *bs2_dev)
 
 	bs2_info("Allocated %lu blocks, bankshot2 has %lu blocks, "
 		"free blocks %lu\n", allocated_blocks, bs2_dev->block_end,
-		bs2_dev->num_free_blocks);
+		(unsigned long)percpu_counter_sum_positive(
+					&bs2_dev->num_free_blocks));
 
 	bs2_info("Inode alloc %u, evict %u, ioctl evict %u\n",
 		bs2_dev->cache_stats.inode_alloc,
@@ -111,6 +122,68 @@ void bankshot2_print_io_stats(struct bankshot2_device *bs2_dev)
 		bs2_dev->cache_stats.inode_ioctl_evict);
 
 	bs2_info("Mmap hit %d\n", bs2_dev->mmap_hit);
+
+	bs2_info("Zeroed pool: depth %d, hit %llu, miss %llu blocks\n",
+		bs2_dev->zero_pool_count, bs2_dev->zero_pool_hit,
+		bs2_dev->zero_pool_miss);
+
+	cursor_hit = percpu_counter_sum_positive(&bs2_dev->cursor_hit);
+	cursor_miss = percpu_counter_sum_positive(&bs2_dev->cursor_miss);
+	bs2_info("Lookup cursor: hit %llu, miss %llu, hit rate %llu%%\n",
+		cursor_hit, cursor_miss, cursor_hit + cursor_miss ?
+		cursor_hit * 100 / (cursor_hit + cursor_miss) : 0);
+
+	if (bs2_dev->hash_table) {
+		hash_hit = percpu_counter_sum_positive(&bs2_dev->hash_hit);
+		hash_miss = percpu_counter_sum_positive(&bs2_dev->hash_miss);
+		bs2_info("Hash index: %u slots, hit %llu, miss %llu, "
+			"%lu blocks dropped\n", 1U << bs2_dev->hash_bits,
+			hash_hit, hash_miss, bs2_dev->hash_dropped);
+	}
+
+	mutex_lock(&bs2_dev->s_lock);
+	for (i = 0; i < bs2_dev->num_domains; i++)
+		bs2_info("Domain %d: node %d, %lu blocks, free %lu\n", i,
+			bs2_dev->domains[i].nid,
+			bs2_dev->domains[i].block_high -
+			bs2_dev->domains[i].block_low + 1,
+			bs2_dev->domains[i].num_free);
+	mutex_unlock(&bs2_dev->s_lock);
+
+	bankshot2_print_alloc_stats(bs2_dev);
+}
+
+void bankshot2_print_alloc_stats(struct bankshot2_device *bs2_dev)
+{
+	struct bankshot2_alloc_stats *stats;
+	int i;
+
+	stats = kmalloc(sizeof(struct bankshot2_alloc_stats), GFP_KERNEL);
+	if (!stats)
+		return;
+
+	bankshot2_get_alloc_stats(bs2_dev, stats);
+
+	bs2_info("Free runs %llu, largest %llu blocks, average %llu blocks\n",
+		stats->free_runs, stats->largest_free_run,
+		stats->free_runs ?
+		stats->free_blocks / stats->free_runs : 0);
+	for (i = 0; i < BANKSHOT2_HIST_BUCKETS; i++)
+		if (stats->free_run_hist[i])
+			bs2_info("Free runs of %lu+ blocks: %llu\n",
+				1UL << i, stats->free_run_hist[i]);
+
+	for (i = 0; i < BANKSHOT2_LAT_NUM; i++)
+		bs2_info("%s: count %llu, average %llu ns, max %llu ns\n",
+			AllocLatstring[i], stats->lat_count[i],
+			stats->lat_count[i] ?
+			stats->lat_total_ns[i] / stats->lat_count[i] : 0,
+			stats->lat_max_ns[i]);
+	bs2_info("s_lock contended %llu times\n",
+		stats->lat_count[BANKSHOT2_LAT_LOCK_WAIT] -
+		stats->lat_hist[BANKSHOT2_LAT_LOCK_WAIT][0]);
+
+	kfree(stats);
 }
 
 void bankshot2_clear_stats(struct bankshot2_device *bs2_dev)
@@ -129,7 +202,14 @@ void bankshot2_clear_stats(struct bankshot2_device *bs2_dev)
 	bs2_dev->num_bio = 0;
 	bs2_dev->total_bio_size = 0;
 	bs2_dev->mmap_hit = 0;
+	bs2_dev->zero_pool_hit = 0;
+	bs2_dev->zero_pool_miss = 0;
+	percpu_counter_set(&bs2_dev->cursor_hit, 0);
+	percpu_counter_set(&bs2_dev->cursor_miss, 0);
+	percpu_counter_set(&bs2_dev->hash_hit, 0);
+	percpu_counter_set(&bs2_dev->hash_miss, 0);
 
 	memset(&bs2_dev->cache_stats, 0, sizeof(struct cache_stats));
+	bankshot2_clear_alloc_stats(bs2_dev);
 }
 
@@ -35,7 +35,8 @@ static void bankshot2_init_memblocks(struct bankshot2_device *bs2_dev,
 {
 	bs2_dev->block_start = 0;
 	bs2_dev->block_end = (bs2_dev->size >> PAGE_SHIFT);
-	bs2_dev->num_free_blocks = bs2_dev->block_end;
+	percpu_counter_set(&bs2_dev->num_free_blocks, bs2_dev->block_end);
+	bankshot2_init_domains(bs2_dev);
 }
 
 int bankshot2_init_super(struct bankshot2_device *bs2_dev,
@@ -44,6 +45,8 @@ int bankshot2_init_super(struct bankshot2_device *bs2_dev,
 	int ret;
 	unsigned long blocksize;
 	u64 journal_meta_start, journal_data_start, inode_table_start;
+	u64 hash_start;
+	unsigned long hash_size;
 	struct bankshot2_inode *root_i;
 	struct bankshot2_super_block *super;
 	unsigned long blocknr;
@@ -51,7 +54,6 @@ int bankshot2_init_super(struct bankshot2_device *bs2_dev,
 	bs2_dev->jsize = BANKSHOT2_DEFAULT_JOURNAL_SIZE;
 	bs2_dev->phys_addr = phys_addr;
 
-	INIT_LIST_HEAD(&bs2_dev->block_inuse_head);
 	INIT_LIST_HEAD(&bs2_dev->pi_lru_list);
 	bs2_dev->mode = (S_IRUGO | S_IXUGO | S_IWUSR);
 	bs2_dev->uid = current_fsuid();
@@ -60,7 +62,7 @@ int bankshot2_init_super(struct bankshot2_device *bs2_dev,
 //	mutex_init(&bs2_dev->s_truncate_lock);
 	mutex_init(&bs2_dev->inode_table_mutex);
 	mutex_init(&bs2_dev->s_lock);
-	mutex_init(&bs2_dev->alloc_lock);
+	init_rwsem(&bs2_dev->alloc_lock);
 
 	bs2_dev->physical_tree = RB_ROOT;
 	mutex_init(&bs2_dev->phy_tree_lock);
@@ -74,8 +76,10 @@ int bankshot2_init_super(struct bankshot2_device *bs2_dev,
 	bankshot2_init_memblocks(bs2_dev, phys_addr);
 	blocksize = bs2_dev->blocksize = PAGE_SIZE;
 	bs2_dev->s_blocksize_bits = PAGE_SHIFT;
-	/* Make sure enough room for sb, root, inode table and journal */
-	if (cache_size < PAGE_SIZE * 3 + bs2_dev->jsize) {
+	hash_size = bankshot2_hash_index_size(hash_entries);
+	/* Make sure enough room for sb, root, inode table, journal and
+	 * hash index */
+	if (cache_size < PAGE_SIZE * 3 + bs2_dev->jsize + hash_size) {
 		bs2_info("Not enough space for init\n");
 		bankshot2_iounmap(bs2_dev);
 		return -EINVAL;
@@ -101,6 +105,7 @@ int bankshot2_init_super(struct bankshot2_device *bs2_dev,
 	journal_data_start = BANKSHOT2_SB_SIZE * 2;
 	journal_data_start = (journal_data_start + blocksize - 1) &
 		~(blocksize - 1);
+	hash_start = journal_data_start + bs2_dev->jsize;
 
 	bs2_info("journal meta start %llx data start 0x%llx, "
 		"journal size 0x%x, inode_table 0x%llx\n", journal_meta_start,
@@ -114,9 +119,15 @@ int bankshot2_init_super(struct bankshot2_device *bs2_dev,
 	super->s_magic = cpu_to_le16(BANKSHOT2_SUPER_MAGIC);
 	super->s_journal_offset = cpu_to_le64(journal_meta_start);
 	super->s_inode_table_offset = cpu_to_le64(inode_table_start);
+	super->s_hash_offset = cpu_to_le64(hash_size ? hash_start : 0);
+	super->s_hash_entries = cpu_to_le64(hash_size /
+				sizeof(struct bankshot2_hash_entry));
 
-	ret = bankshot2_init_blockmap(bs2_dev,
-					journal_data_start + bs2_dev->jsize);
+	/* ioremap zeroed the index along with everything else */
+	bankshot2_init_hash_index(bs2_dev, hash_start,
+			hash_size / sizeof(struct bankshot2_hash_entry));
+
+	ret = bankshot2_init_blockmap(bs2_dev, hash_start + hash_size);
 
 	if (ret) {
 		bs2_info("blockmap init failed\n");
@@ -166,7 +177,6 @@ int bankshot2_init_super(struct bankshot2_device *bs2_dev,
 	root_i->i_ino = BANKSHOT2_ROOT_INO;
 	root_i->extent_tree = RB_ROOT;
 	root_i->access_tree = RB_ROOT;
-	init_waitqueue_head(&root_i->wait_queue);
 //	root_i->extent_tree_lock = __RW_LOCK_UNLOCKED(extent_tree_lock);
 	mutex_init(&root_i->tree_lock);
 	INIT_LIST_HEAD(&root_i->lru_list);
@@ -179,13 +189,17 @@ int bankshot2_init_super(struct bankshot2_device *bs2_dev,
 			"block end 0x%lx, free blocks %ld\n",
 			bs2_dev->phys_addr, bs2_dev->size, bs2_dev->virt_addr,
 			bs2_dev->block_start, bs2_dev->block_end,
-			bs2_dev->num_free_blocks);
+			bankshot2_count_free_blocks(bs2_dev));
+
+	if (bankshot2_zero_thread_run(bs2_dev))
+		bs2_info("Zeroed block pool disabled\n");
 
 	return ret;
 }
 	
 void bankshot2_destroy_super(struct bankshot2_device *bs2_dev)
 {
+	bankshot2_zero_thread_stop(bs2_dev);
 	bankshot2_iounmap(bs2_dev);
 	bs2_info("%s returns.\n", __func__);
 }
@@ -4,6 +4,33 @@
 
 #include "bankshot2.h"
 
+/*
+ * Inodes with large data blocks must fill whole blocks: once a block is in
+ * the B-tree every page in it is considered cached. Widen the request to
+ * data block boundaries, but not past the end of the extent.
+ */
+static void bankshot2_align_to_data_block(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, struct bankshot2_cache_data *data,
+		u64 *pos, size_t *count, u64 *b_offset)
+{
+	u64 blk_size = bankshot2_inode_blk_size(pi);
+	u64 start, end, extent_end;
+
+	if (pi->i_blk_type == BANKSHOT2_BLOCK_TYPE_4K)
+		return;
+
+	start = *pos & ~(blk_size - 1);
+	end = (*pos + *count + blk_size - 1) & ~(blk_size - 1);
+	extent_end = PAGE_ALIGN(data->extent_start_file_offset +
+					data->extent_length);
+	if (end > extent_end)
+		end = max(extent_end, *pos + *count);
+
+	*b_offset -= *pos - start;
+	*pos = start;
+	*count = end - start;
+}
+
 static void bankshot2_decide_mmap_extent(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, struct bankshot2_cache_data *data,
 		u64 *pos, size_t *count, u64 *b_offset)
@@ -64,6 +91,8 @@ static void bankshot2_decide_mmap_extent(struct bankshot2_device *bs2_dev,
 //	if (*count > MAX_MMAP_SIZE)
 //		*count = MAX_MMAP_SIZE - (*pos & (MAX_MMAP_SIZE - 1));
 
+	bankshot2_align_to_data_block(bs2_dev, pi, data, pos, count, b_offset);
+
 	data->actual_offset = *pos;
 	bs2_dbg("%s, inode %llu, offset %llu, length %lu\n",
 			__func__, pi->i_ino, *pos, *count);
@@ -112,6 +141,9 @@ static int bankshot2_reclaim_blocks(struct bankshot2_device *bs2_dev,
 }
 
 /* Pre allocate the blocks we need.
+ * In the returned array, 0x1 marks a new page to fill from the backing store
+ * and 0x2 a new page the user write covers. Both get fully overwritten, so
+ * their blocks are not zeroed at allocation.
  * Return 1 means we evicted a extent. */
 static int bankshot2_prealloc_blocks(struct bankshot2_device *bs2_dev,
 		struct bankshot2_inode *pi, struct bankshot2_cache_data *data,
@@ -119,6 +151,7 @@ static int bankshot2_prealloc_blocks(struct bankshot2_device *bs2_dev,
 		size_t req_len,	struct extent_entry **access_extent, int write,
 		int *mmaped)
 {
+	struct bankshot2_block_iter iter;
 	unsigned long index;
 	unsigned long count;
 	unsigned long unallocated = 0;
@@ -148,10 +181,13 @@ static int bankshot2_prealloc_blocks(struct bankshot2_device *bs2_dev,
 //	bankshot2_print_tree(bs2_dev, pi);
 	bs2_dbg("pi root @ 0x%llx, height %u", pi->root, pi->height);
 
-	mutex_lock(&pi->tree_lock);
-
+	/*
+	 * The access extent pins this range, so the scan needs no tree
+	 * lock: lookups are RCU-safe against allocation elsewhere.
+	 */
+	bankshot2_block_iter_init(&iter, pi, index, count);
 	for (i = 0; i < count; i++) {
-		block = bankshot2_find_data_block(bs2_dev, pi, index + i);
+		block = bankshot2_block_iter_next(bs2_dev, &iter);
 		if (!block) {
 			unallocated++;
 			required++;
@@ -165,35 +201,60 @@ static int bankshot2_prealloc_blocks(struct bankshot2_device *bs2_dev,
 				/* If write covers the whole page,
 				 * no need to copy to cache first */
 				required--;
-				array[i] = 0;
+				array[i] = 0x2;
 			}
 		}
 	}
 
 	data->required = required;
 
-	mutex_lock(&bs2_dev->alloc_lock);
-	while (bs2_dev->num_free_blocks < unallocated * 2) {
-		bs2_info("Need eviction: %lu free, %lu required\n",
-				bs2_dev->num_free_blocks, unallocated);
-		num_free = 0;
-		BANKSHOT2_START_TIMING(bs2_dev, evict_t, evict);
-		bankshot2_reclaim_blocks(bs2_dev, pi, data, &num_free);
-		BANKSHOT2_END_TIMING(bs2_dev, evict_t, evict);
-
-		bs2_info("Freed %d blocks for pi %llu, %lu free, "
-				"%lu required\n", num_free, pi->i_ino,
-				bs2_dev->num_free_blocks, unallocated);
-		bs2_info("pi %llu info: backup_ino %llu, %llu blocks, "
-				"%u extents, root %llu\n", pi->i_ino,
-				pi->backup_ino,	pi->i_blocks,
-				pi->num_extents, pi->root);
-		if (!num_free)
-			bs2_info("Reclaim blocks failed\n");
-	}
-
-	bs2_dbg("Before alloc: %lu free\n", bs2_dev->num_free_blocks);
-	before_alloc = bs2_dev->num_free_blocks;
+	/* A full hit with nothing to map never takes the tree lock */
+	if (!unallocated && !data->mmap_length) {
+		kfree(alloc_array);
+		*void_array = array;
+		return 0;
+	}
+
+	mutex_lock(&pi->tree_lock);
+
+	/* Allocators share alloc_lock, eviction takes it exclusively */
+	down_read(&bs2_dev->alloc_lock);
+	if (bankshot2_count_free_blocks(bs2_dev) < unallocated * 2) {
+		up_read(&bs2_dev->alloc_lock);
+		down_write(&bs2_dev->alloc_lock);
+		while (bankshot2_count_free_blocks(bs2_dev) <
+				unallocated * 2) {
+			/* Earlier evictions may only be waiting on a grace
+			 * period, have those first */
+			if (bankshot2_reclaim_deferred(bs2_dev))
+				continue;
+			bs2_info("Need eviction: %lu free, %lu required\n",
+					bankshot2_count_free_blocks(bs2_dev),
+					unallocated);
+			num_free = 0;
+			BANKSHOT2_START_TIMING(bs2_dev, evict_t, evict);
+			bankshot2_reclaim_blocks(bs2_dev, pi, data, &num_free);
+			BANKSHOT2_END_TIMING(bs2_dev, evict_t, evict);
+
+			bs2_info("Freed %d blocks for pi %llu, %lu free, "
+					"%lu required\n", num_free, pi->i_ino,
+					bankshot2_count_free_blocks(bs2_dev),
+					unallocated);
+			bs2_info("pi %llu info: backup_ino %llu, %llu blocks, "
+					"%u extents, root %llu\n", pi->i_ino,
+					pi->backup_ino,	pi->i_blocks,
+					pi->num_extents, pi->root);
+			if (!num_free)
+				bs2_info("Reclaim blocks failed\n");
+		}
+		downgrade_write(&bs2_dev->alloc_lock);
+		/* Zero some of what eviction freed while we fill the cache */
+		bankshot2_wakeup_zero_thread(bs2_dev);
+	}
+
+	bs2_dbg("Before alloc: %lu free\n",
+			bankshot2_count_free_blocks(bs2_dev));
+	before_alloc = bankshot2_count_free_blocks(bs2_dev);
 	if (unallocated) {
 		trans = bankshot2_new_transaction(bs2_dev,
 					count / MAX_PTRS_PER_LENTRY + 2);
@@ -204,15 +265,15 @@ static int bankshot2_prealloc_blocks(struct bankshot2_device *bs2_dev,
 
 		BANKSHOT2_START_TIMING(bs2_dev, alloc_t, alloc);
 		err = bankshot2_alloc_blocks(trans, bs2_dev, pi, index,
-						count, true);
+						count, true, array);
 		BANKSHOT2_END_TIMING(bs2_dev, alloc_t, alloc);
 
 		if (err) {
 			bs2_info("[%s:%d] Alloc failed\n", __func__, __LINE__);
 			bs2_info("Request for pi %llu, %lu free, "
 				"%lu before alloc, %lu required\n", pi->i_ino,
-				bs2_dev->num_free_blocks, before_alloc,
-				unallocated);
+				bankshot2_count_free_blocks(bs2_dev),
+				before_alloc, unallocated);
 			bankshot2_abort_transaction(bs2_dev, trans);
 		}
 
@@ -229,7 +290,7 @@ static int bankshot2_prealloc_blocks(struct bankshot2_device *bs2_dev,
 		}
 	}
 
-	mutex_unlock(&bs2_dev->alloc_lock);
+	up_read(&bs2_dev->alloc_lock);
 
 	if (bio_interception)
 		kfree(alloc_array);
@@ -242,7 +303,8 @@ static int bankshot2_prealloc_blocks(struct bankshot2_device *bs2_dev,
 	*void_array = array;
 
 	mutex_unlock(&pi->tree_lock);
-	bs2_dbg("After alloc: %lu free\n", bs2_dev->num_free_blocks);
+	bs2_dbg("After alloc: %lu free\n",
+			bankshot2_count_free_blocks(bs2_dev));
 
 	if (err) {
 		kfree(array);
@@ -271,7 +333,7 @@ static int bankshot2_find_and_alloc_blocks(struct bankshot2_device *bs2_dev,
 		}
 //retry:
 		err = bankshot2_alloc_blocks(NULL, bs2_dev, pi, iblock,
-						1, true);
+						1, true, NULL);
 		if (err) {
 			bs2_dbg("[%s:%d] Alloc failed, "
 				"trying to reclaim some blocks\n",
@@ -341,6 +403,37 @@ int bankshot2_get_xip_mem(struct bankshot2_device *bs2_dev,
 	return ret;
 }
 
+/*
+ * The other pages of the faulting page's data block are cached too, and
+ * physically contiguous with it, so map them all now instead of taking a
+ * fault for each. This is only a head start: the first page that fails,
+ * already mapped or not, ends it and the rest fault in as usual.
+ */
+static void bankshot2_xip_map_block(struct vm_area_struct *vma,
+		pgoff_t pgoff, pgoff_t size, unsigned long pfn,
+		unsigned int blk_shift)
+{
+	pgoff_t first = pgoff & ~((1UL << blk_shift) - 1);
+	pgoff_t last = first + (1UL << blk_shift);
+	pgoff_t vma_last = vma->vm_pgoff + vma_pages(vma);
+	pgoff_t i;
+
+	if (!blk_shift)
+		return;
+
+	first = max(first, vma->vm_pgoff);
+	last = min3(last, size, vma_last);
+
+	for (i = first; i < last; i++) {
+		if (i == pgoff)
+			continue;
+		if (vm_insert_mixed(vma, vma->vm_start +
+				((i - vma->vm_pgoff) << PAGE_SHIFT),
+				pfn + i - pgoff))
+			break;
+	}
+}
+
 static int bankshot2_xip_file_fault(struct vm_area_struct *vma,
 					struct vm_fault *vmf)
 {
@@ -366,7 +459,6 @@ static int bankshot2_xip_file_fault(struct vm_area_struct *vma,
 
 	bs2_dbg("%s: ino %llu, request pgoff %lu, virtual addr %p\n",
 			__func__, ino, vmf->pgoff, vmf->virtual_address);
-	rcu_read_lock();
 	size = (i_size_read(inode) + PAGE_SIZE - 1) >> PAGE_SHIFT;
 	if (vmf->pgoff >= size) {
 		bs2_info("pgoff %lu >= size %lu (SIGBUS).\n",
@@ -377,7 +469,10 @@ static int bankshot2_xip_file_fault(struct vm_area_struct *vma,
 
 //	ret = bankshot2_get_xip_mem(bs2_dev, pi, vmf->pgoff, 1,
 //				&xip_mem, &xip_pfn);
+	rcu_read_lock();
 	block = bankshot2_find_data_block(bs2_dev, pi, vmf->pgoff);
+	xip_pfn = bankshot2_get_pfn(bs2_dev, block);
+	rcu_read_unlock();
 	if (!block) {
 		bs2_info("%s: pgoff 0x%lx get block failed: %d\n", __func__,
 				vmf->pgoff, -ENODATA);
@@ -385,8 +480,13 @@ static int bankshot2_xip_file_fault(struct vm_area_struct *vma,
 		goto out;
 	}
 
-	xip_pfn = bankshot2_get_pfn(bs2_dev, block);
-
+	/*
+	 * vm_insert_mixed may allocate page tables, so not under RCU. Once
+	 * that is dropped nothing pins the block: eviction only skips
+	 * extents with access set and does not zap user mappings, so a
+	 * block evicted from here on is mapped stale, just as the pages an
+	 * earlier fault mapped from it are.
+	 */
 	ret = vm_insert_mixed(vma, (unsigned long)vmf->virtual_address,
 				xip_pfn);
 	bs2_dbg("%s: insert page: vma %p, pfn %lu, request pgoff %lu, "
@@ -399,95 +499,89 @@ static int bankshot2_xip_file_fault(struct vm_area_struct *vma,
 		goto out;
 	}
 
+	bankshot2_xip_map_block(vma, vmf->pgoff, size, xip_pfn,
+				bankshot2_inode_blk_shift(pi) - PAGE_SHIFT);
 	ret = VM_FAULT_NOPAGE;
 out:
-	rcu_read_unlock();
 //	BANKSHOT2_END_TIMING(bs2_dev, page_fault_t, page_fault);
 
 	return ret;
 }
 
-/* If some other guy is accessing the extent, block until it finishes */
-static void bankshot2_lock_access_extent(struct bankshot2_device *bs2_dev,
-		struct bankshot2_inode *pi, u64 pos, size_t count)
+/*
+ * A read hit copies cached pages and at most hands out a mapping of its
+ * window that is there already, so it can share [pos, pos + count) with
+ * other readers. Called with that range held shared.
+ */
+static bool bankshot2_read_hit(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, struct bankshot2_cache_data *data,
+		u64 pos, size_t count)
 {
-	timing_t time;
+	struct bankshot2_block_iter iter;
+	unsigned long nr_pages, num;
+	bool hit = true;
+
+	nr_pages = count >> PAGE_SHIFT;
+	bankshot2_block_iter_init(&iter, pi, pos >> PAGE_SHIFT, nr_pages);
+	while (nr_pages) {
+		if (!bankshot2_block_iter_next_run(bs2_dev, &iter, nr_pages,
+							&num))
+			return false;
+		nr_pages -= num;
+	}
 
-	while(true) {
+	if (data->mmap_length) {
 		mutex_lock(&pi->tree_lock);
-		BANKSHOT2_START_TIMING(bs2_dev, insert_access_t, time);
-		if (bankshot2_extent_being_accessed(bs2_dev, pi, pos, count)
-				== 0) {
-			bankshot2_insert_access_extent(bs2_dev, pi, pos,
-							count);
-			bs2_dbg("Lock extent: pi %llu, offset 0x%llx, "
-					"size %lu\n", pi->i_ino, pos, count);
-			BANKSHOT2_END_TIMING(bs2_dev, insert_access_t, time);
-			mutex_unlock(&pi->tree_lock);
-			break;
-		}
+		hit = bankshot2_mmap_hit(bs2_dev, pi, data);
 		mutex_unlock(&pi->tree_lock);
-		bs2_info("Waiting on extent: pi %llu, offset 0x%llx, "
-					"size %lu\n", pi->i_ino, pos, count);
-		BANKSHOT2_START_TIMING(bs2_dev, wait_access_t, time);
-		wait_event_interruptible_timeout(pi->wait_queue, false,
-					msecs_to_jiffies(1));
-		BANKSHOT2_END_TIMING(bs2_dev, wait_access_t, time);
-		bs2_info("Wakeup and test again: pi %llu, offset 0x%llx, "
-					"size %lu\n", pi->i_ino, pos, count);
 	}
 
-	return;
-}
-
-static void bankshot2_unlock_access_extent(struct bankshot2_device *bs2_dev,
-		struct bankshot2_inode *pi, u64 pos, size_t count)
-{
-	timing_t time;
-
-	mutex_lock(&pi->tree_lock);
-
-	BANKSHOT2_START_TIMING(bs2_dev, remove_access_t, time);
-	bankshot2_remove_access_extent(bs2_dev, pi, pos, count);
-	BANKSHOT2_END_TIMING(bs2_dev, remove_access_t, time);
-
-	mutex_unlock(&pi->tree_lock);
-	bs2_dbg("Release extent: pi %llu, offset 0x%llx, size %lu\n",
-			pi->i_ino, pos, count);
-	wake_up_interruptible(&pi->wait_queue);
-
-	return;
+	return hit;
 }
 
 int bankshot2_xip_file_read(struct bankshot2_device *bs2_dev,
 		struct bankshot2_cache_data *data, struct bankshot2_inode *pi,
 		ssize_t *actual_length)
 {
-	size_t bytes, user_bytes;
 	ssize_t read = 0;
-	u64 pos, block, origin_pos;
+	u64 pos, block, stop, hit_pos;
 	u64 user_offset = data->offset;
-	size_t count, origin_count;
+	size_t count, hit_count;
 	size_t req_len = data->size;
 	u64 b_offset;
 	char *buf = data->buf;
-	unsigned long index;
-	unsigned long offset, user_offset_in_page;
+	unsigned long index, nr_pages, num;
+	unsigned long offset;
 	size_t copy_user;
 	void *xmem;
 	char *void_array = NULL;
 	int ret;
 	unsigned long required;
 	struct extent_entry *access_extent = NULL;
+	struct bankshot2_range_lock range;
+	struct bankshot2_block_iter iter;
 	timing_t bs_read_r, copy_user_time;
 	int mmaped = 0;
 
 	bankshot2_decide_mmap_extent(bs2_dev, pi, data, &pos, &count, &b_offset);
 
-	/* Add to access extent tree, may sleep */
-	bankshot2_lock_access_extent(bs2_dev, pi, pos, count);
-	origin_pos = pos;
-	origin_count = count;
+	/* A hit shares the pages it copies, or the window it maps */
+	if (data->mmap_length) {
+		hit_pos = pos;
+		hit_count = count;
+	} else {
+		hit_pos = user_offset & PAGE_MASK;
+		hit_count = PAGE_ALIGN(user_offset + req_len) - hit_pos;
+	}
+	bankshot2_lock_range(bs2_dev, pi, &range, hit_pos, hit_count, false);
+	if (bankshot2_read_hit(bs2_dev, pi, data, hit_pos, hit_count)) {
+		data->required = 0;
+		goto fill_cache;
+	}
+	bankshot2_unlock_range(bs2_dev, pi, &range);
+
+	/* Fills and new mappings hold the whole range exclusively */
+	bankshot2_lock_range(bs2_dev, pi, &range, pos, count, true);
 
 	/* Pre-allocate the blocks we need */
 	ret = bankshot2_prealloc_blocks(bs2_dev, pi, data, &void_array,
@@ -498,8 +592,12 @@ int bankshot2_xip_file_read(struct bankshot2_device *bs2_dev,
 
 	required = ret;
 
-	if (mmaped == 1)
+	if (mmaped == 1) {
+		/* Nothing will fill the new pages, don't leave them stale */
+		bankshot2_zero_unfilled_pages(bs2_dev, pi, pos, void_array,
+					0, PAGE_ALIGN(count) >> PAGE_SHIFT, 0x1);
 		goto fill_cache;
+	}
 
 	/* Copy to cache first if it's not in cache */
 	BANKSHOT2_START_TIMING(bs2_dev, bs_read_r_t, bs_read_r);
@@ -512,49 +610,48 @@ int bankshot2_xip_file_read(struct bankshot2_device *bs2_dev,
 		goto out;
 
 fill_cache:
-	/* Now copy to user buffer */
-	do {
-		offset = pos & (bs2_dev->blocksize - 1); /* Within page */
-		index = pos >> bs2_dev->s_blocksize_bits;
-		bytes = bs2_dev->blocksize - offset;
-//		i = index - start_index;
-
-		if (bytes > count)
-			bytes = count;
-
-		if (req_len > 0 && ((user_offset >> bs2_dev->s_blocksize_bits)
-				== index)) { // Same page
-			BANKSHOT2_START_TIMING(bs2_dev, copy_to_user_t,
-						copy_user_time);
-			user_offset_in_page =
-				user_offset & (bs2_dev->blocksize - 1);
-			user_bytes = bs2_dev->blocksize - user_offset_in_page;
-			block = bankshot2_find_data_block(bs2_dev, pi, index);
-			if (!block) {
-				bs2_info("%s: get block failed, index 0x%lx\n",
-						__func__, index);
-				break;
-			}
-			xmem = bankshot2_get_block(bs2_dev, block);
-			copy_user = min(req_len, user_bytes);
-			__copy_to_user(buf, xmem + user_offset_in_page,
-					copy_user);
-			req_len -= copy_user;
-			buf += copy_user;
-			user_offset += copy_user;
-			BANKSHOT2_END_TIMING(bs2_dev, copy_to_user_t,
-						copy_user_time);
+	/* Now copy to user buffer, one copy per contiguous cache run */
+	index = user_offset >> bs2_dev->s_blocksize_bits;
+	offset = user_offset & (bs2_dev->blocksize - 1);
+	nr_pages = DIV_ROUND_UP(offset + req_len, bs2_dev->blocksize);
+	bankshot2_block_iter_init(&iter, pi, index, nr_pages);
+	while (req_len > 0) {
+		BANKSHOT2_START_TIMING(bs2_dev, copy_to_user_t,
+					copy_user_time);
+		block = bankshot2_block_iter_next_run(bs2_dev, &iter,
+							nr_pages, &num);
+		if (!block) {
+			bs2_info("%s: get block failed, index 0x%lx\n",
+					__func__, index);
+			break;
 		}
+		bankshot2_block_iter_prefetch(bs2_dev, &iter, 0);
+		xmem = bankshot2_get_block(bs2_dev, block);
+		copy_user = min(req_len, (num << bs2_dev->s_blocksize_bits) -
+						offset);
+		__copy_to_user(buf, xmem + offset, copy_user);
+		req_len -= copy_user;
+		buf += copy_user;
+		index += num;
+		nr_pages -= num;
+		offset = 0;
+		BANKSHOT2_END_TIMING(bs2_dev, copy_to_user_t,
+					copy_user_time);
+	}
 
-//		bankshot2_flush_edge_cachelines(pos, bytes, xmem + offset);
-
-		read += bytes;
-		count -= bytes;
-		pos += bytes;
-		b_offset += bytes;
-	} while (count);
-
-	if (pos > pi->i_size) {
+	/* Stopped at a page without a block: report up to it */
+	if (req_len > 0) {
+		stop = (u64)index << bs2_dev->s_blocksize_bits;
+		count = stop > pos ? min_t(u64, stop - pos, count) : 0;
+	}
+	read = count;
+	pos += count;
+
+	/*
+	 * Only a fill grows i_size: a hit maps nothing new, and with the
+	 * range shared other readers could store a smaller size after us.
+	 */
+	if (range.exclusive && pos > pi->i_size) {
 		bankshot2_update_isize(pi, pos);
 	}	
 
@@ -562,7 +659,7 @@ fill_cache:
 	ret = 0;
 
 out:
-	bankshot2_unlock_access_extent(bs2_dev, pi, origin_pos, origin_count);
+	bankshot2_unlock_range(bs2_dev, pi, &range);
 	kfree(void_array);
 //	bankshot2_clear_extent_access(bs2_dev, pi, start_index);
 	if (access_extent)
@@ -576,31 +673,32 @@ ssize_t bankshot2_xip_file_write(struct bankshot2_device *bs2_dev,
 		ssize_t *actual_length)
 {
 	long status = 0;
-	size_t bytes, user_bytes;
 	ssize_t written = 0;
-	u64 pos, origin_pos;
+	u64 pos, origin_pos, stop;
 	u64 block;
 	u64 user_offset = data->offset;
 	size_t count, origin_count;
 	size_t req_len = data->size;
 	u64 b_offset;
 	char *buf = data->buf;
-	unsigned long index;
-	unsigned long offset, user_offset_in_page;
+	unsigned long index, nr_pages, num;
+	unsigned long offset;
 	size_t copied, copy_user;
 	void *xmem;
 	char *void_array = NULL;
 	int ret;
 	unsigned long required;
 	struct extent_entry *access_extent = NULL;
+	struct bankshot2_range_lock range;
+	struct bankshot2_block_iter iter;
 	timing_t bs_read_w, copy_user_time;
 	int mmaped = 0;
 
 	bankshot2_decide_mmap_extent(bs2_dev, pi, data, &pos, &count,
 					&b_offset);
 
-	/* Add to access extent tree, may sleep */
-	bankshot2_lock_access_extent(bs2_dev, pi, pos, count);
+	/* Hold the range against other reads and writes, may sleep */
+	bankshot2_lock_range(bs2_dev, pi, &range, pos, count, true);
 	origin_pos = pos;
 	origin_count = count;
 
@@ -613,8 +711,12 @@ ssize_t bankshot2_xip_file_write(struct bankshot2_device *bs2_dev,
 
 	required = ret;
 
-	if (mmaped == 1)
+	if (mmaped == 1) {
+		/* Nothing will fill the new pages, don't leave them stale */
+		bankshot2_zero_unfilled_pages(bs2_dev, pi, pos, void_array,
+					0, PAGE_ALIGN(count) >> PAGE_SHIFT, 0x1);
 		goto fill_cache;
+	}
 
 //	start_index = pos >> bs2_dev->s_blocksize_bits;
 
@@ -629,62 +731,61 @@ ssize_t bankshot2_xip_file_write(struct bankshot2_device *bs2_dev,
 		goto out;
 
 fill_cache:
-	do {
-		offset = pos & (bs2_dev->blocksize - 1); /* Within page */
-		index = pos >> bs2_dev->s_blocksize_bits;
-		bytes = bs2_dev->blocksize - offset;
-
-		if (bytes > count)
-			bytes = count;
-
-		if (req_len > 0 && ((user_offset >> bs2_dev->s_blocksize_bits)
-					== index)) { // Same page
-			BANKSHOT2_START_TIMING(bs2_dev, copy_from_user_t,
-						copy_user_time);
-			block = bankshot2_find_data_block(bs2_dev, pi, index);
-			if (!block) {
-				bs2_info("%s: get block failed, index 0x%lx\n",
-						__func__, index);
-				break;
-			}
-			xmem = bankshot2_get_block(bs2_dev, block);
-
-			user_offset_in_page =
-				user_offset & (bs2_dev->blocksize - 1);
-			user_bytes = bs2_dev->blocksize - user_offset_in_page;
-			copy_user = min(req_len, user_bytes);
-
-			bs2_dbg("copy %p to index %lu, offset 0x%llx\n",
-					xmem, index, pos);
-			copied = copy_user -
-				__copy_from_user_inatomic_nocache(
-					xmem + user_offset_in_page,
-					buf, copy_user);
-			if (unlikely(copied != copy_user)) {
-				bs2_info("%s: copied %lu, bytes %lu\n",
-						__func__, copied, copy_user);
-				status = -EFAULT;
-				break;
-			}
-			req_len -= copied;
-			buf += copied;
-			user_offset += copied;
-			bankshot2_flush_edge_cachelines(pos, copied,
-						xmem + user_offset_in_page);
-			BANKSHOT2_END_TIMING(bs2_dev, copy_from_user_t,
-						copy_user_time);
+	/* Copy from the user buffer, one copy per contiguous cache run */
+	index = user_offset >> bs2_dev->s_blocksize_bits;
+	offset = user_offset & (bs2_dev->blocksize - 1);
+	nr_pages = DIV_ROUND_UP(offset + req_len, bs2_dev->blocksize);
+	bankshot2_block_iter_init(&iter, pi, index, nr_pages);
+	while (req_len > 0) {
+		BANKSHOT2_START_TIMING(bs2_dev, copy_from_user_t,
+					copy_user_time);
+		block = bankshot2_block_iter_next_run(bs2_dev, &iter,
+							nr_pages, &num);
+		if (!block) {
+			bs2_info("%s: get block failed, index 0x%lx\n",
+					__func__, index);
+			break;
 		}
+		bankshot2_block_iter_prefetch(bs2_dev, &iter, 1);
+		xmem = bankshot2_get_block(bs2_dev, block);
+		copy_user = min(req_len, (num << bs2_dev->s_blocksize_bits) -
+						offset);
+
+		bs2_dbg("copy %p to index %lu, offset 0x%llx\n",
+				xmem, index, user_offset);
+		copied = copy_user -
+			__copy_from_user_inatomic_nocache(xmem + offset,
+							buf, copy_user);
+		bankshot2_flush_edge_cachelines(user_offset, copied,
+						xmem + offset);
+		req_len -= copied;
+		buf += copied;
+		user_offset += copied;
+		BANKSHOT2_END_TIMING(bs2_dev, copy_from_user_t,
+					copy_user_time);
+		if (unlikely(copied != copy_user)) {
+			bs2_info("%s: copied %lu, bytes %lu\n",
+					__func__, copied, copy_user);
+			index = user_offset >> bs2_dev->s_blocksize_bits;
+			status = -EFAULT;
+			break;
+		}
+		index += num;
+		nr_pages -= num;
+		offset = 0;
+	}
 
-//		bs2_dbg("After copy from user\n");
-
-//		bankshot2_copy_from_cache(bs2_dev, addr, bytes, xmem);
-//		bankshot2_flush_edge_cachelines(pos, copied, xmem + offset);
-		status = bytes;
-		written += status;
-		count -= status;
-		pos += status;
-		b_offset += status;
-	} while (count);
+	/* Bailed out early at page index: report up to it. The new pages
+	 * the write was meant to cover from there on were never zeroed. */
+	if (req_len > 0) {
+		stop = (u64)index << bs2_dev->s_blocksize_bits;
+		count = stop > pos ? min_t(u64, stop - pos, count) : 0;
+		bankshot2_zero_unfilled_pages(bs2_dev, pi, origin_pos,
+				void_array, index - (origin_pos >> PAGE_SHIFT),
+				PAGE_ALIGN(origin_count) >> PAGE_SHIFT, 0x2);
+	}
+	written = count;
+	pos += count;
 
 	if (pos > pi->i_size) {
 		bankshot2_update_isize(pi, pos);
@@ -694,7 +795,7 @@ fill_cache:
 	ret = status < 0 ? status : 0;
 
 out:
-	bankshot2_unlock_access_extent(bs2_dev, pi, origin_pos, origin_count);
+	bankshot2_unlock_range(bs2_dev, pi, &range);
 	kfree(void_array);
 //	bankshot2_clear_extent_access(bs2_dev, pi, start_index);
 	if (access_extent)
@@ -714,7 +815,8 @@ int bankshot2_fsync_to_cache(struct bankshot2_device *bs2_dev,
 	void *xmem;
 	pgoff_t pgoff;
 	loff_t offset;
-	unsigned long nr_flush_bytes;
+	unsigned long nr_flush_bytes, nr_pages, num;
+	struct bankshot2_block_iter iter;
 	u64 ino, block;
 	timing_t fsync_time;
 
@@ -766,23 +868,32 @@ int bankshot2_fsync_to_cache(struct bankshot2_device *bs2_dev,
 	end = CACHELINE_ALIGN(end);
 
 	BANKSHOT2_START_TIMING(bs2_dev, fsync_t, fsync_time);
+	if (start >= end)
+		goto out;
+
+	/* Flush a contiguous cache run at a time */
+	pgoff = start >> PAGE_SHIFT;
+	nr_pages = ((end - 1) >> PAGE_SHIFT) - pgoff + 1;
+	bankshot2_block_iter_init(&iter, pi, pgoff, nr_pages);
 	do {
-		pgoff = start >> PAGE_SHIFT;
 		offset = start & ~PAGE_MASK;
-
-		nr_flush_bytes = PAGE_CACHE_SIZE - offset;
-		if (nr_flush_bytes > (end - start))
-			nr_flush_bytes = end - start;
-
-		block = bankshot2_find_data_block(bs2_dev, pi, pgoff);
+		block = bankshot2_block_iter_next_run(bs2_dev, &iter,
+							nr_pages, &num);
 		if (!block) {
 			bs2_dbg("%s: get block failed, index 0x%lx\n",
 					__func__, pgoff);
 			goto out;
 		}
+
+		nr_flush_bytes = (num << PAGE_SHIFT) - offset;
+		if (nr_flush_bytes > (end - start))
+			nr_flush_bytes = end - start;
+
 		xmem = bankshot2_get_block(bs2_dev, block);
 		bankshot2_flush_buffer(xmem + offset, nr_flush_bytes, 0);
 		start += nr_flush_bytes;
+		pgoff += num;
+		nr_pages -= num;
 	} while (start < end);
 
 out:
@@ -0,0 +1,740 @@
+/*
+ * Bankshot2 userspace microbenchmarks.
+ * Brings up the cache core the way bankshot2_init() does, on an mmap'ed
+ * "PM" region, and times the hot paths at 1, 2, 4, ... threads.
+ */
+
+#include "../bankshot2.h"
+#include <getopt.h>
+#include <sched.h>
+#include <unistd.h>
+
+/* Module parameters and hooks that live in files not built here */
+int measure_timing = 0;
+int data_block_type = BANKSHOT2_DEFAULT_BLOCK_TYPE;
+unsigned long data_block_size = 0;
+int alloc_stripes = 1;
+int extent_mapping = 0;
+unsigned long hash_entries = 0;
+
+int bankshot2_write_back_extent(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, struct bankshot2_cache_data *data,
+		struct extent_entry *extent)
+{
+	return 0;
+}
+
+void bankshot2_munmap_extent(struct bankshot2_device *bs2_dev,
+		struct bankshot2_inode *pi, struct extent_entry *extent)
+{
+}
+
+#define BENCH_MAX_THREADS	64
+#define BENCH_LOOKUP_BLOCKS	32768
+#define BENCH_RANGE_PAGES	512UL
+#define BENCH_FILL_CHUNK	32768UL
+#define BENCH_LOCK_PAGES	64UL
+#define BENCH_HELD_RANGES	256
+
+struct bench_thread;
+
+struct bench {
+	const char *name;
+	unsigned long *nr_ops;
+	void (*setup)(struct bench_thread *t);
+	void (*run)(struct bench_thread *t);
+	void (*teardown)(struct bench_thread *t);
+};
+
+struct bench_thread {
+	pthread_t thread;
+	int id;
+	const struct bench *bench;
+	struct bankshot2_inode *pi;
+	struct inode inode;
+	unsigned long *blocks;
+	char *buf;
+	struct bankshot2_range_lock *held;
+	u64 ns;
+};
+
+struct bankshot2_device *bs2_dev;
+static struct bankshot2_inode *lookup_pi;
+static struct bench_thread threads[BENCH_MAX_THREADS];
+static pthread_barrier_t barrier;
+static unsigned long nr_ops = 100000;
+static unsigned long nr_alloc_ops;
+static unsigned long nr_lookup_blocks = BENCH_LOOKUP_BLOCKS;
+static unsigned long nr_hash_ops;
+static unsigned long nr_fill_ops;
+static unsigned long nr_copy_ops;
+static unsigned long nr_copy_pages;
+
+static inline u64 bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long bench_rand(unsigned long *seed)
+{
+	*seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+	return *seed >> 33;
+}
+
+static struct bankshot2_inode *bench_new_inode(struct inode *inode,
+		unsigned long ino)
+{
+	struct bankshot2_cache_data data;
+	u64 st_ino;
+
+	memset(inode, 0, sizeof(*inode));
+	inode->i_ino = ino;
+	inode->i_mode = S_IFREG | S_IRUGO;
+	inode->i_nlink = 1;
+
+	memset(&data, 0, sizeof(data));
+	data.inode = inode;
+	return bankshot2_find_cache_inode(bs2_dev, &data, &st_ino);
+}
+
+/* Fill a file's mapping with num data blocks, logged like the xip path,
+ * a journal-sized chunk per transaction */
+static int bench_fill_inode(struct bankshot2_inode *pi, unsigned long num)
+{
+	bankshot2_transaction_t *trans;
+	unsigned long done, chunk;
+	int err;
+
+	for (done = 0; done < num; done += chunk) {
+		chunk = min(num - done, BENCH_FILL_CHUNK);
+		trans = bankshot2_new_transaction(bs2_dev,
+					chunk / MAX_PTRS_PER_LENTRY + 2);
+		if (IS_ERR(trans))
+			return PTR_ERR(trans);
+
+		err = bankshot2_alloc_blocks(trans, bs2_dev, pi, done, chunk,
+						false, NULL);
+		if (err) {
+			bankshot2_abort_transaction(bs2_dev, trans);
+			return err;
+		}
+
+		bankshot2_commit_transaction(bs2_dev, trans);
+	}
+
+	pi->i_size = num << bankshot2_inode_blk_shift(pi);
+	return 0;
+}
+
+/* ----------------------------- alloc --------------------------------- */
+static void alloc_setup(struct bench_thread *t)
+{
+	t->blocks = malloc(nr_alloc_ops * sizeof(unsigned long));
+}
+
+static void alloc_run(struct bench_thread *t)
+{
+	unsigned long i;
+
+	for (i = 0; i < nr_alloc_ops; i++)
+		if (bankshot2_new_block(bs2_dev, &t->blocks[i],
+				BANKSHOT2_BLOCK_TYPE_4K, 0))
+			abort();
+}
+
+static void free_run(struct bench_thread *t)
+{
+	unsigned long i;
+
+	for (i = 0; i < nr_alloc_ops; i++)
+		bankshot2_free_block(bs2_dev, t->blocks[i],
+				BANKSHOT2_BLOCK_TYPE_4K);
+}
+
+static void alloc_teardown(struct bench_thread *t)
+{
+	free(t->blocks);
+	t->blocks = NULL;
+}
+
+/* ----------------------------- fill ---------------------------------- */
+/* Map nr_fill_ops pages of an empty inode, the way a cache miss does */
+static void fill_run(struct bench_thread *t)
+{
+	if (bench_fill_inode(t->pi, nr_fill_ops))
+		abort();
+}
+
+static void fill_teardown(struct bench_thread *t)
+{
+	bankshot2_truncate_blocks(bs2_dev, t->pi, 0,
+				le64_to_cpu(t->pi->i_size));
+	t->pi->i_size = 0;
+}
+
+/* ----------------------------- lookup -------------------------------- */
+static void lookup_run(struct bench_thread *t)
+{
+	unsigned long seed = t->id + 1;
+	unsigned long i;
+
+	for (i = 0; i < nr_ops; i++)
+		if (!bankshot2_find_data_block(bs2_dev, lookup_pi,
+				bench_rand(&seed) % nr_lookup_blocks))
+			abort();
+}
+
+/* The same random pages as lookup, straight from the hash index */
+static void lookup_hash_run(struct bench_thread *t)
+{
+	unsigned long seed = t->id + 1;
+	unsigned long i;
+
+	for (i = 0; i < nr_hash_ops; i++)
+		if (!bankshot2_hash_lookup(bs2_dev, lookup_pi,
+				bench_rand(&seed) % nr_lookup_blocks))
+			abort();
+}
+
+/* Page by page over random 2MB windows, the way the copy loops walk */
+static void lookup_range_run(struct bench_thread *t)
+{
+	struct bankshot2_block_iter iter;
+	unsigned long seed = t->id + 1;
+	unsigned long window = min(nr_lookup_blocks, BENCH_RANGE_PAGES);
+	unsigned long i, left = 0;
+
+	for (i = 0; i < nr_ops; i++, left--) {
+		if (left == 0) {
+			bankshot2_block_iter_init(&iter, lookup_pi,
+				bench_rand(&seed) %
+					(nr_lookup_blocks - window + 1),
+				window);
+			left = window;
+		}
+		if (!bankshot2_block_iter_next(bs2_dev, &iter))
+			abort();
+	}
+}
+
+/* ----------------------------- copy ---------------------------------- */
+/* Map nr_copy_pages pages in random order, as scattered misses fill a
+ * file, so that no two neighbouring pages are contiguous in the cache */
+static void copy_setup(struct bench_thread *t)
+{
+	unsigned long i, j, tmp, seed = t->id + 1;
+
+	t->blocks = malloc(nr_copy_pages * sizeof(unsigned long));
+	t->buf = malloc(BENCH_RANGE_PAGES << PAGE_SHIFT);
+	for (i = 0; i < nr_copy_pages; i++)
+		t->blocks[i] = i;
+	for (i = nr_copy_pages - 1; i > 0; i--) {
+		j = bench_rand(&seed) % (i + 1);
+		tmp = t->blocks[i];
+		t->blocks[i] = t->blocks[j];
+		t->blocks[j] = tmp;
+	}
+	for (i = 0; i < nr_copy_pages; i++)
+		if (bankshot2_alloc_blocks(NULL, bs2_dev, t->pi,
+				t->blocks[i], 1, false, NULL))
+			abort();
+	t->pi->i_size = nr_copy_pages << PAGE_SHIFT;
+}
+
+/* Copy random 2MB windows out of the cache, a run at a time like
+ * do_fsync_cache_fill(), with or without prefetching the next run */
+static void copy_windows(struct bench_thread *t, int pf)
+{
+	struct bankshot2_block_iter iter;
+	unsigned long seed = t->id + 1;
+	unsigned long i, left, num;
+	char *buf;
+	u64 block;
+
+	for (i = 0; i < nr_copy_ops; i++) {
+		bankshot2_block_iter_init(&iter, t->pi,
+			bench_rand(&seed) % (nr_copy_pages /
+				BENCH_RANGE_PAGES) * BENCH_RANGE_PAGES,
+			BENCH_RANGE_PAGES);
+		buf = t->buf;
+		for (left = BENCH_RANGE_PAGES; left; left -= num) {
+			block = bankshot2_block_iter_next_run(bs2_dev, &iter,
+							left, &num);
+			if (!block)
+				abort();
+			if (pf)
+				bankshot2_block_iter_prefetch(bs2_dev, &iter,
+								0);
+			memcpy(buf, bankshot2_get_block(bs2_dev, block),
+				num << PAGE_SHIFT);
+			buf += num << PAGE_SHIFT;
+		}
+	}
+}
+
+static void copy_run(struct bench_thread *t)
+{
+	copy_windows(t, 0);
+}
+
+static void copy_prefetch_run(struct bench_thread *t)
+{
+	copy_windows(t, 1);
+}
+
+static void copy_teardown(struct bench_thread *t)
+{
+	bankshot2_truncate_blocks(bs2_dev, t->pi, 0,
+				le64_to_cpu(t->pi->i_size));
+	t->pi->i_size = 0;
+	free(t->blocks);
+	t->blocks = NULL;
+	free(t->buf);
+	t->buf = NULL;
+}
+
+/* ----------------------------- range lock ---------------------------- */
+/* Lock random two-page ranges of a shared inode, within a span small
+ * enough that threads keep running into each other. Holders give up the
+ * CPU inside the range, as a miss going to the backing store would. */
+static void range_lock_run(struct bench_thread *t)
+{
+	struct bankshot2_range_lock range;
+	unsigned long seed = t->id + 1;
+	unsigned long span = min(nr_lookup_blocks, BENCH_LOCK_PAGES);
+	unsigned long i, page;
+
+	for (i = 0; i < nr_ops; i++) {
+		page = bench_rand(&seed) % span;
+		bankshot2_lock_range(bs2_dev, lookup_pi, &range,
+				page << PAGE_SHIFT, 2 * PAGE_SIZE, true);
+		if (!bankshot2_find_data_block(bs2_dev, lookup_pi, page))
+			abort();
+		sched_yield();
+		bankshot2_unlock_range(bs2_dev, lookup_pi, &range);
+	}
+}
+
+/* Readers of random pages of one 2MB window, holding the window
+ * exclusively or just their page shared, as read misses and hits do */
+static void window_read(struct bench_thread *t, bool shared)
+{
+	struct bankshot2_range_lock range;
+	unsigned long seed = t->id + 1;
+	unsigned long window = min(nr_lookup_blocks, BENCH_RANGE_PAGES);
+	unsigned long i, page;
+	u64 block;
+
+	for (i = 0; i < nr_ops; i++) {
+		page = bench_rand(&seed) % window;
+		if (shared)
+			bankshot2_lock_range(bs2_dev, lookup_pi, &range,
+				page << PAGE_SHIFT, PAGE_SIZE, false);
+		else
+			bankshot2_lock_range(bs2_dev, lookup_pi, &range,
+				0, window << PAGE_SHIFT, true);
+		block = bankshot2_find_data_block(bs2_dev, lookup_pi, page);
+		if (!block)
+			abort();
+		memcpy(t->buf, bankshot2_get_block(bs2_dev, block), PAGE_SIZE);
+		sched_yield();
+		bankshot2_unlock_range(bs2_dev, lookup_pi, &range);
+	}
+}
+
+static void window_setup(struct bench_thread *t)
+{
+	t->buf = malloc(PAGE_SIZE);
+}
+
+static void window_excl_run(struct bench_thread *t)
+{
+	window_read(t, false);
+}
+
+static void window_shared_run(struct bench_thread *t)
+{
+	window_read(t, true);
+}
+
+static void window_teardown(struct bench_thread *t)
+{
+	free(t->buf);
+	t->buf = NULL;
+}
+
+/* Lock random pages shared while every thread keeps BENCH_HELD_RANGES
+ * ranges of the file held, single pages and every 16th a 2MB window, as
+ * many readers in flight on one large file would */
+static void range_crowded_setup(struct bench_thread *t)
+{
+	unsigned long seed = t->id + 1;
+	unsigned long span = nr_lookup_blocks, pages;
+	int i;
+
+	t->held = malloc(BENCH_HELD_RANGES * sizeof(*t->held));
+	for (i = 0; i < BENCH_HELD_RANGES; i++) {
+		pages = i % 16 ? 1 : min(span, BENCH_RANGE_PAGES);
+		bankshot2_lock_range(bs2_dev, lookup_pi, &t->held[i],
+			(bench_rand(&seed) % (span - pages + 1)) << PAGE_SHIFT,
+			pages << PAGE_SHIFT, false);
+	}
+}
+
+static void range_crowded_run(struct bench_thread *t)
+{
+	struct bankshot2_range_lock range;
+	unsigned long seed = t->id + 1001;
+	unsigned long i, page;
+
+	for (i = 0; i < nr_ops; i++) {
+		page = bench_rand(&seed) % nr_lookup_blocks;
+		bankshot2_lock_range(bs2_dev, lookup_pi, &range,
+				page << PAGE_SHIFT, PAGE_SIZE, false);
+		bankshot2_unlock_range(bs2_dev, lookup_pi, &range);
+	}
+}
+
+static void range_crowded_teardown(struct bench_thread *t)
+{
+	int i;
+
+	for (i = 0; i < BENCH_HELD_RANGES; i++)
+		bankshot2_unlock_range(bs2_dev, lookup_pi, &t->held[i]);
+	free(t->held);
+	t->held = NULL;
+}
+
+/* ----------------------------- extents ------------------------------- */
+static void extent_setup(struct bench_thread *t)
+{
+	unsigned long i, j, tmp, seed = t->id + 1;
+
+	/* Insert in random order so the tree sees real rebalancing */
+	t->blocks = malloc(nr_ops * sizeof(unsigned long));
+	for (i = 0; i < nr_ops; i++)
+		t->blocks[i] = i;
+	for (i = nr_ops - 1; i > 0; i--) {
+		j = bench_rand(&seed) % (i + 1);
+		tmp = t->blocks[i];
+		t->blocks[i] = t->blocks[j];
+		t->blocks[j] = tmp;
+	}
+}
+
+static void extent_insert_run(struct bench_thread *t)
+{
+	struct extent_entry *access_extent;
+	unsigned long i;
+
+	mutex_lock(&t->pi->tree_lock);
+	for (i = 0; i < nr_ops; i++)
+		bankshot2_add_extent(bs2_dev, t->pi,
+				t->blocks[i] << PAGE_SHIFT, PAGE_SIZE,
+				t->blocks[i] << PAGE_SHIFT,
+				t->inode.i_mapping, NULL, &access_extent);
+	mutex_unlock(&t->pi->tree_lock);
+}
+
+static void extent_remove_run(struct bench_thread *t)
+{
+	unsigned long i;
+
+	mutex_lock(&t->pi->tree_lock);
+	for (i = 0; i < nr_ops; i++)
+		bankshot2_remove_extent(bs2_dev, t->pi,
+				t->blocks[i] << PAGE_SHIFT);
+	mutex_unlock(&t->pi->tree_lock);
+}
+
+/* ----------------------------- journal ------------------------------- */
+static void commit_run(struct bench_thread *t)
+{
+	bankshot2_transaction_t *trans;
+	unsigned long i;
+
+	for (i = 0; i < nr_ops; i++) {
+		/* A full journal is normal: let the cleaner catch up */
+		while (IS_ERR(trans = bankshot2_new_transaction(bs2_dev,
+						MAX_INODE_LENTRIES))) {
+			if (PTR_ERR(trans) != -EAGAIN)
+				abort();
+			wake_up_interruptible(&bs2_dev->log_cleaner_wait);
+			sched_yield();
+		}
+		bankshot2_add_logentry(bs2_dev, trans, t->pi,
+					MAX_DATA_PER_LENTRY, LE_DATA);
+		bankshot2_commit_transaction(bs2_dev, trans);
+	}
+}
+
+static const struct bench benches[] = {
+	{ "alloc", &nr_alloc_ops, alloc_setup, alloc_run, NULL },
+	{ "free", &nr_alloc_ops, NULL, free_run, alloc_teardown },
+	{ "fill", &nr_fill_ops, NULL, fill_run, fill_teardown },
+	{ "lookup", &nr_ops, NULL, lookup_run, NULL },
+	{ "lookup hash", &nr_hash_ops, NULL, lookup_hash_run, NULL },
+	{ "lookup range", &nr_ops, NULL, lookup_range_run, NULL },
+	{ "copy 2MB", &nr_copy_ops, copy_setup, copy_run, NULL },
+	{ "copy 2MB pf", &nr_copy_ops, NULL, copy_prefetch_run,
+		copy_teardown },
+	{ "range lock", &nr_ops, NULL, range_lock_run, NULL },
+	{ "window excl", &nr_ops, window_setup, window_excl_run,
+		window_teardown },
+	{ "window shared", &nr_ops, window_setup, window_shared_run,
+		window_teardown },
+	{ "range crowded", &nr_ops, range_crowded_setup, range_crowded_run,
+		range_crowded_teardown },
+	{ "extent insert", &nr_ops, extent_setup, extent_insert_run, NULL },
+	{ "extent remove", &nr_ops, NULL, extent_remove_run, alloc_teardown },
+	{ "commit", &nr_ops, NULL, commit_run, NULL },
+};
+
+static void *bench_thread_fn(void *arg)
+{
+	struct bench_thread *t = arg;
+	u64 start;
+
+	kshim_set_cpu(t->id);
+	pthread_barrier_wait(&barrier);
+	start = bench_now();
+	t->bench->run(t);
+	t->ns = bench_now() - start;
+	return NULL;
+}
+
+/* Run one benchmark on nr_threads threads; returns the wall time in ns */
+static u64 bench_one(const struct bench *bench, int nr_threads)
+{
+	u64 wall = 0;
+	int i;
+
+	pthread_barrier_init(&barrier, NULL, nr_threads);
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].bench = bench;
+		if (bench->setup)
+			bench->setup(&threads[i]);
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&threads[i].thread, NULL, bench_thread_fn,
+				&threads[i]);
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		wall = max(wall, threads[i].ns);
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		if (bench->teardown)
+			bench->teardown(&threads[i]);
+	pthread_barrier_destroy(&barrier);
+	return wall;
+}
+
+static int bench_init(unsigned long cache_size, int max_threads)
+{
+	int i, ret;
+
+	bs2_dev = kzalloc(sizeof(struct bankshot2_device), GFP_KERNEL);
+	if (!bs2_dev)
+		return -ENOMEM;
+
+	bs2_dev->inode_hash_array =
+		kzalloc(sizeof(struct hash_inode) * HASH_ARRAY_SIZE,
+			GFP_KERNEL);
+	if (!bs2_dev->inode_hash_array)
+		return -ENOMEM;
+	for (i = 0; i < HASH_ARRAY_SIZE; i++)
+		bs2_dev->inode_hash_array[i].size = 1;
+
+	ret = bankshot2_init_kmem(bs2_dev);
+	if (ret)
+		return ret;
+
+	ret = bankshot2_init_super(bs2_dev, 0, cache_size);
+	if (ret)
+		return ret;
+
+	ret = bankshot2_init_extents(bs2_dev);
+	if (ret)
+		return ret;
+
+	ret = bankshot2_init_transactions(bs2_dev);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < max_threads; i++) {
+		threads[i].id = i;
+		threads[i].pi = bench_new_inode(&threads[i].inode, i + 1);
+		if (!threads[i].pi)
+			return -ENOMEM;
+	}
+
+	lookup_pi = bench_new_inode(&threads[max_threads].inode,
+					max_threads + 1);
+	if (!lookup_pi)
+		return -ENOMEM;
+
+	/* Leave half of the cache for the alloc runs */
+	nr_lookup_blocks = min(nr_lookup_blocks,
+			bankshot2_count_free_blocks(bs2_dev) / 2);
+	ret = bench_fill_inode(lookup_pi, nr_lookup_blocks);
+	if (ret)
+		return ret;
+
+	/* Every lookup page must be in the index for the hash run */
+	if (bs2_dev->hash_table && !bs2_dev->hash_dropped)
+		nr_hash_ops = nr_ops;
+	else if (bs2_dev->hash_table)
+		printf("Hash index dropped %lu blocks, skipping its run\n",
+			bs2_dev->hash_dropped);
+
+	nr_alloc_ops = min(nr_ops, bankshot2_count_free_blocks(bs2_dev) / 2 /
+				max_threads);
+	/* Whole data blocks of any type */
+	nr_fill_ops = round_down(nr_alloc_ops,
+			bankshot2_get_numblocks(BANKSHOT2_BLOCK_TYPE_2M));
+	/* As many pages copied as other runs do ops, in 2MB windows */
+	nr_copy_pages = round_down(nr_alloc_ops, BENCH_RANGE_PAGES);
+	nr_copy_ops = nr_copy_pages ? nr_ops / BENCH_RANGE_PAGES : 0;
+	return 0;
+}
+
+static void bench_print_alloc_stats(void)
+{
+	struct bankshot2_alloc_stats stats;
+	int i;
+
+	bankshot2_get_alloc_stats(bs2_dev, &stats);
+	printf("\nfree runs %llu, largest %llu blocks, s_lock contended "
+		"%llu of %llu\n", (unsigned long long)stats.free_runs,
+		(unsigned long long)stats.largest_free_run,
+		(unsigned long long)(stats.lat_count[BANKSHOT2_LAT_LOCK_WAIT] -
+			stats.lat_hist[BANKSHOT2_LAT_LOCK_WAIT][0]),
+		(unsigned long long)stats.lat_count[BANKSHOT2_LAT_LOCK_WAIT]);
+	for (i = 0; i < BANKSHOT2_LAT_NUM; i++)
+		if (stats.lat_count[i])
+			printf("%-16s count %llu, average %llu ns, "
+				"max %llu ns\n",
+				i == BANKSHOT2_LAT_ALLOC ? "alloc latency" :
+				i == BANKSHOT2_LAT_FREE ? "free latency" :
+				"s_lock wait",
+				(unsigned long long)stats.lat_count[i],
+				(unsigned long long)(stats.lat_total_ns[i] /
+					stats.lat_count[i]),
+				(unsigned long long)stats.lat_max_ns[i]);
+	if (measure_timing && bs2_dev->countstats[wait_access_t])
+		printf("range lock waits %llu, average %llu ns\n",
+			(unsigned long long)bs2_dev->countstats[wait_access_t],
+			(unsigned long long)(bs2_dev->timingstats[wait_access_t] /
+				bs2_dev->countstats[wait_access_t]));
+}
+
+static void bench_exit(void)
+{
+	bankshot2_destroy_extents(bs2_dev);
+	bankshot2_destroy_transactions(bs2_dev);
+	bankshot2_destroy_super(bs2_dev);
+	bankshot2_destroy_kmem(bs2_dev);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-s cache MB] [-t max threads] "
+		"[-n ops per thread] [-b data block type] [-B data block bytes] "
+		"[-S alloc stripes] [-f PM file] [-L lookup pages] "
+		"[-H hash index slots] [-e] [-m] [-v]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long cache_size = 1024UL << 20;
+	const char *pm_path = NULL;
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int nr_threads, opt, ret;
+	unsigned int i;
+	u64 wall;
+
+	while ((opt = getopt(argc, argv, "s:t:n:b:B:S:f:L:H:emv")) != -1) {
+		switch (opt) {
+		case 's':
+			cache_size = strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'n':
+			nr_ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			data_block_type = atoi(optarg);
+			break;
+		case 'B':
+			data_block_size = strtoul(optarg, NULL, 0);
+			data_block_type =
+				bankshot2_data_blk_size_to_type(data_block_size);
+			break;
+		case 'S':
+			alloc_stripes = atoi(optarg);
+			break;
+		case 'f':
+			pm_path = optarg;
+			break;
+		case 'L':
+			nr_lookup_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'H':
+			hash_entries = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			extent_mapping = 1;
+			break;
+		case 'm':
+			measure_timing = 1;
+			break;
+		case 'v':
+			kshim_verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/* One slot is kept for the shared lookup inode */
+	max_threads = min(max(max_threads, 1), BENCH_MAX_THREADS - 1);
+	if (!nr_ops || !nr_lookup_blocks || cache_size < BANKSHOT2_RESERVE_SPACE ||
+			!bankshot2_data_blk_type_ok(data_block_type) ||
+			alloc_stripes < 1 ||
+			alloc_stripes > BANKSHOT2_MAX_DOMAINS)
+		usage(argv[0]);
+
+	kshim_init(pm_path);
+	ret = bench_init(cache_size, max_threads);
+	if (ret) {
+		fprintf(stderr, "Bankshot2 init failed: %d\n", ret);
+		return 1;
+	}
+
+	printf("%-16s %8s %12s %12s\n", "benchmark", "threads", "ns/op",
+		"Mops/s");
+	/* Paired runs (alloc/free, insert/remove) share per-thread state */
+	for (nr_threads = 1; nr_threads <= max_threads; nr_threads *= 2) {
+		for (i = 0; i < ARRAY_SIZE(benches); i++) {
+			if (!*benches[i].nr_ops)
+				continue;
+			wall = bench_one(&benches[i], nr_threads);
+			printf("%-16s %8d %12.1f %12.2f\n", benches[i].name,
+				nr_threads, (double)wall / *benches[i].nr_ops,
+				(double)*benches[i].nr_ops * nr_threads * 1000 /
+				wall);
+		}
+	}
+
+	bench_print_alloc_stats();
+	bench_exit();
+	return 0;
+}
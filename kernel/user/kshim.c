@@ -0,0 +1,900 @@
+/*
+ * Bankshot2 userspace shim: implementation of the kernel API subset
+ * declared in kshim.h.
+ */
+
+#include "kshim.h"
+#include <stdarg.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+int kshim_verbose;
+int nr_cpu_ids = 1;
+struct user_namespace init_user_ns;
+pgd_t kshim_empty_pgd;
+
+static const char *kshim_pm_path;
+static unsigned long kshim_pm_size;
+static __thread struct task_struct *kshim_task;
+static __thread int kshim_cpu = -1;
+
+void kshim_init(const char *pm_path)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+	nr_cpu_ids = cpus > 0 ? cpus : 1;
+	kshim_pm_path = pm_path;
+}
+
+/* ============================ rbtree ================================= */
+#define RB_RED		0
+#define RB_BLACK	1
+
+#define rb_color(r)	((r)->__rb_parent_color & 1)
+#define rb_is_red(r)	(!rb_color(r))
+#define rb_is_black(r)	rb_color(r)
+#define rb_set_red(r)	do { (r)->__rb_parent_color &= ~1UL; } while (0)
+#define rb_set_black(r)	do { (r)->__rb_parent_color |= 1UL; } while (0)
+
+static inline void rb_set_parent(struct rb_node *rb, struct rb_node *p)
+{
+	rb->__rb_parent_color = rb_color(rb) | (unsigned long)p;
+}
+
+static inline void rb_set_color(struct rb_node *rb, int color)
+{
+	rb->__rb_parent_color = (rb->__rb_parent_color & ~1UL) | color;
+}
+
+static void __rb_rotate_left(struct rb_node *node, struct rb_root *root,
+		const struct rb_augment_callbacks *augment)
+{
+	struct rb_node *right = node->rb_right;
+	struct rb_node *parent = rb_parent(node);
+
+	node->rb_right = right->rb_left;
+	if (right->rb_left)
+		rb_set_parent(right->rb_left, node);
+	right->rb_left = node;
+
+	rb_set_parent(right, parent);
+	if (parent) {
+		if (node == parent->rb_left)
+			parent->rb_left = right;
+		else
+			parent->rb_right = right;
+	} else {
+		root->rb_node = right;
+	}
+	rb_set_parent(node, right);
+	if (augment)
+		augment->rotate(node, right);
+}
+
+static void __rb_rotate_right(struct rb_node *node, struct rb_root *root,
+		const struct rb_augment_callbacks *augment)
+{
+	struct rb_node *left = node->rb_left;
+	struct rb_node *parent = rb_parent(node);
+
+	node->rb_left = left->rb_right;
+	if (left->rb_right)
+		rb_set_parent(left->rb_right, node);
+	left->rb_right = node;
+
+	rb_set_parent(left, parent);
+	if (parent) {
+		if (node == parent->rb_right)
+			parent->rb_right = left;
+		else
+			parent->rb_left = left;
+	} else {
+		root->rb_node = left;
+	}
+	rb_set_parent(node, left);
+	if (augment)
+		augment->rotate(node, left);
+}
+
+static void __rb_insert(struct rb_node *node, struct rb_root *root,
+		const struct rb_augment_callbacks *augment)
+{
+	struct rb_node *parent, *gparent, *uncle, *tmp;
+
+	while ((parent = rb_parent(node)) && rb_is_red(parent)) {
+		gparent = rb_parent(parent);
+
+		if (parent == gparent->rb_left) {
+			uncle = gparent->rb_right;
+			if (uncle && rb_is_red(uncle)) {
+				rb_set_black(uncle);
+				rb_set_black(parent);
+				rb_set_red(gparent);
+				node = gparent;
+				continue;
+			}
+
+			if (parent->rb_right == node) {
+				__rb_rotate_left(parent, root, augment);
+				tmp = parent;
+				parent = node;
+				node = tmp;
+			}
+
+			rb_set_black(parent);
+			rb_set_red(gparent);
+			__rb_rotate_right(gparent, root, augment);
+		} else {
+			uncle = gparent->rb_left;
+			if (uncle && rb_is_red(uncle)) {
+				rb_set_black(uncle);
+				rb_set_black(parent);
+				rb_set_red(gparent);
+				node = gparent;
+				continue;
+			}
+
+			if (parent->rb_left == node) {
+				__rb_rotate_right(parent, root, augment);
+				tmp = parent;
+				parent = node;
+				node = tmp;
+			}
+
+			rb_set_black(parent);
+			rb_set_red(gparent);
+			__rb_rotate_left(gparent, root, augment);
+		}
+	}
+
+	rb_set_black(root->rb_node);
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root)
+{
+	__rb_insert(node, root, NULL);
+}
+
+void rb_insert_augmented(struct rb_node *node, struct rb_root *root,
+		const struct rb_augment_callbacks *augment)
+{
+	__rb_insert(node, root, augment);
+}
+
+static void __rb_erase_color(struct rb_node *node, struct rb_node *parent,
+		struct rb_root *root,
+		const struct rb_augment_callbacks *augment)
+{
+	struct rb_node *other;
+
+	while ((!node || rb_is_black(node)) && node != root->rb_node) {
+		if (parent->rb_left == node) {
+			other = parent->rb_right;
+			if (rb_is_red(other)) {
+				rb_set_black(other);
+				rb_set_red(parent);
+				__rb_rotate_left(parent, root, augment);
+				other = parent->rb_right;
+			}
+			if ((!other->rb_left || rb_is_black(other->rb_left)) &&
+			    (!other->rb_right ||
+			     rb_is_black(other->rb_right))) {
+				rb_set_red(other);
+				node = parent;
+				parent = rb_parent(node);
+			} else {
+				if (!other->rb_right ||
+						rb_is_black(other->rb_right)) {
+					rb_set_black(other->rb_left);
+					rb_set_red(other);
+					__rb_rotate_right(other, root, augment);
+					other = parent->rb_right;
+				}
+				rb_set_color(other, rb_color(parent));
+				rb_set_black(parent);
+				rb_set_black(other->rb_right);
+				__rb_rotate_left(parent, root, augment);
+				node = root->rb_node;
+				break;
+			}
+		} else {
+			other = parent->rb_left;
+			if (rb_is_red(other)) {
+				rb_set_black(other);
+				rb_set_red(parent);
+				__rb_rotate_right(parent, root, augment);
+				other = parent->rb_left;
+			}
+			if ((!other->rb_left || rb_is_black(other->rb_left)) &&
+			    (!other->rb_right ||
+			     rb_is_black(other->rb_right))) {
+				rb_set_red(other);
+				node = parent;
+				parent = rb_parent(node);
+			} else {
+				if (!other->rb_left ||
+						rb_is_black(other->rb_left)) {
+					rb_set_black(other->rb_right);
+					rb_set_red(other);
+					__rb_rotate_left(other, root, augment);
+					other = parent->rb_left;
+				}
+				rb_set_color(other, rb_color(parent));
+				rb_set_black(parent);
+				rb_set_black(other->rb_left);
+				__rb_rotate_right(parent, root, augment);
+				node = root->rb_node;
+				break;
+			}
+		}
+	}
+
+	if (node)
+		rb_set_black(node);
+}
+
+/*
+ * As in lib/rbtree.c, the augmented values are brought up to date after
+ * the node is unlinked and before rebalancing, whose rotations keep them.
+ */
+static void __rb_erase(struct rb_node *node, struct rb_root *root,
+		const struct rb_augment_callbacks *augment)
+{
+	struct rb_node *child, *parent, *old, *left;
+	int color;
+
+	if (!node->rb_left) {
+		child = node->rb_right;
+	} else if (!node->rb_right) {
+		child = node->rb_left;
+	} else {
+		/* Two children: splice in the in-order successor */
+		old = node;
+		node = node->rb_right;
+		while ((left = node->rb_left) != NULL)
+			node = left;
+
+		if (rb_parent(old)) {
+			if (rb_parent(old)->rb_left == old)
+				rb_parent(old)->rb_left = node;
+			else
+				rb_parent(old)->rb_right = node;
+		} else {
+			root->rb_node = node;
+		}
+
+		child = node->rb_right;
+		parent = rb_parent(node);
+		color = rb_color(node);
+
+		if (parent == old) {
+			parent = node;
+			if (augment)
+				augment->copy(old, node);
+		} else {
+			if (child)
+				rb_set_parent(child, parent);
+			parent->rb_left = child;
+
+			node->rb_right = old->rb_right;
+			rb_set_parent(old->rb_right, node);
+			if (augment) {
+				augment->copy(old, node);
+				augment->propagate(parent, node);
+			}
+		}
+
+		node->__rb_parent_color = old->__rb_parent_color;
+		node->rb_left = old->rb_left;
+		rb_set_parent(old->rb_left, node);
+		if (augment)
+			augment->propagate(node, NULL);
+
+		goto color;
+	}
+
+	parent = rb_parent(node);
+	color = rb_color(node);
+
+	if (child)
+		rb_set_parent(child, parent);
+	if (parent) {
+		if (parent->rb_left == node)
+			parent->rb_left = child;
+		else
+			parent->rb_right = child;
+	} else {
+		root->rb_node = child;
+	}
+	if (augment && parent)
+		augment->propagate(parent, NULL);
+
+color:
+	if (color == RB_BLACK)
+		__rb_erase_color(child, parent, root, augment);
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root)
+{
+	__rb_erase(node, root, NULL);
+}
+
+void rb_erase_augmented(struct rb_node *node, struct rb_root *root,
+		const struct rb_augment_callbacks *augment)
+{
+	__rb_erase(node, root, augment);
+}
+
+struct rb_node *rb_first(const struct rb_root *root)
+{
+	struct rb_node *n = root->rb_node;
+
+	if (!n)
+		return NULL;
+	while (n->rb_left)
+		n = n->rb_left;
+	return n;
+}
+
+struct rb_node *rb_last(const struct rb_root *root)
+{
+	struct rb_node *n = root->rb_node;
+
+	if (!n)
+		return NULL;
+	while (n->rb_right)
+		n = n->rb_right;
+	return n;
+}
+
+struct rb_node *rb_next(const struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	if (node->rb_right) {
+		node = node->rb_right;
+		while (node->rb_left)
+			node = node->rb_left;
+		return (struct rb_node *)node;
+	}
+
+	while ((parent = rb_parent(node)) && node == parent->rb_right)
+		node = parent;
+
+	return parent;
+}
+
+struct rb_node *rb_prev(const struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	if (node->rb_left) {
+		node = node->rb_left;
+		while (node->rb_right)
+			node = node->rb_right;
+		return (struct rb_node *)node;
+	}
+
+	while ((parent = rb_parent(node)) && node == parent->rb_left)
+		node = parent;
+
+	return parent;
+}
+
+/* ============================= locks ================================= */
+void mutex_init(struct mutex *lock)
+{
+	pthread_mutex_init(&lock->m, NULL);
+}
+
+void mutex_lock(struct mutex *lock)
+{
+	pthread_mutex_lock(&lock->m);
+}
+
+void mutex_unlock(struct mutex *lock)
+{
+	pthread_mutex_unlock(&lock->m);
+}
+
+int mutex_trylock(struct mutex *lock)
+{
+	return pthread_mutex_trylock(&lock->m) == 0;
+}
+
+void spin_lock_init(spinlock_t *lock)
+{
+	pthread_spin_init(&lock->s, PTHREAD_PROCESS_PRIVATE);
+}
+
+void spin_lock(spinlock_t *lock)
+{
+	pthread_spin_lock(&lock->s);
+}
+
+void spin_unlock(spinlock_t *lock)
+{
+	pthread_spin_unlock(&lock->s);
+}
+
+int spin_trylock(spinlock_t *lock)
+{
+	return pthread_spin_trylock(&lock->s) == 0;
+}
+
+void init_rwsem(struct rw_semaphore *sem)
+{
+	pthread_rwlock_init(&sem->l, NULL);
+}
+
+void down_read(struct rw_semaphore *sem)
+{
+	pthread_rwlock_rdlock(&sem->l);
+}
+
+void up_read(struct rw_semaphore *sem)
+{
+	pthread_rwlock_unlock(&sem->l);
+}
+
+void down_write(struct rw_semaphore *sem)
+{
+	pthread_rwlock_wrlock(&sem->l);
+}
+
+void up_write(struct rw_semaphore *sem)
+{
+	pthread_rwlock_unlock(&sem->l);
+}
+
+/* pthreads cannot downgrade atomically; a writer may slip in between */
+void downgrade_write(struct rw_semaphore *sem)
+{
+	pthread_rwlock_unlock(&sem->l);
+	pthread_rwlock_rdlock(&sem->l);
+}
+
+/* ============================== rcu ================================== */
+static pthread_rwlock_t kshim_rcu_lock;
+static pthread_once_t kshim_rcu_once = PTHREAD_ONCE_INIT;
+static __thread int kshim_rcu_nesting;
+
+static void kshim_rcu_init(void)
+{
+	pthread_rwlockattr_t attr;
+
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&kshim_rcu_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+}
+
+void rcu_read_lock(void)
+{
+	pthread_once(&kshim_rcu_once, kshim_rcu_init);
+	if (kshim_rcu_nesting++ == 0)
+		pthread_rwlock_rdlock(&kshim_rcu_lock);
+}
+
+void rcu_read_unlock(void)
+{
+	if (--kshim_rcu_nesting == 0)
+		pthread_rwlock_unlock(&kshim_rcu_lock);
+}
+
+void synchronize_rcu(void)
+{
+	if (kshim_rcu_nesting)
+		abort();
+	pthread_once(&kshim_rcu_once, kshim_rcu_init);
+	pthread_rwlock_wrlock(&kshim_rcu_lock);
+	pthread_rwlock_unlock(&kshim_rcu_lock);
+}
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+	synchronize_rcu();
+	func(head);
+}
+
+/* ========================== tasks and waits ========================== */
+static struct task_struct *kshim_alloc_task(void)
+{
+	struct task_struct *task = calloc(1, sizeof(*task));
+
+	if (!task)
+		abort();
+	pthread_mutex_init(&task->lock, NULL);
+	pthread_cond_init(&task->cond, NULL);
+	return task;
+}
+
+static pthread_key_t kshim_task_key;
+static pthread_once_t kshim_task_once = PTHREAD_ONCE_INIT;
+
+static void kshim_free_task(void *task)
+{
+	free(task);
+}
+
+static void kshim_task_key_init(void)
+{
+	pthread_key_create(&kshim_task_key, kshim_free_task);
+}
+
+/* Threads not started through kthread_run get a task on first use */
+struct task_struct *kshim_current(void)
+{
+	if (!kshim_task) {
+		kshim_task = kshim_alloc_task();
+		kshim_task->thread = pthread_self();
+		pthread_once(&kshim_task_once, kshim_task_key_init);
+		pthread_setspecific(kshim_task_key, kshim_task);
+	}
+	return kshim_task;
+}
+
+void init_waitqueue_head(wait_queue_head_t *q)
+{
+	pthread_spin_init(&q->lock, PTHREAD_PROCESS_PRIVATE);
+	INIT_LIST_HEAD(&q->task_list);
+}
+
+void prepare_to_wait(wait_queue_head_t *q, wait_queue_t *wait, int state)
+{
+	pthread_mutex_lock(&wait->task->lock);
+	wait->task->woken = 0;
+	pthread_mutex_unlock(&wait->task->lock);
+
+	pthread_spin_lock(&q->lock);
+	if (list_empty(&wait->task_list))
+		list_add_tail(&wait->task_list, &q->task_list);
+	pthread_spin_unlock(&q->lock);
+}
+
+void finish_wait(wait_queue_head_t *q, wait_queue_t *wait)
+{
+	pthread_spin_lock(&q->lock);
+	if (!list_empty(&wait->task_list))
+		list_del_init(&wait->task_list);
+	pthread_spin_unlock(&q->lock);
+}
+
+int waitqueue_active(wait_queue_head_t *q)
+{
+	return !list_empty(&q->task_list);
+}
+
+static void kshim_wake_task(struct task_struct *task)
+{
+	pthread_mutex_lock(&task->lock);
+	task->woken = 1;
+	pthread_cond_signal(&task->cond);
+	pthread_mutex_unlock(&task->lock);
+}
+
+void wake_up(wait_queue_head_t *q)
+{
+	wait_queue_t *wait;
+
+	pthread_spin_lock(&q->lock);
+	list_for_each_entry(wait, &q->task_list, task_list)
+		kshim_wake_task(wait->task);
+	pthread_spin_unlock(&q->lock);
+}
+
+/* Sleep until woken since the last prepare_to_wait, or asked to stop */
+void schedule(void)
+{
+	struct task_struct *task = current;
+
+	pthread_mutex_lock(&task->lock);
+	while (!task->woken && !task->should_stop)
+		pthread_cond_wait(&task->cond, &task->lock);
+	task->woken = 0;
+	pthread_mutex_unlock(&task->lock);
+}
+
+void set_current_state(int state)
+{
+	struct task_struct *task = current;
+
+	pthread_mutex_lock(&task->lock);
+	task->woken = 0;
+	pthread_mutex_unlock(&task->lock);
+}
+
+int wake_up_process(struct task_struct *p)
+{
+	kshim_wake_task(p);
+	return 1;
+}
+
+void set_user_nice(struct task_struct *p, long nice)
+{
+}
+
+static void *kshim_kthread(void *arg)
+{
+	struct task_struct *task = arg;
+
+	kshim_task = task;
+	task->ret = task->threadfn(task->data);
+	return NULL;
+}
+
+struct task_struct *kthread_create(int (*threadfn)(void *data),
+		void *data, const char *namefmt, ...)
+{
+	struct task_struct *task = kshim_alloc_task();
+
+	task->threadfn = threadfn;
+	task->data = data;
+	if (pthread_create(&task->thread, NULL, kshim_kthread, task)) {
+		free(task);
+		return ERR_PTR(-ENOMEM);
+	}
+	return task;
+}
+
+int kthread_should_stop(void)
+{
+	return __atomic_load_n(&current->should_stop, __ATOMIC_SEQ_CST);
+}
+
+int kthread_stop(struct task_struct *k)
+{
+	int ret;
+
+	pthread_mutex_lock(&k->lock);
+	k->should_stop = 1;
+	pthread_cond_signal(&k->cond);
+	pthread_mutex_unlock(&k->lock);
+
+	pthread_join(k->thread, NULL);
+	ret = k->ret;
+	free(k);
+	return ret;
+}
+
+void getrawmonotonic(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC_RAW, ts);
+}
+
+unsigned long get_seconds(void)
+{
+	return time(NULL);
+}
+
+/* ========================= cpus and percpu =========================== */
+void kshim_set_cpu(int cpu)
+{
+	kshim_cpu = cpu % nr_cpu_ids;
+}
+
+/* The CPU pinned by kshim_set_cpu, or wherever the thread runs now */
+int raw_smp_processor_id(void)
+{
+	int cpu;
+
+	if (kshim_cpu >= 0)
+		return kshim_cpu;
+
+	cpu = sched_getcpu();
+	return cpu >= 0 ? cpu % nr_cpu_ids : 0;
+}
+
+int cpu_to_node(int cpu)
+{
+	return 0;
+}
+
+void *__alloc_percpu(size_t size, size_t align)
+{
+	return calloc(nr_cpu_ids, __KSHIM_PCPU_STRIDE(size));
+}
+
+void free_percpu(void *ptr)
+{
+	free(ptr);
+}
+
+/* Counters a cache line apart */
+#define KSHIM_COUNTER_STRIDE	(64 / sizeof(s64))
+
+int percpu_counter_init(struct percpu_counter *fbc, s64 amount)
+{
+	fbc->count = amount;
+	fbc->counters = calloc(nr_cpu_ids * KSHIM_COUNTER_STRIDE,
+				sizeof(s64));
+	return fbc->counters ? 0 : -ENOMEM;
+}
+
+void percpu_counter_destroy(struct percpu_counter *fbc)
+{
+	free(fbc->counters);
+	fbc->counters = NULL;
+}
+
+/* Not atomic against concurrent adds, as in the kernel */
+void percpu_counter_set(struct percpu_counter *fbc, s64 amount)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		__atomic_store_n(&fbc->counters[cpu * KSHIM_COUNTER_STRIDE], 0,
+				__ATOMIC_RELAXED);
+	__atomic_store_n(&fbc->count, amount, __ATOMIC_SEQ_CST);
+}
+
+void percpu_counter_add(struct percpu_counter *fbc, s64 amount)
+{
+	/* Threads may share a CPU slot, so this still has to be atomic */
+	__atomic_add_fetch(&fbc->counters[raw_smp_processor_id() *
+			KSHIM_COUNTER_STRIDE], amount, __ATOMIC_RELAXED);
+}
+
+s64 percpu_counter_read_positive(struct percpu_counter *fbc)
+{
+	s64 count = __atomic_load_n(&fbc->count, __ATOMIC_RELAXED);
+	int cpu;
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		count += __atomic_load_n(&fbc->counters[cpu *
+				KSHIM_COUNTER_STRIDE], __ATOMIC_RELAXED);
+	return count > 0 ? count : 0;
+}
+
+s64 percpu_counter_sum_positive(struct percpu_counter *fbc)
+{
+	return percpu_counter_read_positive(fbc);
+}
+
+void sort(void *base, size_t num, size_t size,
+	int (*cmp)(const void *, const void *),
+	void (*swap)(void *, void *, int))
+{
+	qsort(base, num, size, cmp);
+}
+
+/* =============================== slab ================================ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+		size_t align, unsigned long flags, void (*ctor)(void *))
+{
+	struct kmem_cache *cachep = malloc(sizeof(*cachep));
+
+	if (cachep) {
+		cachep->name = name;
+		cachep->size = size;
+	}
+	return cachep;
+}
+
+void kmem_cache_destroy(struct kmem_cache *cachep)
+{
+	free(cachep);
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cachep, gfp_t flags)
+{
+	return malloc(cachep->size);
+}
+
+void kmem_cache_free(struct kmem_cache *cachep, void *objp)
+{
+	free(objp);
+}
+
+void *kmalloc(size_t size, gfp_t flags)
+{
+	return malloc(size);
+}
+
+void *kzalloc(size_t size, gfp_t flags)
+{
+	return calloc(1, size);
+}
+
+void kfree(const void *objp)
+{
+	free((void *)objp);
+}
+
+unsigned long copy_from_user(void *to, const void *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+unsigned long copy_to_user(void *to, const void *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+unsigned long clear_user(void *to, unsigned long n)
+{
+	memset(to, 0, n);
+	return 0;
+}
+
+/* ================================ fs ================================= */
+struct file *fget(unsigned int fd)
+{
+	return NULL;
+}
+
+void fput(struct file *file)
+{
+}
+
+kuid_t current_fsuid(void)
+{
+	kuid_t uid = { getuid() };
+
+	return uid;
+}
+
+kgid_t current_fsgid(void)
+{
+	kgid_t gid = { getgid() };
+
+	return gid;
+}
+
+/* ================================ mm ================================= */
+int vm_munmap_page(struct mm_struct *mm, unsigned long start, size_t len)
+{
+	return 0;
+}
+
+void *request_mem_region_exclusive(unsigned long start, unsigned long n,
+		const char *name)
+{
+	return (void *)1;
+}
+
+void release_mem_region(unsigned long start, unsigned long n)
+{
+}
+
+/*
+ * The PM region: a shared mapping of kshim_pm_path (e.g. a file on a DAX
+ * or tmpfs mount) if one was given, anonymous memory otherwise.
+ */
+void *ioremap_cache(unsigned long phys_addr, unsigned long size)
+{
+	void *addr;
+	int fd;
+
+	if (!kshim_pm_path) {
+		addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	} else {
+		fd = open(kshim_pm_path, O_RDWR | O_CREAT, 0600);
+		if (fd < 0)
+			return NULL;
+		if (ftruncate(fd, size)) {
+			close(fd);
+			return NULL;
+		}
+		addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+				fd, 0);
+		close(fd);
+	}
+
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	kshim_pm_size = size;
+	return addr;
+}
+
+void iounmap(void *addr)
+{
+	munmap(addr, kshim_pm_size);
+}
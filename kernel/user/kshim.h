@@ -0,0 +1,824 @@
+/*
+ * Bankshot2 userspace shim.
+ * Just enough of the kernel API to build the cache core (allocator,
+ * B-tree, extent trees, inode table and journal) as a normal program.
+ * Locks map to pthreads, slabs to malloc, kthreads to pthreads and the
+ * "PM" region to an mmap of anonymous memory or a file.
+ */
+
+#ifndef __BANKSHOT2_KSHIM_H
+#define __BANKSHOT2_KSHIM_H
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef long long s64;
+typedef uint16_t __le16;
+typedef uint32_t __le32;
+typedef unsigned long long __le64;
+typedef unsigned long pgoff_t;
+typedef unsigned int gfp_t;
+typedef unsigned int fmode_t;
+typedef unsigned short umode_t;
+typedef struct { unsigned int val; } kuid_t;
+typedef struct { unsigned int val; } kgid_t;
+
+#define __force
+#define __user
+#define __init
+#define __exit
+#define __percpu
+#define ____cacheline_aligned_in_smp	__attribute__((aligned(64)))
+
+#define le16_to_cpu(x)	((u16)(x))
+#define le32_to_cpu(x)	((u32)(x))
+#define le64_to_cpu(x)	((u64)(x))
+#define cpu_to_le16(x)	((u16)(x))
+#define cpu_to_le32(x)	((u32)(x))
+#define cpu_to_le64(x)	((u64)(x))
+#define le64_to_cpup(p)	(*(const u64 *)(p))
+static inline void le64_add_cpu(__le64 *var, u64 val)
+{
+	*var += val;
+}
+
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+#define barrier()	__asm__ __volatile__("" ::: "memory")
+#define prefetch(x)	__builtin_prefetch(x)
+#define prefetchw(x)	__builtin_prefetch(x, 1)
+#define smp_mb()	__sync_synchronize()
+/* x86 keeps loads and stores in order, as the kernel assumes */
+#define smp_wmb()	barrier()
+#define smp_rmb()	barrier()
+#define smp_read_barrier_depends()	do { } while (0)
+#define ACCESS_ONCE(x)	(*(volatile typeof(x) *)&(x))
+#define BUG()		abort()
+#define BUG_ON(c)	do { if (c) abort(); } while (0)
+#define WARN_ON(c)	({ int __w = !!(c); if (__w) \
+			fprintf(stderr, "WARN %s:%d\n", __FILE__, __LINE__); \
+			__w; })
+
+/* pr_info is quiet unless the driver asks for it */
+extern int kshim_verbose;
+#define pr_debug(fmt, ...)	do { } while (0)
+#define pr_info(fmt, ...)	do { if (kshim_verbose) \
+					printf(fmt, ##__VA_ARGS__); } while (0)
+#define printk(fmt, ...)	pr_info(fmt, ##__VA_ARGS__)
+#define dump_stack()		do { } while (0)
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define min(a, b)	((a) < (b) ? (a) : (b))
+#define max(a, b)	((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)	((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b)	((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define ALIGN(x, a)	(((x) + (a) - 1) & ~((typeof(x))(a) - 1))
+#define round_up(x, y)	((((x) - 1) | ((typeof(x))((y) - 1))) + 1)
+#define round_down(x, y)	((x) & ~((typeof(x))((y) - 1)))
+
+static inline int fls64(u64 x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+#define ilog2(n)	(63 - __builtin_clzll(n))
+#define roundup_pow_of_two(n)	(1UL << fls64((n) - 1))
+
+#define MAX_ERRNO	4095
+#define IS_ERR_VALUE(x)	unlikely((unsigned long)(x) >= (unsigned long)-MAX_ERRNO)
+static inline void *ERR_PTR(long error) { return (void *)error; }
+static inline long PTR_ERR(const void *ptr) { return (long)ptr; }
+static inline bool IS_ERR(const void *ptr)
+{
+	return IS_ERR_VALUE((unsigned long)ptr);
+}
+
+#define PAGE_SHIFT	12
+#define PAGE_SIZE	(1UL << PAGE_SHIFT)
+#define PAGE_MASK	(~(PAGE_SIZE - 1))
+#define PAGE_ALIGN(x)	(((x) + PAGE_SIZE - 1) & PAGE_MASK)
+
+#define GFP_KERNEL	0
+#define GFP_NOFS	0
+#define GFP_ATOMIC	0
+#define GFP_NOWAIT	0
+#define __GFP_NOWARN	0
+#define SLAB_RECLAIM_ACCOUNT	0
+#define SLAB_MEM_SPREAD		0
+
+/* ---------------------------- lists ---------------------------------- */
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new, struct list_head *prev,
+		struct list_head *next)
+{
+	next->prev = new;
+	new->next = next;
+	new->prev = prev;
+	prev->next = new;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *new,
+		struct list_head *head)
+{
+	__list_add(new, head->prev, head);
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	entry->next = entry->prev = NULL;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	INIT_LIST_HEAD(entry);
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+static inline void list_splice_init(struct list_head *list,
+		struct list_head *head)
+{
+	if (list_empty(list))
+		return;
+	list->next->prev = head;
+	list->prev->next = head->next;
+	head->next->prev = list->prev;
+	head->next = list->next;
+	INIT_LIST_HEAD(list);
+}
+
+static inline void list_move_tail(struct list_head *list,
+		struct list_head *head)
+{
+	list_del(list);
+	list_add_tail(list, head);
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) \
+	list_entry((ptr)->next, type, member)
+#define list_for_each_entry(pos, head, member)				\
+	for (pos = list_entry((head)->next, typeof(*pos), member);	\
+	     &pos->member != (head);					\
+	     pos = list_entry(pos->member.next, typeof(*pos), member))
+#define list_for_each_entry_safe(pos, n, head, member)			\
+	for (pos = list_entry((head)->next, typeof(*pos), member),	\
+	     n = list_entry(pos->member.next, typeof(*pos), member);	\
+	     &pos->member != (head);					\
+	     pos = n, n = list_entry(n->member.next, typeof(*n), member))
+
+/* ---------------------------- rbtree --------------------------------- */
+struct rb_node {
+	unsigned long __rb_parent_color;
+	struct rb_node *rb_right;
+	struct rb_node *rb_left;
+} __attribute__((aligned(sizeof(long))));
+
+struct rb_root {
+	struct rb_node *rb_node;
+};
+
+#define RB_ROOT		(struct rb_root) { NULL, }
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+#define rb_parent(r)	((struct rb_node *)((r)->__rb_parent_color & ~3))
+#define RB_EMPTY_ROOT(root)	((root)->rb_node == NULL)
+#define RB_EMPTY_NODE(node)	\
+	((node)->__rb_parent_color == (unsigned long)(node))
+#define RB_CLEAR_NODE(node)	\
+	((node)->__rb_parent_color = (unsigned long)(node))
+
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+		struct rb_node **rb_link)
+{
+	node->__rb_parent_color = (unsigned long)parent;
+	node->rb_left = node->rb_right = NULL;
+	*rb_link = node;
+}
+
+void rb_insert_color(struct rb_node *, struct rb_root *);
+void rb_erase(struct rb_node *, struct rb_root *);
+struct rb_node *rb_next(const struct rb_node *);
+struct rb_node *rb_prev(const struct rb_node *);
+struct rb_node *rb_first(const struct rb_root *);
+struct rb_node *rb_last(const struct rb_root *);
+
+/* <linux/rbtree_augmented.h> and <linux/interval_tree_generic.h> */
+struct rb_augment_callbacks {
+	void (*propagate)(struct rb_node *node, struct rb_node *stop);
+	void (*copy)(struct rb_node *old, struct rb_node *new);
+	void (*rotate)(struct rb_node *old, struct rb_node *new);
+};
+
+void rb_insert_augmented(struct rb_node *node, struct rb_root *root,
+		const struct rb_augment_callbacks *augment);
+void rb_erase_augmented(struct rb_node *node, struct rb_root *root,
+		const struct rb_augment_callbacks *augment);
+
+#define RB_DECLARE_CALLBACKS(rbstatic, rbname, rbstruct, rbfield,	\
+			     rbtype, rbaugmented, rbcompute)		\
+static inline void							\
+rbname ## _propagate(struct rb_node *rb, struct rb_node *stop)		\
+{									\
+	while (rb != stop) {						\
+		rbstruct *node = rb_entry(rb, rbstruct, rbfield);	\
+		rbtype augmented = rbcompute(node);			\
+		if (node->rbaugmented == augmented)			\
+			break;						\
+		node->rbaugmented = augmented;				\
+		rb = rb_parent(&node->rbfield);				\
+	}								\
+}									\
+static inline void							\
+rbname ## _copy(struct rb_node *rb_old, struct rb_node *rb_new)		\
+{									\
+	rbstruct *old = rb_entry(rb_old, rbstruct, rbfield);		\
+	rbstruct *new = rb_entry(rb_new, rbstruct, rbfield);		\
+	new->rbaugmented = old->rbaugmented;				\
+}									\
+static void								\
+rbname ## _rotate(struct rb_node *rb_old, struct rb_node *rb_new)	\
+{									\
+	rbstruct *old = rb_entry(rb_old, rbstruct, rbfield);		\
+	rbstruct *new = rb_entry(rb_new, rbstruct, rbfield);		\
+	new->rbaugmented = old->rbaugmented;				\
+	old->rbaugmented = rbcompute(old);				\
+}									\
+rbstatic const struct rb_augment_callbacks rbname = {			\
+	rbname ## _propagate, rbname ## _copy, rbname ## _rotate	\
+};
+
+#define INTERVAL_TREE_DEFINE(ITSTRUCT, ITRB, ITTYPE, ITSUBTREE,		\
+			     ITSTART, ITLAST, ITSTATIC, ITPREFIX)	\
+static inline ITTYPE ITPREFIX ## _compute_subtree_last(ITSTRUCT *node)	\
+{									\
+	ITTYPE max = ITLAST(node), subtree_last;			\
+	if (node->ITRB.rb_left) {					\
+		subtree_last = rb_entry(node->ITRB.rb_left,		\
+					ITSTRUCT, ITRB)->ITSUBTREE;	\
+		if (max < subtree_last)					\
+			max = subtree_last;				\
+	}								\
+	if (node->ITRB.rb_right) {					\
+		subtree_last = rb_entry(node->ITRB.rb_right,		\
+					ITSTRUCT, ITRB)->ITSUBTREE;	\
+		if (max < subtree_last)					\
+			max = subtree_last;				\
+	}								\
+	return max;							\
+}									\
+									\
+RB_DECLARE_CALLBACKS(static, ITPREFIX ## _augment, ITSTRUCT, ITRB,	\
+		     ITTYPE, ITSUBTREE, ITPREFIX ## _compute_subtree_last) \
+									\
+ITSTATIC void ITPREFIX ## _insert(ITSTRUCT *node, struct rb_root *root)	\
+{									\
+	struct rb_node **link = &root->rb_node, *rb_parent = NULL;	\
+	ITTYPE start = ITSTART(node), last = ITLAST(node);		\
+	ITSTRUCT *parent;						\
+									\
+	while (*link) {							\
+		rb_parent = *link;					\
+		parent = rb_entry(rb_parent, ITSTRUCT, ITRB);		\
+		if (parent->ITSUBTREE < last)				\
+			parent->ITSUBTREE = last;			\
+		if (start < ITSTART(parent))				\
+			link = &parent->ITRB.rb_left;			\
+		else							\
+			link = &parent->ITRB.rb_right;			\
+	}								\
+									\
+	node->ITSUBTREE = last;						\
+	rb_link_node(&node->ITRB, rb_parent, link);			\
+	rb_insert_augmented(&node->ITRB, root, &ITPREFIX ## _augment);	\
+}									\
+									\
+ITSTATIC void ITPREFIX ## _remove(ITSTRUCT *node, struct rb_root *root)	\
+{									\
+	rb_erase_augmented(&node->ITRB, root, &ITPREFIX ## _augment);	\
+}									\
+									\
+static ITSTRUCT *							\
+ITPREFIX ## _subtree_search(ITSTRUCT *node, ITTYPE start, ITTYPE last)	\
+{									\
+	while (true) {							\
+		if (node->ITRB.rb_left) {				\
+			ITSTRUCT *left = rb_entry(node->ITRB.rb_left,	\
+						  ITSTRUCT, ITRB);	\
+			if (start <= left->ITSUBTREE) {			\
+				node = left;				\
+				continue;				\
+			}						\
+		}							\
+		if (ITSTART(node) <= last) {				\
+			if (start <= ITLAST(node))			\
+				return node;				\
+			if (node->ITRB.rb_right) {			\
+				node = rb_entry(node->ITRB.rb_right,	\
+						ITSTRUCT, ITRB);	\
+				if (start <= node->ITSUBTREE)		\
+					continue;			\
+			}						\
+		}							\
+		return NULL;						\
+	}								\
+}									\
+									\
+ITSTATIC ITSTRUCT *							\
+ITPREFIX ## _iter_first(struct rb_root *root, ITTYPE start, ITTYPE last) \
+{									\
+	ITSTRUCT *node;							\
+									\
+	if (!root->rb_node)						\
+		return NULL;						\
+	node = rb_entry(root->rb_node, ITSTRUCT, ITRB);			\
+	if (node->ITSUBTREE < start)					\
+		return NULL;						\
+	return ITPREFIX ## _subtree_search(node, start, last);		\
+}									\
+									\
+ITSTATIC ITSTRUCT *							\
+ITPREFIX ## _iter_next(ITSTRUCT *node, ITTYPE start, ITTYPE last)	\
+{									\
+	struct rb_node *rb = node->ITRB.rb_right, *prev;		\
+									\
+	while (true) {							\
+		if (rb) {						\
+			ITSTRUCT *right = rb_entry(rb, ITSTRUCT, ITRB);	\
+			if (start <= right->ITSUBTREE)			\
+				return ITPREFIX ## _subtree_search(right, \
+								start, last); \
+		}							\
+									\
+		do {							\
+			rb = rb_parent(&node->ITRB);			\
+			if (!rb)					\
+				return NULL;				\
+			prev = &node->ITRB;				\
+			node = rb_entry(rb, ITSTRUCT, ITRB);		\
+			rb = node->ITRB.rb_right;			\
+		} while (prev == rb);					\
+									\
+		if (last < ITSTART(node))				\
+			return NULL;					\
+		else if (start <= ITLAST(node))				\
+			return node;					\
+	}								\
+}
+
+/* ---------------------------- atomics -------------------------------- */
+typedef struct { int counter; } atomic_t;
+typedef struct { long counter; } atomic64_t;
+
+#define atomic_read(v)	__atomic_load_n(&(v)->counter, __ATOMIC_SEQ_CST)
+#define atomic_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_inc(v)	((void)__atomic_add_fetch(&(v)->counter, 1, \
+							__ATOMIC_SEQ_CST))
+#define atomic_dec(v)	((void)__atomic_sub_fetch(&(v)->counter, 1, \
+							__ATOMIC_SEQ_CST))
+/* The kernel builds with -fno-strict-aliasing; the shim does not */
+#define atomic64_add(i, v) ((void)__atomic_add_fetch( \
+		(long *)(void *)(v), (i), __ATOMIC_SEQ_CST))
+#define atomic_inc_return(v) \
+	__atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec_and_test(v) \
+	(__atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST) == 0)
+#define cmpxchg(p, o, n)	__sync_val_compare_and_swap(p, o, n)
+#define xchg(p, v)	__atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+
+/* Not atomic against concurrent readers, unlike cmpxchg16b */
+#define cmpxchg_double_local(p1, p2, o1, o2, n1, n2)			\
+({									\
+	bool __ret = *(p1) == (o1) && *(p2) == (o2);			\
+	if (__ret) {							\
+		*(p1) = (n1);						\
+		*(p2) = (n2);						\
+	}								\
+	__ret;								\
+})
+
+static inline void set_64bit(volatile u64 *ptr, u64 val)
+{
+	__atomic_store_n(ptr, val, __ATOMIC_SEQ_CST);
+}
+
+/* ---------------------------- locks ---------------------------------- */
+struct mutex {
+	pthread_mutex_t m;
+};
+
+typedef struct {
+	pthread_spinlock_t s;
+} spinlock_t;
+
+struct rw_semaphore {
+	pthread_rwlock_t l;
+};
+
+typedef struct {
+	unsigned sequence;
+} seqcount_t;
+
+static inline void seqcount_init(seqcount_t *s)
+{
+	s->sequence = 0;
+}
+
+static inline unsigned read_seqcount_begin(const seqcount_t *s)
+{
+	unsigned ret;
+
+	while ((ret = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1)
+		;
+	return ret;
+}
+
+static inline int read_seqcount_retry(const seqcount_t *s, unsigned start)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) != start;
+}
+
+static inline void write_seqcount_begin(seqcount_t *s)
+{
+	__atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_seqcount_end(seqcount_t *s)
+{
+	__atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+}
+
+void mutex_init(struct mutex *lock);
+void mutex_lock(struct mutex *lock);
+void mutex_unlock(struct mutex *lock);
+int mutex_trylock(struct mutex *lock);
+void spin_lock_init(spinlock_t *lock);
+void spin_lock(spinlock_t *lock);
+void spin_unlock(spinlock_t *lock);
+int spin_trylock(spinlock_t *lock);
+#define spin_lock_bh(lock)	spin_lock(lock)
+#define spin_unlock_bh(lock)	spin_unlock(lock)
+void init_rwsem(struct rw_semaphore *sem);
+void down_read(struct rw_semaphore *sem);
+void up_read(struct rw_semaphore *sem);
+void down_write(struct rw_semaphore *sem);
+void up_write(struct rw_semaphore *sem);
+void downgrade_write(struct rw_semaphore *sem);
+
+/* ----------------------------- rcu ----------------------------------- */
+/*
+ * Readers hold a writer-preferring rwlock for the outermost critical
+ * section; a grace period takes it exclusively. Callbacks run inline.
+ */
+struct rcu_head {
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *head);
+};
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void synchronize_rcu(void);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+#define rcu_barrier()		do { } while (0)
+#define rcu_dereference(p)	ACCESS_ONCE(p)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/* ------------------------- tasks and waits --------------------------- */
+#define TASK_RUNNING		0
+#define TASK_INTERRUPTIBLE	1
+#define TASK_UNINTERRUPTIBLE	2
+
+struct mm_struct {
+	spinlock_t page_table_lock;
+};
+
+struct task_struct {
+	void *journal_info;
+	struct mm_struct *mm;
+	pthread_t thread;
+	int (*threadfn)(void *data);
+	void *data;
+	int ret;
+	int should_stop;
+	int woken;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct task_struct *kshim_current(void);
+#define current (kshim_current())
+
+typedef struct wait_queue_head {
+	pthread_spinlock_t lock;	/* Keeps the kernel's 24-byte layout */
+	struct list_head task_list;
+} wait_queue_head_t;
+
+typedef struct {
+	struct task_struct *task;
+	struct list_head task_list;
+} wait_queue_t;
+
+#define DEFINE_WAIT(name)						\
+	wait_queue_t name = {						\
+		.task = current,					\
+		.task_list = LIST_HEAD_INIT((name).task_list),		\
+	}
+
+void init_waitqueue_head(wait_queue_head_t *q);
+void prepare_to_wait(wait_queue_head_t *q, wait_queue_t *wait, int state);
+void finish_wait(wait_queue_head_t *q, wait_queue_t *wait);
+int waitqueue_active(wait_queue_head_t *q);
+void wake_up(wait_queue_head_t *q);
+#define wake_up_interruptible(q)	wake_up(q)
+void schedule(void);
+/* Only the sleep/wake handshake matters: set_current_state() arms
+ * schedule(), wake_up_process() ends it, whichever comes first */
+void set_current_state(int state);
+int wake_up_process(struct task_struct *p);
+void set_user_nice(struct task_struct *p, long nice);
+#define cond_resched()		do { } while (0)
+
+#define wait_event_interruptible(wq, condition)				\
+({									\
+	DEFINE_WAIT(__wait);						\
+	for (;;) {							\
+		prepare_to_wait(&(wq), &__wait, TASK_INTERRUPTIBLE);	\
+		if (condition)						\
+			break;						\
+		schedule();						\
+	}								\
+	finish_wait(&(wq), &__wait);					\
+	0;								\
+})
+
+struct task_struct *kthread_create(int (*threadfn)(void *data),
+		void *data, const char *namefmt, ...);
+#define kthread_run(threadfn, data, namefmt, ...)			\
+	kthread_create(threadfn, data, namefmt, ##__VA_ARGS__)
+int kthread_should_stop(void);
+int kthread_stop(struct task_struct *k);
+
+#define NSEC_PER_SEC	1000000000L
+void getrawmonotonic(struct timespec *ts);
+unsigned long get_seconds(void);
+
+/* ------------------------- cpus and percpu --------------------------- */
+extern int nr_cpu_ids;
+
+int raw_smp_processor_id(void);
+#define smp_processor_id()	raw_smp_processor_id()
+#define for_each_possible_cpu(cpu) \
+	for ((cpu) = 0; (cpu) < nr_cpu_ids; (cpu)++)
+int cpu_to_node(int cpu);
+#define first_online_node	0
+#define NUMA_NO_NODE		(-1)
+#define node_online(nid)	((nid) == 0)
+
+/* Per-CPU copies are laid out one cacheline-rounded stride apart */
+#define __KSHIM_PCPU_STRIDE(size)	(((size) + 63) & ~63UL)
+void *__alloc_percpu(size_t size, size_t align);
+#define alloc_percpu(type) \
+	((type *)__alloc_percpu(sizeof(type), __alignof__(type)))
+void free_percpu(void *ptr);
+#define per_cpu_ptr(ptr, cpu)						\
+	((typeof(ptr))((char *)(ptr) +					\
+		(size_t)(cpu) * __KSHIM_PCPU_STRIDE(sizeof(*(ptr)))))
+#define get_cpu_ptr(ptr)	per_cpu_ptr(ptr, raw_smp_processor_id())
+#define put_cpu_ptr(ptr)	do { (void)(ptr); } while (0)
+
+/* One cache line per CPU, summed on every read */
+struct percpu_counter {
+	s64 count;
+	s64 *counters;
+};
+
+int percpu_counter_init(struct percpu_counter *fbc, s64 amount);
+void percpu_counter_destroy(struct percpu_counter *fbc);
+void percpu_counter_set(struct percpu_counter *fbc, s64 amount);
+void percpu_counter_add(struct percpu_counter *fbc, s64 amount);
+#define percpu_counter_sub(fbc, amount)	percpu_counter_add(fbc, -(s64)(amount))
+#define percpu_counter_inc(fbc)	percpu_counter_add(fbc, 1)
+s64 percpu_counter_read_positive(struct percpu_counter *fbc);
+s64 percpu_counter_sum_positive(struct percpu_counter *fbc);
+
+void sort(void *base, size_t num, size_t size,
+	int (*cmp)(const void *, const void *),
+	void (*swap)(void *, void *, int));
+
+/* ------------------------------ slab --------------------------------- */
+struct kmem_cache {
+	size_t size;
+	const char *name;
+};
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+		size_t align, unsigned long flags, void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *cachep);
+void *kmem_cache_alloc(struct kmem_cache *cachep, gfp_t flags);
+void kmem_cache_free(struct kmem_cache *cachep, void *objp);
+void *kmalloc(size_t size, gfp_t flags);
+void *kzalloc(size_t size, gfp_t flags);
+void kfree(const void *objp);
+
+unsigned long copy_from_user(void *to, const void *from, unsigned long n);
+unsigned long copy_to_user(void *to, const void *from, unsigned long n);
+unsigned long clear_user(void *to, unsigned long n);
+
+/* ------------------------------ fs ----------------------------------- */
+#define FMODE_READ	0x1
+#define FMODE_WRITE	0x2
+#define FMODE_EXCL	0x80
+
+#define S_IFMT		00170000
+#define S_IFREG		0100000
+#define S_IFDIR		0040000
+#define S_IRWXU		00700
+#define S_IRUSR		00400
+#define S_IWUSR		00200
+#define S_IXUSR		00100
+#define S_IRGRP		00040
+#define S_IWGRP		00020
+#define S_IXGRP		00010
+#define S_IROTH		00004
+#define S_IWOTH		00002
+#define S_IXOTH		00001
+#define S_IRUGO		(S_IRUSR | S_IRGRP | S_IROTH)
+#define S_IXUGO		(S_IXUSR | S_IXGRP | S_IXOTH)
+
+#define FS_SYNC_FL	0x00000008
+#define FS_IMMUTABLE_FL	0x00000010
+#define FS_APPEND_FL	0x00000020
+#define FS_NOATIME_FL	0x00000080
+#define FS_DIRSYNC_FL	0x00010000
+#define S_SYNC		1
+#define S_NOATIME	2
+#define S_APPEND	4
+#define S_IMMUTABLE	8
+#define S_DIRSYNC	64
+
+struct fiemap_extent {
+	u64 fe_logical;
+	u64 fe_physical;
+	u64 fe_length;
+	u64 fe_reserved64[2];
+	u32 fe_flags;
+	u32 fe_reserved[3];
+};
+
+struct address_space;
+struct cdev {
+	void *owner;
+};
+
+struct inode {
+	unsigned long i_ino;
+	umode_t i_mode;
+	unsigned int i_nlink;
+	loff_t i_size;
+	unsigned long i_blocks;
+	struct timespec i_atime, i_mtime, i_ctime;
+	unsigned int i_flags;
+	struct address_space *i_mapping;
+	kuid_t i_uid;
+	kgid_t i_gid;
+};
+
+struct address_space {
+	struct inode *host;
+};
+
+struct dentry {
+	struct inode *d_inode;
+};
+
+struct file {
+	fmode_t f_mode;
+	struct dentry *f_dentry;
+	struct address_space *f_mapping;
+};
+
+struct file *fget(unsigned int fd);
+void fput(struct file *file);
+static inline unsigned int i_uid_read(const struct inode *inode)
+{
+	return inode->i_uid.val;
+}
+static inline unsigned int i_gid_read(const struct inode *inode)
+{
+	return inode->i_gid.val;
+}
+
+struct user_namespace {
+	int level;
+};
+extern struct user_namespace init_user_ns;
+kuid_t current_fsuid(void);
+kgid_t current_fsgid(void);
+static inline unsigned int from_kuid(struct user_namespace *ns, kuid_t uid)
+{
+	return uid.val;
+}
+static inline unsigned int from_kgid(struct user_namespace *ns, kgid_t gid)
+{
+	return gid.val;
+}
+
+/* ------------------------------ mm ----------------------------------- */
+struct vm_area_struct {
+	unsigned long vm_start;
+	unsigned long vm_end;
+	unsigned long vm_pgoff;
+	struct mm_struct *vm_mm;
+};
+
+/* There are no user page tables to walk: nothing is ever present */
+typedef struct { unsigned long pgd; } pgd_t;
+typedef struct { unsigned long pud; } pud_t;
+typedef struct { unsigned long pmd; } pmd_t;
+typedef struct { unsigned long pte; } pte_t;
+extern pgd_t kshim_empty_pgd;
+#define pgd_offset(mm, address)		(&kshim_empty_pgd)
+#define pud_offset(pgd, address)	((pud_t *)(pgd))
+#define pmd_offset(pud, address)	((pmd_t *)(pud))
+#define pte_offset_map(pmd, address)	((pte_t *)(pmd))
+#define pgd_present(x)			((x).pgd != 0)
+#define pud_present(x)			((x).pud != 0)
+#define pmd_present(x)			((x).pmd != 0)
+#define pte_present(x)			((x).pte != 0)
+#define pte_dirty(x)			0
+
+/* No struct pages behind the mapping: every block lands on node 0 */
+static inline int pfn_valid(unsigned long pfn) { return 0; }
+static inline int pfn_to_nid(unsigned long pfn) { return 0; }
+
+int vm_munmap_page(struct mm_struct *mm, unsigned long start, size_t len);
+
+void *request_mem_region_exclusive(unsigned long start, unsigned long n,
+		const char *name);
+void release_mem_region(unsigned long start, unsigned long n);
+void *ioremap_cache(unsigned long phys_addr, unsigned long size);
+void iounmap(void *addr);
+
+/* --------------------------- module glue ----------------------------- */
+struct bio;
+struct bio_set;
+struct block_device;
+struct request_queue;
+struct gendisk;
+
+#define THIS_MODULE	NULL
+#define module_param(name, type, perm)
+#define MODULE_PARM_DESC(name, desc)
+#define MODULE_AUTHOR(x)
+#define MODULE_LICENSE(x)
+#define module_init(x)
+#define module_exit(x)
+#define EXPORT_SYMBOL(x)
+
+/* Set up the shim; pm_path selects a file to back the PM region */
+void kshim_init(const char *pm_path);
+void kshim_set_cpu(int cpu);
+
+#endif